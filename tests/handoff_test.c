@@ -0,0 +1,232 @@
+/* See LICENSE for licence details. */
+/* handoff payload: sessions round trip, truncated and corrupt payload */
+#include "test.h"
+
+struct handoff_test_t {
+	struct terminal_t term[2]; /* sessions of old process */
+	uint32_t id[2];
+	pid_t pid[2];
+	const char *pending[2];    /* outq: input not written to child yet */
+	struct outq_t payload;
+};
+
+bool handoff_test_session(struct outq_t *payload, uint32_t id, pid_t pid,
+	const char *pending, const uint8_t *snap, size_t size)
+{
+	/* same layout as handoff_send() */
+	return outq_varint(payload, id) && outq_varint(payload, pid)
+		&& outq_varint(payload, strlen(pending)) && outq_push(payload, pending, strlen(pending))
+		&& outq_varint(payload, size) && outq_push(payload, snap, size);
+}
+
+bool handoff_test_init(struct handoff_test_t *t)
+{
+	struct outq_t snap = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	bool ok = true;
+
+	memset(t, 0, sizeof(struct handoff_test_t));
+	t->id[0] = 7;
+	t->id[1] = 9;
+	t->pid[0] = 1234;
+	t->pid[1] = 5678;
+	t->pending[0] = "ls -l\r";
+	t->pending[1] = "";
+
+	if (!test_term(&t->term[0], TEST_COLS, TEST_LINES) || !test_term(&t->term[1], 100, 30))
+		return false;
+	test_fill(&t->term[0], 1);
+	test_fill(&t->term[1], 2);
+	test_feed(&t->term[1], "\033[?1049h\033[5;5Halternate");
+
+	for (int i = 0; i < 2 && ok; i++) {
+		snap.head = snap.len = 0;
+		ok = snapshot_encode(&t->term[i], &snap)
+			&& handoff_test_session(&t->payload, t->id[i], t->pid[i], t->pending[i], snap.buf, snap.len);
+	}
+	free(snap.buf);
+	return ok;
+}
+
+void handoff_test_die(struct handoff_test_t *t)
+{
+	term_die(&t->term[0]);
+	term_die(&t->term[1]);
+	free(t->payload.buf);
+}
+
+struct session_t *handoff_test_decode(struct session_mgr_t *mgr, const uint8_t **ptr, const uint8_t *end)
+{
+	/* master fd: /dev/null (closed by handoff_release()) */
+	int fd;
+	struct session_t *session;
+
+	if ((fd = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0)
+		return NULL;
+	if ((session = handoff_session(mgr, fd, ptr, end)) == NULL)
+		close(fd);
+	return session;
+}
+
+void test_round_trip(void)
+{
+	const uint8_t *ptr, *end;
+	struct session_t *session[3];
+	struct session_mgr_t mgr;
+	struct handoff_test_t t;
+
+	CHECK(handoff_test_init(&t));
+	CHECK(mgr_init(&mgr, NULL, NULL));
+
+	ptr = t.payload.buf;
+	end = t.payload.buf + t.payload.len;
+	for (int i = 0; i < 2; i++) {
+		CHECK((session[i] = handoff_test_decode(&mgr, &ptr, end)) != NULL);
+		if (!session[i])
+			continue;
+		CHECK(session[i]->id == t.id[i] && session[i]->pid == t.pid[i]);
+		CHECK(mgr_lookup(&mgr, t.id[i]) == session[i]);
+		CHECK(test_same(&t.term[i], session[i]->term));
+		CHECK(outq_pending(&session[i]->term->outq) == strlen(t.pending[i]));
+		CHECK(strlen(t.pending[i]) == 0 || memcmp(session[i]->term->outq.buf
+			+ session[i]->term->outq.head, t.pending[i], strlen(t.pending[i])) == 0);
+	}
+	CHECK(ptr == end);
+	CHECK(mgr.count == 2);
+
+	/* id already in use: new id is assigned */
+	ptr = t.payload.buf;
+	CHECK((session[2] = handoff_test_decode(&mgr, &ptr, end)) != NULL);
+	CHECK(session[2] && session[2]->id != t.id[0] && session[2]->id != t.id[1]);
+	CHECK(mgr.count == 3);
+
+	for (int i = 0; i < 3; i++) {
+		if (session[i])
+			handoff_release(&mgr, session[i], false);
+	}
+	CHECK(mgr.count == 0);
+
+	mgr_die(&mgr);
+	handoff_test_die(&t);
+}
+
+void test_range_checks(void)
+{
+	/* lengths beyond payload and snapshot of impossible size: refused, mgr untouched */
+	struct {
+		int index;    /* varint of snapshot (grid_encode_state() header) */
+		uint64_t value;
+	} cases[] = {
+		{ 0, 0 },                       /* cols */
+		{ 1, 0 },                       /* lines */
+		{ 0, (uint64_t) USHRT_MAX + 1 },
+		{ 1, (uint64_t) USHRT_MAX + 1 },
+		{ 2, TEST_COLS },               /* cursor.x: refused by snapshot_decode() */
+	};
+	const uint8_t *ptr;
+	struct session_mgr_t mgr;
+	struct terminal_t term;
+	struct outq_t snap    = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t patch   = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t payload = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(mgr_init(&mgr, NULL, NULL));
+	CHECK(test_term(&term, TEST_COLS, TEST_LINES));
+	test_fill(&term, 3);
+	CHECK(snapshot_encode(&term, &snap));
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		CHECK(test_patch_varint(snap.buf, snap.len, cases[i].index, cases[i].value, &patch));
+		payload.head = payload.len = 0;
+		CHECK(handoff_test_session(&payload, 1, 1, "", patch.buf, patch.len));
+		ptr = payload.buf;
+		CHECK(handoff_test_decode(&mgr, &ptr, payload.buf + payload.len) == NULL);
+		CHECK(mgr.count == 0);
+	}
+
+	/* outq and snapshot length larger than the rest of payload */
+	payload.head = payload.len = 0;
+	CHECK(handoff_test_session(&payload, 1, 1, "abc", snap.buf, snap.len));
+	CHECK(test_patch_varint(payload.buf, payload.len, 2, payload.len, &patch));
+	ptr = patch.buf;
+	CHECK(handoff_test_decode(&mgr, &ptr, patch.buf + patch.len) == NULL);
+	CHECK(test_patch_varint(payload.buf, payload.len, 3, snap.len + 1, &patch)); /* varint after "abc" */
+	ptr = patch.buf;
+	CHECK(handoff_test_decode(&mgr, &ptr, patch.buf + patch.len) == NULL);
+	CHECK(mgr.count == 0);
+
+	mgr_die(&mgr);
+	term_die(&term);
+	free(snap.buf);
+	free(patch.buf);
+	free(payload.buf);
+}
+
+void test_truncated(void)
+{
+	/* every proper prefix of a session is refused */
+	const uint8_t *ptr, *end;
+	struct session_t *session;
+	struct session_mgr_t mgr;
+	struct handoff_test_t t;
+
+	CHECK(handoff_test_init(&t));
+	CHECK(mgr_init(&mgr, NULL, NULL));
+
+	/* end of first session */
+	ptr = t.payload.buf;
+	CHECK((session = handoff_test_decode(&mgr, &ptr, t.payload.buf + t.payload.len)) != NULL);
+	if (session)
+		handoff_release(&mgr, session, false);
+	end = ptr;
+
+	for (const uint8_t *cut = t.payload.buf; cut < end; cut++) {
+		ptr = t.payload.buf;
+		CHECK(handoff_test_decode(&mgr, &ptr, cut) == NULL);
+		CHECK(ptr <= cut);
+		CHECK(mgr.count == 0);
+	}
+
+	mgr_die(&mgr);
+	handoff_test_die(&t);
+}
+
+void test_corrupted(void)
+{
+	/* any result is fine, but decoded sessions are sane and payload is never overrun */
+	uint32_t seed = 9;
+	uint8_t *copy;
+	const uint8_t *ptr, *end;
+	struct session_t *session;
+	struct session_mgr_t mgr;
+	struct handoff_test_t t;
+
+	CHECK(handoff_test_init(&t));
+	CHECK(mgr_init(&mgr, NULL, NULL));
+	CHECK((copy = malloc(t.payload.len)) != NULL);
+
+	for (int i = 0; i < TEST_CORRUPT && copy; i++) {
+		memcpy(copy, t.payload.buf, t.payload.len);
+		test_corrupt(copy, t.payload.len, &seed);
+		ptr = copy;
+		end = copy + t.payload.len;
+		while (ptr < end && (session = handoff_test_decode(&mgr, &ptr, end)) != NULL) {
+			CHECK(ptr <= end);
+			CHECK(test_sane(session->term));
+			handoff_release(&mgr, session, false);
+		}
+		CHECK(mgr.count == 0);
+	}
+
+	free(copy);
+	mgr_die(&mgr);
+	handoff_test_die(&t);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_range_checks();
+	test_truncated();
+	test_corrupted();
+	return test_result("handoff_test");
+}
@@ -0,0 +1,272 @@
+/* See LICENSE for licence details. */
+/* recording: blocks and keyframe index round trip, truncated and corrupt files */
+#include "test.h"
+#include <sys/resource.h>
+
+enum {
+	RECORD_SMALL = 32 * 1024,                  /* input of recording for corrupt copies */
+	RECORD_LARGE = 3 * REC_KEYFRAME_BYTES + 1, /* input of recording with several keyframes */
+};
+
+struct record_test_t {
+	char path[BUFSIZE];
+	uint8_t *buf;       /* whole recording */
+	size_t size;
+	struct terminal_t term; /* recorded terminal (final state) */
+};
+
+void record_feed(struct terminal_t *term, size_t bytes, uint32_t seed)
+{
+	/* colored lines: each call of parse() ends at clean parser state */
+	char buf[BUFSIZE];
+	int len;
+
+	for (size_t total = 0; total < bytes; total += len) {
+		len = snprintf(buf, BUFSIZE, "\033[%u;%um%08x \xe3\x81\x82 %u\033[0m\033[K\r\n",
+			30 + test_rand(&seed) % 8, 40 + test_rand(&seed) % 8, test_rand(&seed), test_rand(&seed) % 1000);
+		parse(term, (uint8_t *) buf, len);
+	}
+}
+
+bool record_test_init(struct record_test_t *t, size_t bytes, uint32_t seed)
+{
+	int fd;
+	struct stat st;
+
+	memset(t, 0, sizeof(struct record_test_t));
+	snprintf(t->path, sizeof(t->path), "/tmp/record_test.%d", getpid());
+	if (!test_term(&t->term, TEST_COLS, TEST_LINES))
+		return false;
+	test_fill(&t->term, seed);
+
+	if (!rec_open(&t->term, t->path))
+		return false;
+	record_feed(&t->term, bytes, seed);
+	rec_close(&t->term);
+
+	if ((fd = open(t->path, O_RDONLY)) < 0 || fstat(fd, &st) < 0
+		|| (t->buf = malloc(st.st_size)) == NULL
+		|| read(fd, t->buf, st.st_size) != st.st_size) {
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	close(fd);
+	t->size = st.st_size;
+	return true;
+}
+
+void record_test_die(struct record_test_t *t)
+{
+	unlink(t->path);
+	free(t->buf);
+	term_die(&t->term);
+}
+
+bool record_test_write(struct record_test_t *t, const uint8_t *buf, size_t size)
+{
+	int fd;
+	bool ret;
+
+	if ((fd = open(t->path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		return false;
+	ret = rec_write_all(fd, buf, size);
+	close(fd);
+	return ret;
+}
+
+bool record_index_valid(struct player_t *player)
+{
+	/* every index entry: keyframe block before end of events, sorted by time */
+	struct rec_block_header_t header;
+
+	for (int i = 0; i < player->index_count; i++) {
+		if (player->index[i].offset < player->data || player->index[i].offset >= player->end
+			|| !player_block(player, player->index[i].offset, &header)
+			|| header.type != REC_KEYFRAME || header.next > player->end
+			|| (i > 0 && player->index[i].time < player->index[i - 1].time))
+			return false;
+	}
+	return true;
+}
+
+void test_round_trip(void)
+{
+	struct record_test_t t;
+	struct player_t player;
+	struct terminal_t term;
+
+	CHECK(record_test_init(&t, RECORD_LARGE, 1));
+	CHECK(test_term(&term, TEST_COLS, TEST_LINES));
+	CHECK(player_open(&player, t.path));
+
+	/* index from footer: first keyframe at rec_open(), then one per REC_KEYFRAME_BYTES (before next input) */
+	CHECK(player.index_count >= RECORD_LARGE / REC_KEYFRAME_BYTES);
+	CHECK(record_index_valid(&player));
+	CHECK(player.end < player.size);
+
+	CHECK(player_seek(&player, &term, UINT64_MAX));
+	CHECK(test_same(&t.term, &term));
+
+	/* back to each keyframe, then to the end again */
+	for (int i = player.index_count - 1; i >= 0; i--) {
+		CHECK(player_seek(&player, &term, player.index[i].time));
+		CHECK(test_sane(&term));
+	}
+	CHECK(player_seek(&player, &term, UINT64_MAX));
+	CHECK(test_same(&t.term, &term));
+	player_close(&player);
+
+	/* terminal of another size is refused */
+	term_die(&term);
+	CHECK(test_term(&term, TEST_COLS + 1, TEST_LINES));
+	CHECK(player_open(&player, t.path));
+	CHECK(!player_seek(&player, &term, UINT64_MAX));
+	player_close(&player);
+
+	term_die(&term);
+	record_test_die(&t);
+}
+
+void test_truncated(void)
+{
+	/* recording cut at a block boundary or inside a block: index is rebuilt by scan */
+	int fd;
+	size_t pos;
+	struct record_test_t t;
+	struct player_t player;
+	struct terminal_t term;
+	struct rec_block_header_t header;
+	struct outq_t cuts = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(record_test_init(&t, RECORD_LARGE, 2));
+	CHECK(test_term(&term, TEST_COLS, TEST_LINES));
+
+	/* lengths in descending order: file is truncated in place */
+	CHECK(player_open(&player, t.path));
+	for (pos = player.data; player_block(&player, pos, &header); pos = header.next) {
+		size_t len[] = { pos, pos + 1, header.payload, header.next - 1 };
+		outq_push(&cuts, len, sizeof(len));
+	}
+	player_close(&player);
+	CHECK(pos == t.size - 12); /* footer */
+
+	CHECK((fd = open(t.path, O_WRONLY)) >= 0);
+	for (size_t i = cuts.len / sizeof(size_t); i-- > 0;) {
+		size_t len = ((size_t *) cuts.buf)[i];
+
+		CHECK(ftruncate(fd, len) == 0);
+		CHECK(player_open(&player, t.path));
+		CHECK(player.index_count <= 1 + RECORD_LARGE / REC_KEYFRAME_BYTES);
+		CHECK(record_index_valid(&player));
+		/* replay only from the last keyframe (cheap) */
+		if (player.index_count > 0)
+			CHECK(player_seek(&player, &term, player.index[player.index_count - 1].time));
+		CHECK(test_sane(&term));
+		player_close(&player);
+	}
+	close(fd);
+
+	/* shorter than header */
+	for (size_t len = 0; len < 8; len++) {
+		CHECK(record_test_write(&t, t.buf, len));
+		if (player_open(&player, t.path)) {
+			CHECK(player.index_count == 0);
+			player_close(&player);
+		}
+	}
+
+	free(cuts.buf);
+	term_die(&term);
+	record_test_die(&t);
+}
+
+void test_corrupted(void)
+{
+	/* any result is fine, but index stays valid and terminal stays usable */
+	uint32_t seed = 3;
+	uint8_t *copy;
+	struct record_test_t t;
+	struct player_t player;
+	struct terminal_t term;
+
+	CHECK(record_test_init(&t, RECORD_SMALL, 4));
+	CHECK(test_term(&term, TEST_COLS, TEST_LINES));
+	CHECK((copy = malloc(t.size)) != NULL);
+
+	for (int i = 0; i < TEST_CORRUPT && copy; i++) {
+		memcpy(copy, t.buf, t.size);
+		test_corrupt(copy, t.size, &seed);
+		CHECK(record_test_write(&t, copy, t.size));
+		if (!player_open(&player, t.path))
+			continue;
+		player_seek(&player, &term, UINT64_MAX);
+		CHECK(test_sane(&term));
+		player_close(&player);
+	}
+
+	free(copy);
+	term_die(&term);
+	record_test_die(&t);
+}
+
+void test_write_failure(void)
+{
+	/* rec_write_block(): block that couldn't be written is neither indexed nor left in file */
+	struct stat st;
+	struct rlimit old, limit;
+	struct recorder_t rec;
+	struct record_test_t t;
+	struct player_t player;
+	struct outq_t keyframe = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	uint8_t header[] = { 'Y', 'R', 'E', 'C', REC_VERSION, TEST_COLS, TEST_LINES, 0 };
+
+	CHECK(record_test_init(&t, 0, 5));
+	CHECK(grid_encode(&t.term, &keyframe));
+
+	memset(&rec, 0, sizeof(struct recorder_t));
+	CHECK((rec.fd = open(t.path, O_RDWR | O_CREAT | O_TRUNC, 0600)) >= 0);
+	CHECK(rec_write_all(rec.fd, header, sizeof(header)));
+	rec.offset = sizeof(header);
+
+	rec_write_block(&rec, REC_KEYFRAME, 1, keyframe.buf, keyframe.len);
+	CHECK(rec.index_count == 1 && rec.index[0].offset == sizeof(header));
+
+	/* file size limit in the middle of the next keyframe */
+	signal(SIGXFSZ, SIG_IGN);
+	CHECK(getrlimit(RLIMIT_FSIZE, &old) == 0);
+	limit = old;
+	limit.rlim_cur = rec.offset + 16;
+	CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+	rec_write_block(&rec, REC_KEYFRAME, 2, keyframe.buf, keyframe.len);
+	CHECK(rec.index_count == 1);
+	CHECK(fstat(rec.fd, &st) == 0 && (size_t) st.st_size == rec.offset);
+
+	CHECK(setrlimit(RLIMIT_FSIZE, &old) == 0);
+	signal(SIGXFSZ, SIG_DFL);
+
+	/* next keyframe starts where the index expects it */
+	rec_write_block(&rec, REC_KEYFRAME, 3, keyframe.buf, keyframe.len);
+	CHECK(rec.index_count == 2);
+	close(rec.fd);
+
+	CHECK(player_open(&player, t.path));
+	CHECK(player.index_count == 2 && record_index_valid(&player));
+	CHECK(player.index[0].offset == rec.index[0].offset && player.index[1].offset == rec.index[1].offset);
+	player_close(&player);
+
+	free(rec.index);
+	free(rec.scratch);
+	free(keyframe.buf);
+	record_test_die(&t);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_truncated();
+	test_corrupted();
+	test_write_failure();
+	return test_result("record_test");
+}
@@ -0,0 +1,152 @@
+/* See LICENSE for licence details. */
+/* snapshot_encode() / snapshot_decode(): round trip, truncated and corrupt body */
+#include "test.h"
+
+void test_round_trip(void)
+{
+	struct terminal_t a, b, c;
+	struct outq_t snap = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(test_term(&a, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&b, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&c, 40, 10));
+	test_fill(&a, 1);
+
+	/* inside an escape sequence and a UTF-8 sequence: parsing continues where it stopped */
+	test_feed(&a, "\033[3");
+	CHECK(snapshot_encode(&a, &snap));
+	CHECK(snapshot_decode(&b, snap.buf, snap.len));
+	CHECK(test_same(&a, &b));
+	CHECK(b.scroll.top == a.scroll.top && b.scroll.bottom == a.scroll.bottom);
+	CHECK(b.esc.state == a.esc.state && b.esc.bp - b.esc.buf == a.esc.bp - a.esc.buf);
+
+	test_feed(&a, "1mred \xe3\x81");
+	test_feed(&b, "1mred \xe3\x81");
+	snap.len = 0;
+	CHECK(snapshot_encode(&a, &snap));
+	CHECK(snapshot_decode(&b, snap.buf, snap.len));
+	test_feed(&a, "\x86 done");
+	test_feed(&b, "\x86 done");
+	CHECK(test_same(&a, &b));
+
+	/* terminal of another size is re-initialized to the snapshot size */
+	CHECK(snapshot_decode(&c, snap.buf, snap.len));
+	test_feed(&c, "\x86 done");
+	CHECK(test_same(&a, &c));
+
+	free(snap.buf);
+	term_die(&a);
+	term_die(&b);
+	term_die(&c);
+}
+
+void test_range_checks(void)
+{
+	/* grid_decode_state(): rejected state leaves term untouched */
+	struct {
+		int index;    /* varint of grid state header */
+		uint64_t value;
+	} cases[] = {
+		{ 2, TEST_COLS },      /* cursor.x */
+		{ 3, TEST_LINES },     /* cursor.y */
+		{ 11, TEST_COLS },     /* saved cursor.x */
+		{ 12, TEST_LINES },    /* saved cursor.y */
+		{ 4, TEST_LINES - 1 }, /* scroll.top > scroll.bottom */
+		{ 5, TEST_LINES },     /* scroll.bottom */
+	};
+	struct terminal_t a, b, keep;
+	struct outq_t snap  = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t patch = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(test_term(&a, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&b, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&keep, TEST_COLS, TEST_LINES));
+	test_fill(&a, 2);
+	test_fill(&b, 3);
+	test_fill(&keep, 3);
+	test_feed(&a, "\033[1;10r");
+	CHECK(snapshot_encode(&a, &snap));
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		CHECK(test_patch_varint(snap.buf, snap.len, cases[i].index, cases[i].value, &patch));
+		CHECK(!snapshot_decode(&b, patch.buf, patch.len));
+		CHECK(test_same(&b, &keep));
+		CHECK(test_sane(&b));
+	}
+
+	/* zero size and size out of range: refused before term is touched */
+	CHECK(test_patch_varint(snap.buf, snap.len, 0, 0, &patch));
+	CHECK(!snapshot_decode(&b, patch.buf, patch.len));
+	CHECK(test_patch_varint(snap.buf, snap.len, 1, (uint64_t) USHRT_MAX + 1, &patch));
+	CHECK(!snapshot_decode(&b, patch.buf, patch.len));
+	CHECK(test_same(&b, &keep));
+
+	free(snap.buf);
+	free(patch.buf);
+	term_die(&a);
+	term_die(&b);
+	term_die(&keep);
+}
+
+void test_truncated(void)
+{
+	/* every proper prefix is rejected, term is never left half restored */
+	struct terminal_t a, b;
+	struct outq_t snap = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(test_term(&a, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&b, TEST_COLS, TEST_LINES));
+	test_fill(&a, 4);
+	CHECK(snapshot_encode(&a, &snap));
+
+	for (size_t len = 0; len < snap.len; len++) {
+		CHECK(!snapshot_decode(&b, snap.buf, len));
+		CHECK(test_sane(&b));
+	}
+	CHECK(snapshot_decode(&b, snap.buf, snap.len));
+	CHECK(test_same(&a, &b));
+
+	free(snap.buf);
+	term_die(&a);
+	term_die(&b);
+}
+
+void test_corrupted(void)
+{
+	/* any result is fine, but term stays usable */
+	uint32_t seed = 5;
+	uint8_t *copy;
+	struct terminal_t a, b;
+	struct outq_t snap = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(test_term(&a, TEST_COLS, TEST_LINES));
+	CHECK(test_term(&b, TEST_COLS, TEST_LINES));
+	test_fill(&a, 6);
+	test_feed(&a, "\033]0;title");
+	CHECK(snapshot_encode(&a, &snap));
+	CHECK((copy = malloc(snap.len)) != NULL);
+
+	for (int i = 0; i < TEST_CORRUPT && copy; i++) {
+		memcpy(copy, snap.buf, snap.len);
+		test_corrupt(copy, snap.len, &seed);
+		snapshot_decode(&b, copy, snap.len);
+		CHECK(b.arena == NULL || test_sane(&b));
+		if (!b.arena) /* re-initialization to a corrupt size failed */
+			CHECK(test_term(&b, TEST_COLS, TEST_LINES));
+		test_feed(&b, "\x07\033[5;5Habc\r\n");
+	}
+
+	free(copy);
+	free(snap.buf);
+	term_die(&a);
+	term_die(&b);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_range_checks();
+	test_truncated();
+	test_corrupted();
+	return test_result("snapshot_test");
+}
@@ -0,0 +1,218 @@
+/* See LICENSE for licence details. */
+/* state sync: SYNC_DELTA round trip, framing, truncated and corrupt deltas */
+#include "test.h"
+
+struct sync_test_t {
+	struct terminal_t term;
+	struct sync_server_t srv;
+	struct sync_client_t client;
+	struct outq_t frame;
+	char path[BUFSIZE];
+};
+
+bool sync_test_init(struct sync_test_t *t)
+{
+	uint8_t buf[2 * VARINT_MAX];
+	size_t len;
+
+	memset(t, 0, sizeof(struct sync_test_t));
+	snprintf(t->path, sizeof(t->path), "/tmp/sync_test.%d", getpid());
+	if (!test_term(&t->term, TEST_COLS, TEST_LINES))
+		return false;
+	if (!sync_init(&t->srv, &t->term, t->path)) {
+		term_die(&t->term);
+		return false;
+	}
+
+	/* SYNC_HELLO as sent by sync_hello() */
+	t->client.fd = -1;
+	len  = varint_put(buf, TEST_COLS);
+	len += varint_put(buf + len, TEST_LINES);
+	return sync_client_hello(&t->client, buf, len);
+}
+
+void sync_test_die(struct sync_test_t *t)
+{
+	sync_die(&t->srv);
+	unlink(t->path);
+	term_die(&t->term);
+	if (t->client.ready)
+		term_die(&t->client.term);
+	free(t->frame.buf);
+}
+
+bool sync_test_delta(struct sync_test_t *t, uint64_t from, const uint8_t **payload, size_t *size)
+{
+	/* encode delta from generation from and unwrap its frame */
+	uint8_t type;
+
+	sync_update(&t->srv);
+	sync_encode(&t->srv, from, &t->frame);
+	return sync_next(&t->frame, SYNC_FRAME_MAX, &type, payload, size) == 1 && type == SYNC_DELTA;
+}
+
+void test_round_trip(void)
+{
+	const uint8_t *payload;
+	size_t size;
+	struct sync_test_t t;
+
+	CHECK(sync_test_init(&t));
+
+	/* full state for a new viewer */
+	test_fill(&t.term, 1);
+	CHECK(sync_test_delta(&t, 0, &payload, &size));
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+	CHECK(t.client.gen == t.srv.gen);
+
+	/* incremental: only changed spans */
+	test_feed(&t.term, "\033[3;7Hpartial\033[12;1H\033[2K\033[41mred line");
+	CHECK(sync_test_delta(&t, t.client.gen, &payload, &size));
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+
+	/* cursor only */
+	test_feed(&t.term, "\033[20;30H");
+	CHECK(sync_test_delta(&t, t.client.gen, &payload, &size));
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+
+	sync_test_die(&t);
+}
+
+void test_framing(void)
+{
+	/* sync_next(): incomplete, empty and oversized messages */
+	uint8_t type, header[4];
+	const uint8_t *payload;
+	size_t size;
+	struct outq_t in = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t body = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	outq_varint(&body, 42);
+	CHECK(sync_frame(&in, SYNC_ACK, &body));
+	for (size_t len = 0; len < in.len; len++) {
+		struct outq_t part = in;
+		part.len = len;
+		CHECK(sync_next(&part, SYNC_ACK_MAX, &type, &payload, &size) == 0);
+	}
+	CHECK(sync_next(&in, SYNC_ACK_MAX, &type, &payload, &size) == 1);
+	CHECK(type == SYNC_ACK && size == body.len && memcmp(payload, body.buf, size) == 0);
+	CHECK(outq_pending(&in) == 0);
+
+	/* size 0 (no type byte) */
+	in.head = in.len = 0;
+	memset(header, 0, sizeof(header));
+	outq_push(&in, header, sizeof(header));
+	CHECK(sync_next(&in, SYNC_ACK_MAX, &type, &payload, &size) == -1);
+
+	/* larger than max: refused before the body arrives */
+	in.head = in.len = 0;
+	header[0] = SYNC_ACK_MAX + 1;
+	outq_push(&in, header, sizeof(header));
+	CHECK(sync_next(&in, SYNC_ACK_MAX, &type, &payload, &size) == -1);
+
+	in.head = in.len = 0;
+	for (int i = 0; i < 4; i++)
+		header[i] = 0xFF;
+	outq_push(&in, header, sizeof(header));
+	CHECK(sync_next(&in, SYNC_FRAME_MAX, &type, &payload, &size) == -1);
+
+	free(in.buf);
+	free(body.buf);
+}
+
+void test_range_checks(void)
+{
+	/* sync_client_apply(): cursor and spans outside of the grid */
+	struct {
+		int index;    /* varint of SYNC_DELTA payload */
+		uint64_t value;
+	} cases[] = {
+		{ 1, TEST_COLS },      /* cursor.x */
+		{ 2, TEST_LINES },     /* cursor.y */
+		{ 5, TEST_LINES },     /* y of first span */
+		{ 6, 1 },              /* x of first span: x + n > cols (n: full line) */
+		{ 7, TEST_COLS + 1 },  /* n of first span */
+	};
+	const uint8_t *payload;
+	size_t size;
+	struct sync_test_t t;
+	struct outq_t patch = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	CHECK(sync_test_init(&t));
+	test_fill(&t.term, 2);
+	CHECK(sync_test_delta(&t, 0, &payload, &size));
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		CHECK(test_patch_varint(payload, size, cases[i].index, cases[i].value, &patch));
+		CHECK(!sync_client_apply(&t.client, patch.buf, patch.len));
+		CHECK(test_sane(&t.client.term));
+	}
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+
+	free(patch.buf);
+	sync_test_die(&t);
+}
+
+void test_truncated(void)
+{
+	/* every proper prefix of a delta is rejected */
+	const uint8_t *payload;
+	size_t size;
+	struct sync_test_t t;
+
+	CHECK(sync_test_init(&t));
+	test_fill(&t.term, 3);
+	CHECK(sync_test_delta(&t, 0, &payload, &size));
+
+	for (size_t len = 0; len < size; len++) {
+		CHECK(!sync_client_apply(&t.client, payload, len));
+		CHECK(test_sane(&t.client.term));
+	}
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+
+	sync_test_die(&t);
+}
+
+void test_corrupted(void)
+{
+	/* any result is fine, but client grid stays in range */
+	uint32_t seed = 7;
+	uint8_t *copy;
+	const uint8_t *payload;
+	size_t size;
+	struct sync_test_t t;
+
+	CHECK(sync_test_init(&t));
+	test_fill(&t.term, 4);
+	CHECK(sync_test_delta(&t, 0, &payload, &size));
+	CHECK((copy = malloc(size)) != NULL);
+
+	for (int i = 0; i < TEST_CORRUPT && copy; i++) {
+		memcpy(copy, payload, size);
+		test_corrupt(copy, size, &seed);
+		sync_client_apply(&t.client, copy, size);
+		CHECK(test_sane(&t.client.term));
+	}
+
+	/* client recovers with the next full state */
+	CHECK(sync_client_apply(&t.client, payload, size));
+	CHECK(test_same(&t.term, &t.client.term));
+
+	free(copy);
+	sync_test_die(&t);
+}
+
+int main(void)
+{
+	test_round_trip();
+	test_framing();
+	test_range_checks();
+	test_truncated();
+	test_corrupted();
+	return test_result("sync_test");
+}
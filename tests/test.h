@@ -0,0 +1,130 @@
+/* See LICENSE for licence details. */
+/*
+	codec tests: each test is one program, yaftlib.c is included (single translation unit)
+		cc -std=gnu11 -DDEBUG=0 -pthread -o snapshot_test snapshot_test.c -lutil && ./snapshot_test
+	build with -fsanitize=address,undefined to catch out of range access on corrupt input
+	exit status: 0 if all checks passed
+*/
+#include "../yaftlib.c"
+
+enum {
+	TEST_COLS    = 80,
+	TEST_LINES   = 24,
+	TEST_CORRUPT = 2000, /* corrupted copies decoded by each test */
+};
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+static inline uint32_t test_rand(uint32_t *seed)
+{
+	/* xorshift32: same sequence on every run */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+bool test_term(struct terminal_t *term, int cols, int lines)
+{
+	/* no child: replies of parse() are discarded */
+	memset(term, 0, sizeof(struct terminal_t));
+	if (!term_init(term, cols * CELL_WIDTH, lines * CELL_HEIGHT))
+		return false;
+	term->fd = -1;
+	return true;
+}
+
+void test_feed(struct terminal_t *term, const char *str)
+{
+	parse(term, (uint8_t *) str, strlen(str));
+}
+
+void test_fill(struct terminal_t *term, uint32_t seed)
+{
+	/* colors, attributes, wide glyphs, cursor movement and scroll margins */
+	char buf[BUFSIZE];
+
+	test_feed(term, "\033[2J\033[H");
+	for (int i = 0; i < term->lines * 3; i++) {
+		snprintf(buf, BUFSIZE, "\033[%u;%um\033[%umline %d \xe3\x81\x82\xe3\x81\x84 %08x\033[0m\r\n",
+			30 + test_rand(&seed) % 8, 40 + test_rand(&seed) % 8,
+			(unsigned []) { 1, 4, 5, 7 }[test_rand(&seed) % 4], i, test_rand(&seed));
+		test_feed(term, buf);
+	}
+	snprintf(buf, BUFSIZE, "\033[%u;%ur\033[%u;%uH\0337\033[%u;%uH\033[3g\033[?25l",
+		2 + test_rand(&seed) % 4, term->lines - 1 - test_rand(&seed) % 4,
+		1 + test_rand(&seed) % term->lines, 1 + test_rand(&seed) % term->cols,
+		1 + test_rand(&seed) % term->lines, 1 + test_rand(&seed) % term->cols);
+	test_feed(term, buf);
+}
+
+bool test_same(struct terminal_t *a, struct terminal_t *b)
+{
+	/* grid and cursor */
+	if (a->cols != b->cols || a->lines != b->lines
+		|| a->cursor.x != b->cursor.x || a->cursor.y != b->cursor.y)
+		return false;
+
+	for (int y = 0; y < a->lines; y++) {
+		for (int x = 0; x < a->cols; x++) {
+			if (!cell_equal(&a->cells[y][x], &b->cells[y][x]))
+				return false;
+		}
+	}
+	return true;
+}
+
+bool test_sane(struct terminal_t *term)
+{
+	/* state every decoder must leave, even after rejecting input */
+	return term->cursor.x < term->cols && term->cursor.y < term->lines
+		&& term->state.cursor.x < term->cols && term->state.cursor.y < term->lines
+		&& term->scroll.top <= term->scroll.bottom
+		&& term->scroll.bottom < term->lines
+		&& term->esc.bp >= term->esc.buf && term->esc.bp < term->esc.buf + term->esc.size;
+}
+
+bool test_patch_varint(const uint8_t *buf, size_t size, int index, uint64_t value, struct outq_t *out)
+{
+	/* copy of buf whose index-th varint (from the start) is replaced by value */
+	const uint8_t *ptr = buf, *end = buf + size, *field;
+	uint64_t old;
+
+	for (int i = 0; i < index; i++) {
+		if (!varint_get(&ptr, end, &old))
+			return false;
+	}
+	field = ptr;
+	if (!varint_get(&ptr, end, &old))
+		return false;
+
+	out->head = out->len = 0;
+	return (field == buf || outq_push(out, buf, field - buf)) && outq_varint(out, value)
+		&& outq_push(out, ptr, end - ptr);
+}
+
+void test_corrupt(uint8_t *buf, size_t size, uint32_t *seed)
+{
+	/* flip a few bytes: some land in lengths and counts, some in cells */
+	int count = 1 + test_rand(seed) % 4;
+
+	for (int i = 0; i < count && size > 0; i++)
+		buf[test_rand(seed) % size] ^= 1 << (test_rand(seed) % BITS_PER_BYTE);
+}
+
+int test_result(const char *name)
+{
+	if (test_failures > 0) {
+		fprintf(stderr, "%s: %d check(s) failed\n", name, test_failures);
+		return EXIT_FAILURE;
+	}
+	printf("%s: ok\n", name);
+	return EXIT_SUCCESS;
+}
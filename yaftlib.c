@@ -260,6 +260,103 @@ pid_t eforkpty(int *amaster, char *name,
 	return pid;
 }
 
+pid_t espawn(int master, int slave, const char *file, char *const argv[], char *const envp[])
+{
+	/*
+		execvp() file on opened pty pair without fork():
+			posix_spawn() of glibc uses clone(CLONE_VM | CLONE_VFORK), parent's page tables
+			are never copied, so spawn time doesn't depend on the size of host process.
+			setsid() is done by POSIX_SPAWN_SETSID, then opening the slave (without O_NOCTTY)
+			as session leader makes it the controlling terminal (Linux).
+		envp: NULL means current environ
+		master and slave are kept open: caller closes slave after spawn
+	*/
+	extern char **environ;
+	pid_t pid;
+
+#if defined(__linux__) && defined(POSIX_SPAWN_SETSID)
+	int ret;
+	char name[BUFSIZE];
+	sigset_t mask;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+
+	if (ptsname_r(master, name, sizeof(name)) != 0) {
+		logging(LOG_ERROR, "ptsname_r: %s\n", strerror(errno));
+		return -1;
+	}
+	/* child must not inherit master and parent's copy of slave */
+	fcntl(master, F_SETFD, FD_CLOEXEC);
+	fcntl(slave, F_SETFD, FD_CLOEXEC);
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask); /* reactor may block SIGCHLD for signalfd */
+	sigfillset(&mask);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, name, O_RDWR, 0);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+
+	ret = posix_spawnp(&pid, file, &actions, &attr, argv, envp ? envp: environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (ret != 0) {
+		logging(LOG_ERROR, "posix_spawnp: %s\n", strerror(ret));
+		return -1;
+	}
+#else
+	/* XXX: BSD and Mac OS X need TIOCSCTTY in child, fallback to fork() */
+	errno = 0;
+	if ((pid = fork()) < 0) {
+		logging(LOG_ERROR, "fork: %s\n", strerror(errno));
+		return pid;
+	} else if (pid == 0) { /* child */
+		close(master);
+		setsid();
+
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		ioctl(slave, TIOCSCTTY, NULL);
+		close(slave);
+
+		if (envp)
+			environ = (char **) envp;
+		execvp(file, argv);
+		_exit(EXIT_FAILURE);
+	}
+#endif
+	return pid;
+}
+
+pid_t espawnpty(int *amaster, const char *file, char *const argv[], char *const envp[],
+	const struct termios *termp, const struct winsize *winsize)
+{
+	/* eforkpty() + execvp() without fork(): see espawn() */
+	int master, slave;
+	pid_t pid;
+
+	if (eopenpty(&master, &slave, NULL, termp, winsize) < 0)
+		return -1;
+
+	pid = espawn(master, slave, file, argv, envp);
+	eclose(slave);
+
+	if (pid < 0) {
+		eclose(master);
+		return -1;
+	}
+	*amaster = master;
+
+	return pid;
+}
+
 int esetenv(const char *name, const char *value, int overwrite)
 {
 	int ret;
@@ -308,6 +405,48 @@ long estrtol(const char *nptr, char **endptr, int base)
 	return ret;
 }
 
+#if defined(__linux__)
+int eepoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int ret;
+	errno = 0;
+
+	if ((ret = epoll_ctl(epfd, op, fd, event)) < 0)
+		logging(LOG_ERROR, "epoll_ctl: %s\n", strerror(errno));
+
+	return ret;
+}
+
+int eepoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	int ret;
+	errno = 0;
+
+	if ((ret = epoll_wait(epfd, events, maxevents, timeout)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		else
+			logging(LOG_ERROR, "epoll_wait: %s\n", strerror(errno));
+	}
+	return ret;
+}
+
+int epidfd_open(pid_t pid)
+{
+	int ret = -1;
+	errno = 0;
+
+#if defined(SYS_pidfd_open)
+	if ((ret = syscall(SYS_pidfd_open, pid, 0)) < 0)
+		logging(LOG_WARN, "pidfd_open: %s\n", strerror(errno));
+#else
+	(void) pid;
+	errno = ENOSYS;
+#endif
+	return ret;
+}
+#endif
+
 /* parse_arg functions */
 void reset_parm(struct parm_t *pt)
 {
@@ -433,9 +572,10 @@ void copy_cell(struct terminal_t *term, int dst_y, int dst_x, int src_y, int src
 	}
 }
 
-int set_cell(struct terminal_t *term, int y, int x, const struct glyph_t *glyphp)
+static inline struct cell_t pen_cell(struct terminal_t *term, const struct glyph_t *glyphp)
 {
-	struct cell_t cell, *cellp;
+	/* cell drawn by current color and attribute */
+	struct cell_t cell;
 	uint8_t color_tmp;
 
 	cell.glyphp = glyphp;
@@ -453,7 +593,14 @@ int set_cell(struct terminal_t *term, int y, int x, const struct glyph_t *glyphp
 
 	cell.attribute  = term->attribute;
 	cell.width      = glyphp->width;
+	return cell;
+}
+
+int set_cell(struct terminal_t *term, int y, int x, const struct glyph_t *glyphp)
+{
+	struct cell_t cell, *cellp;
 
+	cell     = pen_cell(term, glyphp);
 	cellp    = &term->cells[y][x];
 	*cellp   = cell;
 	term->line_dirty[y] = true;
@@ -494,8 +641,18 @@ void scroll_window(struct terminal_t *term, int from, int to, int offset)
 	for (int y = from; y <= to; y++)
 		term->line_dirty[y] = true;
 
+	/* offset larger than region (CSI B with large parameter at bottom): clear whole region */
 	abs_offset = abs(offset);
-	lines      = (to - from + 1) - abs_offset;
+	if (abs_offset > to - from + 1) {
+		abs_offset = to - from + 1;
+		offset     = (offset > 0) ? abs_offset: -abs_offset;
+	}
+	lines = (to - from + 1) - abs_offset;
+
+	if (offset > 0 && from == 0 && term->on_scroll_out) {
+		for (int y = from; y < from + abs_offset && y <= to; y++)
+			term->on_scroll_out(term, y);
+	}
 
 	if (offset > 0) { /* scroll down */
 		for (int y = from; y < from + lines; y++)
@@ -596,6 +753,12 @@ void add_char(struct terminal_t *term, uint32_t code)
 	move_cursor(term, 0, set_cell(term, term->cursor.y, term->cursor.x, glyphp));
 }
 
+static inline bool term_arena_owns(struct terminal_t *term, const void *ptr)
+{
+	return (const uint8_t *) term->arena <= (const uint8_t *) ptr
+		&& (const uint8_t *) ptr < (const uint8_t *) term->arena + term->arena_size;
+}
+
 void reset_esc(struct terminal_t *term)
 {
 	logging(DEBUG, "*esc reset*\n");
@@ -607,11 +770,18 @@ void reset_esc(struct terminal_t *term)
 bool push_esc(struct terminal_t *term, uint8_t ch)
 {
 	long offset;
+	char *buf;
 
 	if ((term->esc.bp - term->esc.buf) >= term->esc.size) { /* buffer limit */
 		logging(DEBUG, "escape sequence length >= %d, term.esc.buf reallocated\n", term->esc.size);
 		offset = term->esc.bp - term->esc.buf;
-		term->esc.buf = erealloc(term->esc.buf, term->esc.size * 2);
+		if (term_arena_owns(term, term->esc.buf)) { /* first time: move out of arena */
+			if ((buf = ecalloc(1, term->esc.size * 2)) != NULL)
+				memcpy(buf, term->esc.buf, term->esc.size);
+		} else {
+			buf = erealloc(term->esc.buf, term->esc.size * 2);
+		}
+		term->esc.buf = buf;
 		term->esc.bp  = term->esc.buf + offset;
 		term->esc.size *= 2;
 	}
@@ -666,6 +836,21 @@ void reset_charset(struct terminal_t *term)
 	term->charset.is_valid = true;
 }
 
+void invoke_charset(struct terminal_t *term, int g)
+{
+	struct iso2022_t *iso = &term->iso2022;
+
+	iso->gl    = g;
+	iso->table = (iso->g[g] == CHARSET_US_ASCII) ? NULL: charset_table[iso->g[g]];
+}
+
+void reset_iso2022(struct terminal_t *term)
+{
+	for (int g = 0; g < 4; g++)
+		term->iso2022.g[g] = CHARSET_US_ASCII;
+	invoke_charset(term, 0);
+}
+
 void reset(struct terminal_t *term)
 {
 	term->mode  = MODE_RESET;
@@ -681,6 +866,9 @@ void reset(struct terminal_t *term)
 	term->state.cursor    = term->cursor;
 	term->state.attribute = ATTR_RESET;
 
+	reset_iso2022(term);
+	term->state.iso2022   = term->iso2022;
+
 	term->color_pair.fg = DEFAULT_FG;
 	term->color_pair.bg = DEFAULT_BG;
 
@@ -707,57 +895,402 @@ void redraw(struct terminal_t *term)
 		term->line_dirty[i] = true;
 }
 
-void term_die(struct terminal_t *term)
+void build_pixel_palette(struct palette_t *palette)
 {
-	free(term->line_dirty);
-	free(term->tabstop);
-	free(term->esc.buf);
+	uint32_t color;
+	uint8_t r, g, b;
+	struct pixel_palette_t *pp = &palette->pixel_palette;
+
+	/* convert palette once here, consumers never convert per pixel */
+	for (int i = 0; i < COLORS; i++) {
+		color = palette->virtual_palette[i];
+		r = (color >> 16) & bit_mask[8];
+		g = (color >>  8) & bit_mask[8];
+		b = (color >>  0) & bit_mask[8];
+
+		pp->bpp32[i]    = color & bit_mask[24];
+		pp->bpp24[i][0] = b;
+		pp->bpp24[i][1] = g;
+		pp->bpp24[i][2] = r;
+		pp->bpp16[i]    = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+	}
+}
 
-	for (int i = 0; i < term->lines; i++)
-		free(term->cells[i]);
-	free(term->cells);
+void update_pixel_palette(struct terminal_t *term)
+{
+	/* default_palette is converted only once by shared_init() */
+	if (term->palette)
+		build_pixel_palette(term->palette);
+	term->palette_pending = false;
 }
 
-bool term_init(struct terminal_t *term, int width, int height)
+void share_palette(struct terminal_t *term)
+{
+	free(term->palette);
+	term->palette          = NULL;
+	term->virtual_palette  = default_palette.virtual_palette;
+	term->pixel_palette    = &default_palette.pixel_palette;
+	term->palette_modified = false;
+}
+
+bool unshare_palette(struct terminal_t *term)
+{
+	/* copy on write: called before changing palette entry */
+	if (term->palette)
+		return true;
+
+	if ((term->palette = ecalloc(1, sizeof(struct palette_t))) == NULL)
+		return false;
+	*term->palette        = default_palette;
+	term->virtual_palette = term->palette->virtual_palette;
+	term->pixel_palette   = &term->palette->pixel_palette;
+	return true;
+}
+
+void shared_init(void)
 {
+	/* state which never changes after init: built once for all terminals (pthread_once()) */
 	extern const uint32_t color_list[COLORS]; /* global */
 
-	term->width  = width;
-	term->height = height;
+	for (uint32_t code = 0; code < UCS2_CHARS; code++)
+		glyph_index[code] = NULL;
 
-	term->cols  = term->width / CELL_WIDTH;
-	term->lines = term->height / CELL_HEIGHT;
+	for (uint32_t gi = 0; gi < sizeof(glyphs) / sizeof(struct glyph_t); gi++)
+		glyph_index[glyphs[gi].code] = &glyphs[gi];
 
-	term->esc.size = ESCSEQ_SIZE;
+	for (int i = 0; i < COLORS; i++)
+		default_palette.virtual_palette[i] = color_list[i];
+	build_pixel_palette(&default_palette);
+}
 
-	logging(DEBUG, "terminal cols:%d lines:%d\n", term->cols, term->lines);
+size_t outq_pending(struct outq_t *outq)
+{
+	return outq->len - outq->head;
+}
 
-	/* allocate memory */
-	term->line_dirty   = (bool *) ecalloc(term->lines, sizeof(bool));
-	term->tabstop      = (bool *) ecalloc(term->cols, sizeof(bool));
-	term->esc.buf      = (char *) ecalloc(1, term->esc.size);
+bool outq_push(struct outq_t *outq, const void *buf, size_t size)
+{
+	uint8_t *new_buf;
+	size_t new_size;
 
-	term->cells        = (struct cell_t **) ecalloc(term->lines, sizeof(struct cell_t *));
-	for (int i = 0; i < term->lines; i++)
-		term->cells[i] = (struct cell_t *) ecalloc(term->cols, sizeof(struct cell_t));
+	if (outq->len + size > outq->size && outq->head > 0) { /* compaction */
+		memmove(outq->buf, outq->buf + outq->head, outq->len - outq->head);
+		outq->len -= outq->head;
+		outq->head = 0;
+	}
 
-	if (!term->line_dirty || !term->tabstop
-		|| !term->cells || !term->esc.buf) {
-		term_die(term);
+	if (outq->len + size > outq->size) {
+		new_size = outq->size ? outq->size: BUFSIZE;
+		while (new_size < outq->len + size)
+			new_size *= 2;
+		if ((new_buf = erealloc(outq->buf, new_size)) == NULL)
+			return false;
+		outq->buf  = new_buf;
+		outq->size = new_size;
+	}
+	memcpy(outq->buf + outq->len, buf, size);
+	outq->len += size;
+
+	return true;
+}
+
+void term_check_outq(struct terminal_t *term)
+{
+	/* backpressure: input is accepted again once outq is drained to OUTQ_LIMIT / 2 */
+	if (outq_pending(&term->outq) <= OUTQ_LIMIT / 2)
+		term->outq_full = false;
+}
+
+ssize_t term_flush(struct terminal_t *term)
+{
+	/* write queued data without blocking: return remaining bytes, -1 on error */
+	ssize_t ret;
+	struct outq_t *outq = &term->outq;
+
+	while (outq_pending(outq) > 0) {
+		errno = 0;
+		if ((ret = write(term->fd, outq->buf + outq->head, outq_pending(outq))) < 0) {
+			if (errno == EINTR)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			logging(LOG_ERROR, "write: %s\n", strerror(errno));
+			outq->head = outq->len = 0; /* child never reads: drop queue */
+			return -1;
+		}
+		outq->head += ret;
+	}
+
+	if (outq_pending(outq) == 0)
+		outq->head = outq->len = 0;
+	term_check_outq(term);
+
+	return outq_pending(outq);
+}
+
+bool term_queue(struct terminal_t *term, const void *buf, size_t size)
+{
+	/* queue is bounded by OUTQ_LIMIT: set outq_full and drop if exceeded */
+	if (outq_pending(&term->outq) + size > OUTQ_LIMIT) {
+		logging(LOG_WARN, "output queue full: %zu bytes dropped\n", size);
+		term->outq_full = true;
 		return false;
 	}
+	return outq_push(&term->outq, buf, size);
+}
 
-	/* initialize palette */
-	for (int i = 0; i < COLORS; i++)
-		term->virtual_palette[i] = color_list[i];
-	term->palette_modified = false;
+ssize_t term_write(struct terminal_t *term, const void *buf, size_t size)
+{
+	/*
+		reply or input to child: never blocks, never sleeps
+			- write() immediately only if nothing is queued (keep order)
+			- rest is queued and flushed when master becomes writable
+			- queue is bounded by OUTQ_LIMIT: returns -1 (EAGAIN) and set outq_full
+			- once full, refused until drained below OUTQ_LIMIT / 2 (replies are not)
+	*/
+	ssize_t ret;
+	size_t written = 0;
 
-	/* initialize glyph map */
-	for (uint32_t code = 0; code < UCS2_CHARS; code++)
-		term->glyph[code] = NULL;
+	if (term->outq_full) {
+		errno = EAGAIN;
+		return -1;
+	}
 
-	for (uint32_t gi = 0; gi < sizeof(glyphs) / sizeof(struct glyph_t); gi++)
-		term->glyph[glyphs[gi].code] = &glyphs[gi];
+	if (!term->defer_write && outq_pending(&term->outq) == 0) {
+		do {
+			errno = 0;
+			ret = write(term->fd, buf, size);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			logging(LOG_ERROR, "write: %s\n", strerror(errno));
+			return ret;
+		}
+		written = (ret > 0) ? ret: 0;
+		if (written == size)
+			return written;
+	}
+
+	if (!term_queue(term, (uint8_t *) buf + written, size - written)) {
+		if (written > 0)
+			return written;
+		errno = EAGAIN;
+		return -1;
+	}
+	return size;
+}
+
+/* replies: formatted into term->reply, written by reply_flush() */
+char *fmt_str(char *dst, const char *str)
+{
+	while (*str)
+		*dst++ = *str++;
+	return dst;
+}
+
+char *fmt_dec(char *dst, unsigned num)
+{
+	char tmp[sizeof("4294967295")], *cp = tmp;
+
+	do {
+		*cp++ = '0' + (num % 10);
+		num /= 10;
+	} while (num > 0);
+
+	while (cp > tmp)
+		*dst++ = *--cp;
+	return dst;
+}
+
+char *fmt_hex(char *dst, unsigned num, int digits)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	for (int i = digits - 1; i >= 0; i--)
+		*dst++ = hex[(num >> (i * 4)) & 0x0F];
+	return dst;
+}
+
+void reply_flush(struct terminal_t *term)
+{
+	/* write queued data and replies by one writev(): rest goes to outq */
+	int iovcnt = 0;
+	ssize_t ret;
+	size_t pending, written;
+	struct iovec iov[2];
+	struct reply_t *reply = &term->reply;
+
+	if (reply->len == 0)
+		return;
+
+	pending = outq_pending(&term->outq);
+	if (term->defer_write) {
+		term_queue(term, reply->buf, reply->len);
+		reply->len = 0;
+		return;
+	}
+
+	if (pending > 0) {
+		iov[iovcnt].iov_base = term->outq.buf + term->outq.head;
+		iov[iovcnt].iov_len  = pending;
+		iovcnt++;
+	}
+	iov[iovcnt].iov_base = reply->buf;
+	iov[iovcnt].iov_len  = reply->len;
+	iovcnt++;
+
+	do {
+		errno = 0;
+		ret = writev(term->fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		logging(LOG_ERROR, "writev: %s\n", strerror(errno));
+		reply->len = 0;
+		return;
+	}
+	written = (ret > 0) ? ret: 0;
+
+	if (written >= pending) {
+		term->outq.head = term->outq.len = 0;
+		written -= pending;
+		if (written < (size_t) reply->len)
+			term_queue(term, reply->buf + written, reply->len - written);
+	} else {
+		term->outq.head += written;
+		term_queue(term, reply->buf, reply->len);
+	}
+	reply->len = 0;
+	term_check_outq(term);
+}
+
+char *reply_begin(struct terminal_t *term, int size)
+{
+	/* return space for a reply up to size bytes: commit by reply_end() */
+	if (term->reply.len + size > REPLY_SIZE)
+		reply_flush(term);
+	return term->reply.buf + term->reply.len;
+}
+
+void reply_end(struct terminal_t *term, char *end)
+{
+	term->reply.len = end - term->reply.buf;
+}
+
+void term_reply(struct terminal_t *term, const char *str, int size)
+{
+	char *cp = reply_begin(term, size);
+
+	memcpy(cp, str, size);
+	reply_end(term, cp + size);
+}
+
+size_t term_layout(struct terminal_t *term, uint8_t *base)
+{
+	/*
+		fixed-size storage of term in one arena: return its size (base: NULL to compute only)
+			cells (line pointers) | cell_t (lines * cols) | line_dirty | tabstop | esc.buf
+	*/
+	size_t rows, dirty, tabstop, esc;
+
+	rows    = sizeof(struct cell_t *) * term->lines;
+	rows    = (rows + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	dirty   = rows + sizeof(struct cell_t) * term->cols * term->lines;
+	tabstop = dirty + sizeof(bool) * term->lines;
+	esc     = tabstop + sizeof(bool) * term->cols;
+
+	if (base) {
+		term->cells = (struct cell_t **) base;
+		for (int i = 0; i < term->lines; i++)
+			term->cells[i] = (struct cell_t *) (base + rows) + term->cols * i;
+		term->line_dirty = (bool *) (base + dirty);
+		term->tabstop    = (bool *) (base + tabstop);
+		term->esc.buf    = (char *) (base + esc);
+	}
+	return esc + term->esc.size;
+}
+
+void *arena_alloc(size_t *size, bool *mapped)
+{
+	/* zero filled: large one is backed by transparent huge pages (size is rounded up) */
+	*mapped = false;
+#if defined(MADV_HUGEPAGE)
+	if (HUGE_PAGE_ARENA && *size >= HUGE_PAGE_SIZE) {
+		void *ptr;
+		size_t len = (*size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+
+		if ((ptr = emmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED) {
+			if (madvise(ptr, len, MADV_HUGEPAGE) < 0) /* not fatal: small pages */
+				logging(LOG_DEBUG, "madvise: %s\n", strerror(errno));
+			*size   = len;
+			*mapped = true;
+			return ptr;
+		}
+	}
+#endif
+	return ecalloc(1, *size);
+}
+
+void arena_free(void *ptr, size_t size, bool mapped)
+{
+	if (mapped)
+		emunmap(ptr, size);
+	else
+		free(ptr);
+}
+
+void term_die(struct terminal_t *term)
+{
+	/* safe to call twice, or after term_init() failed */
+	free(term->palette);
+	term->palette = NULL;
+	free(term->outq.buf);
+	term->outq.buf = NULL;
+
+	if (!term_arena_owns(term, term->esc.buf)) /* grown by push_esc() */
+		free(term->esc.buf);
+	if (term->arena)
+		arena_free(term->arena, term->arena_size, term->arena_mapped);
+
+	term->arena      = NULL;
+	term->arena_size = 0;
+	term->cells      = NULL;
+	term->line_dirty = NULL;
+	term->tabstop    = NULL;
+	term->esc.buf    = NULL;
+}
+
+bool term_init(struct terminal_t *term, int width, int height)
+{
+	pthread_once(&shared_once, shared_init);
+
+	term->width  = width;
+	term->height = height;
+
+	term->cols  = term->width / CELL_WIDTH;
+	term->lines = term->height / CELL_HEIGHT;
+
+	term->esc.size = ESCSEQ_SIZE;
+
+	term->outq.buf    = NULL;
+	term->outq.head   = term->outq.len = term->outq.size = 0;
+	term->defer_write = false;
+	term->outq_full   = false;
+	term->reply.len   = 0;
+	term->recorder    = NULL;
+	term->history     = NULL;
+	term->on_scroll_out = NULL;
+	term->palette     = NULL;
+	term->arena       = NULL;
+	term->esc.buf     = NULL;
+
+	logging(DEBUG, "terminal cols:%d lines:%d\n", term->cols, term->lines);
+
+	/* initialize palette and glyph map: shared */
+	share_palette(term);
+	term->palette_pending = false;
+	term->glyph = glyph_index;
 
 	if (!term->glyph[DEFAULT_CHAR]
 		|| !term->glyph[SUBSTITUTE_HALF]
@@ -770,6 +1303,14 @@ bool term_init(struct terminal_t *term, int width, int height)
 		return false;
 	}
 
+	/* allocate memory: cells, line_dirty, tabstop, esc.buf */
+	term->arena_size = term_layout(term, NULL);
+	if ((term->arena = arena_alloc(&term->arena_size, &term->arena_mapped)) == NULL) {
+		term_die(term);
+		return false;
+	}
+	term_layout(term, term->arena);
+
 	/* reset terminal */
 	reset(term);
 
@@ -816,12 +1357,23 @@ void enter_esc(struct terminal_t *term)
 	term->esc.state = STATE_ESC;
 }
 
+void shift_out(struct terminal_t *term)
+{
+	invoke_charset(term, 1); /* SO: G1 into GL */
+}
+
+void shift_in(struct terminal_t *term)
+{
+	invoke_charset(term, 0); /* SI: G0 into GL */
+}
+
 /* function for escape sequence */
 void save_state(struct terminal_t *term)
 {
 	term->state.mode = term->mode & MODE_ORIGIN;
 	term->state.cursor = term->cursor;
 	term->state.attribute = term->attribute;
+	term->state.iso2022 = term->iso2022;
 }
 
 void restore_state(struct terminal_t *term)
@@ -833,6 +1385,7 @@ void restore_state(struct terminal_t *term)
 		term->mode &= ~MODE_ORIGIN;
 	term->cursor    = term->state.cursor;
 	term->attribute = term->state.attribute;
+	term->iso2022   = term->state.iso2022;
 }
 
 void crnl(struct terminal_t *term)
@@ -853,24 +1406,59 @@ void reverse_nl(struct terminal_t *term)
 
 void identify(struct terminal_t *term)
 {
-	ewrite(term->fd, "\033[?6c", 5); /* "I am a VT102" */
+	term_reply(term, "\033[?6c", 5); /* "I am a VT102" */
 }
 
-void enter_csi(struct terminal_t *term)
+void ls2(struct terminal_t *term)
 {
-	term->esc.state = STATE_CSI;
+	invoke_charset(term, 2); /* LS2: G2 into GL */
 }
 
-void enter_osc(struct terminal_t *term)
+void ls3(struct terminal_t *term)
 {
-	term->esc.state = STATE_OSC;
+	invoke_charset(term, 3); /* LS3: G3 into GL */
 }
 
-void enter_dcs(struct terminal_t *term)
+void designate_charset(struct terminal_t *term, uint8_t intermediate, uint8_t final)
 {
-	term->esc.state = STATE_DCS;
-}
-
+	/*
+		ESC I F
+			I: '(' G0, ')' G1, '*' G2, '+' G3
+			F: 'B' US-ASCII, '0' DEC Special Graphics, 'A' United Kingdom
+	*/
+	static const char *designator = "()*+";
+	int g;
+
+	g = strchr(designator, intermediate) - designator;
+
+	if (final == 'B')
+		term->iso2022.g[g] = CHARSET_US_ASCII;
+	else if (final == '0')
+		term->iso2022.g[g] = CHARSET_DEC_SPECIAL;
+	else if (final == 'A')
+		term->iso2022.g[g] = CHARSET_UK;
+	else
+		return; /* not supported: keep current charset */
+
+	if (g == term->iso2022.gl)
+		invoke_charset(term, g);
+}
+
+void enter_csi(struct terminal_t *term)
+{
+	term->esc.state = STATE_CSI;
+}
+
+void enter_osc(struct terminal_t *term)
+{
+	term->esc.state = STATE_OSC;
+}
+
+void enter_dcs(struct terminal_t *term)
+{
+	term->esc.state = STATE_DCS;
+}
+
 void ris(struct terminal_t *term)
 {
 	reset(term);
@@ -1257,17 +1845,22 @@ void set_attr(struct terminal_t *term, struct parm_t *parm)
 void status_report(struct terminal_t *term, struct parm_t *parm)
 {
 	int i, num;
-	char buf[BUFSIZE];
+	char *cp;
 
 	for (i = 0; i < parm->argc; i++) {
 		num = dec2num(parm->argv[i]);
 		if (num == 5) {         /* terminal response: ready */
-			ewrite(term->fd, "\033[0n", 4);
-		} else if (num == 6) {  /* cursor position report */
-			snprintf(buf, BUFSIZE, "\033[%d;%dR", term->cursor.y + 1, term->cursor.x + 1);
-			ewrite(term->fd, buf, strlen(buf));
+			term_reply(term, "\033[0n", 4);
+		} else if (num == 6) {  /* cursor position report: ESC [ Pl ; Pc R */
+			cp = reply_begin(term, sizeof("\033[65535;65535R"));
+			cp = fmt_str(cp, "\033[");
+			cp = fmt_dec(cp, term->cursor.y + 1);
+			*cp++ = ';';
+			cp = fmt_dec(cp, term->cursor.x + 1);
+			*cp++ = 'R';
+			reply_end(term, cp);
 		} else if (num == 15) { /* terminal response: printer not connected */
-			ewrite(term->fd, "\033[?13n", 6);
+			term_reply(term, "\033[?13n", 6);
 		}
 	}
 }
@@ -1276,7 +1869,7 @@ void device_attribute(struct terminal_t *term, struct parm_t *parm)
 {
 	/* TODO: refer VT525 DA */
 	(void) parm;
-	ewrite(term->fd, "\033[?6c", 5); /* "I am a VT102" */
+	term_reply(term, "\033[?6c", 5); /* "I am a VT102" */
 }
 
 void set_mode(struct terminal_t *term, struct parm_t *parm)
@@ -1374,238 +1967,7365 @@ void clear_tabstop(struct terminal_t *term, struct parm_t *parm)
 	}
 }
 
-/* parse.h */
-void (*ctrl_func[CTRL_CHARS])(struct terminal_t *term) = {
-	[BS]  = bs,
-	[HT]  = tab,
-	[LF]  = newline,
-	[VT]  = newline,
-	[FF]  = newline,
-	[CR]  = carriage_return,
-	[ESC] = enter_esc,
-};
+/* osc.h */
+bool parse_color(const char *spec, uint32_t *color)
+{
+	/*
+		color spec format:
+			rgb:R/G/B (R, G, B: 1-4 hex digits, scaled to 8 bit)
+			#RGB, #RRGGBB, #RRRGGGBBB, #RRRRGGGGBBBB (use upper 8 bit)
+	*/
+	char *endp;
+	const char *cp;
+	unsigned long value;
+	int length, digits;
+	uint32_t rgb = 0;
 
-void (*esc_func[ESC_CHARS])(struct terminal_t *term) = {
-	['7'] = save_state,
-	['8'] = restore_state,
-	['D'] = newline,
-	['E'] = crnl,
-	['H'] = set_tabstop,
-	['M'] = reverse_nl,
-	['P'] = enter_dcs,
-	['Z'] = identify,
-	['['] = enter_csi,
-	[']'] = enter_osc,
-	['c'] = ris,
-};
+	if (spec == NULL)
+		return false;
 
-void (*csi_func[ESC_CHARS])(struct terminal_t *term, struct parm_t *) = {
-	['@'] = insert_blank,
-	['A'] = curs_up,
-	['B'] = curs_down,
-	['C'] = curs_forward,
-	['D'] = curs_back,
-	['E'] = curs_nl,
-	['F'] = curs_pl,
-	['G'] = curs_col,
-	['H'] = curs_pos,
-	['J'] = erase_display,
-	['K'] = erase_line,
-	['L'] = insert_line,
-	['M'] = delete_line,
-	['P'] = delete_char,
-	['X'] = erase_char,
-	['a'] = curs_forward,
-	['c'] = device_attribute,
-	['d'] = curs_line,
-	['e'] = curs_down,
-	['f'] = curs_pos,
-	['g'] = clear_tabstop,
-	['h'] = set_mode,
-	['l'] = reset_mode,
-	['m'] = set_attr,
-	['n'] = status_report,
-	['r'] = set_margin,
-	/* XXX: not implemented because these sequences conflict DECSLRM/DECSHTS
-	['s'] = sco_save_state,
-	['u'] = sco_restore_state,
+	if (strncmp(spec, "rgb:", 4) == 0) {
+		cp = spec + 4;
+		for (int i = 0; i < 3; i++) {
+			if (!isxdigit((unsigned char) *cp))
+				return false;
+			value  = strtoul(cp, &endp, 16);
+			digits = endp - cp;
+			if (digits > 4 || (i < 2 && *endp != '/') || (i == 2 && *endp != '\0'))
+				return false;
+			rgb = (rgb << BITS_PER_RGB) | (value * bit_mask[8] / bit_mask[digits * 4]);
+			cp  = endp + 1;
+		}
+	} else if (*spec == '#') {
+		length = strlen(spec + 1);
+		digits = length / 3;
+		if (length % 3 != 0 || digits < 1 || digits > 4)
+			return false;
+		for (int i = 1; i <= length; i++)
+			if (!isxdigit((unsigned char) spec[i]))
+				return false;
+		for (int i = 0; i < 3; i++) {
+			char component[5] = {0};
+			memcpy(component, spec + 1 + i * digits, digits);
+			value = strtoul(component, NULL, 16);
+			value = (digits == 1) ? value << 4: value >> ((digits - 2) * 4);
+			rgb = (rgb << BITS_PER_RGB) | value;
+		}
+	} else {
+		return false;
+	}
+
+	*color = rgb;
+	return true;
+}
+
+void color_report(struct terminal_t *term, int mode, int index, uint8_t st)
+{
+	/* reply as xterm does: 16 bit per component, same terminator as request */
+	char *cp;
+	uint32_t color = term->virtual_palette[index];
+
+	cp = reply_begin(term, sizeof("\033]4;255;rgb:ffff/ffff/ffff\033\\"));
+	cp = fmt_str(cp, "\033]");
+	cp = fmt_dec(cp, mode);
+	*cp++ = ';';
+	if (mode == OSC_SET_PALETTE) {
+		cp = fmt_dec(cp, index);
+		*cp++ = ';';
+	}
+	cp = fmt_str(cp, "rgb:");
+	cp = fmt_hex(cp, ((color >> 16) & bit_mask[8]) * 0x101, 4);
+	*cp++ = '/';
+	cp = fmt_hex(cp, ((color >> 8) & bit_mask[8]) * 0x101, 4);
+	*cp++ = '/';
+	cp = fmt_hex(cp, (color & bit_mask[8]) * 0x101, 4);
+	cp = fmt_str(cp, (st == BEL) ? "\007": "\033\\");
+	reply_end(term, cp);
+}
+
+void palette_changed(struct terminal_t *term)
+{
+	/* pixel_palette is rebuilt once at the end of parse() */
+	term->palette_modified = true;
+	term->palette_pending  = true;
+	redraw(term);
+}
+
+void set_palette(struct terminal_t *term, struct parm_t *parm, uint8_t st)
+{
+	/*
+		OSC Ps ; Pt ST
+		ref: http://invisible-island.net/xterm/ctlseqs/ctlseqs.html
+		ref: http://ttssh2.sourceforge.jp/manual/ja/about/ctrlseq.html#OSC
+
+		OSC 4 ; c ; spec ST
+			c: color index (0-255)
+			spec: color spec ("rgb:R/G/B", "#RRGGBB" etc) or "?" (query)
+			pairs of (c, spec) can be repeated
 	*/
-	['`'] = curs_col,
-};
+	int index;
+	uint32_t color;
+
+	for (int i = 1; i + 1 < parm->argc; i += 2) {
+		index = dec2num(parm->argv[i]);
+		if (parm->argv[i] == NULL || index < 0 || index >= COLORS)
+			continue;
+
+		if (parm->argv[i + 1] && strcmp(parm->argv[i + 1], "?") == 0) {
+			color_report(term, OSC_SET_PALETTE, index, st);
+		} else if (parse_color(parm->argv[i + 1], &color) && unshare_palette(term)) {
+			logging(LOG_DEBUG, "set palette[%d]: 0x%.6X\n", index, color);
+			term->virtual_palette[index] = color;
+			palette_changed(term);
+		}
+	}
+}
 
-/* ctr char/esc sequence/charset function */
-void control_character(struct terminal_t *term, uint8_t ch)
+void set_default_color(struct terminal_t *term, struct parm_t *parm, uint8_t st)
 {
-	static const char *ctrl_char[] = {
-		"NUL", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK", "BEL",
-		"BS ", "HT ", "LF ", "VT ", "FF ", "CR ", "SO ", "SI ",
-		"DLE", "DC1", "DC2", "DC3", "DC4", "NAK", "SYN", "ETB",
-		"CAN", "EM ", "SUB", "ESC", "FS ", "GS ", "RS ", "US ",
-	};
+	/*
+		OSC 10 ; spec ST: default foreground color (DEFAULT_FG palette entry)
+		OSC 11 ; spec ST: default background color (DEFAULT_BG palette entry)
+			subsequent spec is applied to the next Ps (OSC 10 ; fg ; bg ST)
+	*/
+	int mode, index;
+	uint32_t color;
+
+	mode = dec2num(parm->argv[0]);
+	for (int i = 1; i < parm->argc && mode <= OSC_SET_BG; i++, mode++) {
+		index = (mode == OSC_SET_FG) ? DEFAULT_FG: DEFAULT_BG;
+
+		if (parm->argv[i] && strcmp(parm->argv[i], "?") == 0) {
+			color_report(term, mode, index, st);
+		} else if (parse_color(parm->argv[i], &color) && unshare_palette(term)) {
+			term->virtual_palette[index] = color;
+			palette_changed(term);
+		}
+	}
+}
 
-	*term->esc.bp = '\0';
+void reset_palette(struct terminal_t *term, struct parm_t *parm)
+{
+	/*
+		OSC 104 ; c1 ; c2 ; ... ST: reset palette entries c1, c2 ...
+		OSC 104 ST: reset all palette entries
+	*/
+	extern const uint32_t color_list[COLORS]; /* global */
+	int index;
 
-	logging(DEBUG, "ctl: %s\n", ctrl_char[ch]);
+	if (!term->palette) /* default palette is used */
+		return;
 
-	if (ctrl_func[ch])
-		ctrl_func[ch](term);
+	if (parm->argc <= 1 || parm->argv[1] == NULL) {
+		for (int i = 0; i < COLORS; i++)
+			term->virtual_palette[i] = color_list[i];
+	} else {
+		for (int i = 1; i < parm->argc; i++) {
+			index = dec2num(parm->argv[i]);
+			if (parm->argv[i] == NULL || index < 0 || index >= COLORS)
+				continue;
+			term->virtual_palette[index] = color_list[index];
+		}
+	}
+	palette_changed(term);
+
+	/* palette_modified means "differs from default": recheck it, share default again */
+	if (memcmp(term->virtual_palette, color_list, sizeof(color_list)) == 0)
+		share_palette(term);
 }
 
-void esc_sequence(struct terminal_t *term, uint8_t ch)
+/* record.h */
+/*
+	session recording: input of parse() with timestamps
+	file:
+		header  : "YREC" version varint(cols) varint(lines) varint(start: realtime usec)
+		block   : type codec varint(time) varint(raw size) varint(stored size) payload
+		footer  : u64(offset of index block, little endian) "YIDX" (written by rec_close())
+	payload:
+		REC_EVENTS  : { varint(delta usec from previous event) varint(size) bytes }...
+		REC_KEYFRAME: grid_encode() of terminal before the events following it
+		REC_INDEX   : varint(count) { varint(delta time) varint(delta offset) }... of keyframes
+	blocks are compressed (lz_compress()) and written by writer thread: parser only copies input
+*/
+static inline size_t varint_put(uint8_t *p, uint64_t value)
 {
-	*term->esc.bp = '\0';
+	size_t len = 0;
 
-	logging(DEBUG, "esc: ESC %s\n", term->esc.buf);
+	while (value >= 0x80) {
+		p[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	p[len++] = value;
+	return len;
+}
 
-	if (strlen(term->esc.buf) == 1 && esc_func[ch])
-		esc_func[ch](term);
+static inline bool varint_get(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		*value |= (uint64_t) (**p & 0x7F) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
 
-	/* not reset if csi/osc/dcs seqence */
-	if (ch == '[' || ch == ']' || ch == 'P')
-		return;
+static inline bool outq_varint(struct outq_t *outq, uint64_t value)
+{
+	uint8_t buf[VARINT_MAX];
 
-	reset_esc(term);
+	return outq_push(outq, buf, varint_put(buf, value));
 }
 
-void csi_sequence(struct terminal_t *term, uint8_t ch)
+/*
+	minimal LZ77 for terminal output (repeated escape sequences, prompts, blank lines)
+		{ varint(literal size) literals varint(match size - LZ_MIN_MATCH) varint(offset) }...
+		last sequence has literals only
+*/
+enum {
+	LZ_MIN_MATCH = 4,
+	LZ_HASH_BITS = 13,
+	LZ_WINDOW    = 64 * 1024,
+};
+
+static inline size_t lz_bound(size_t size)
 {
-	struct parm_t parm;
+	return size + size / 4 + VARINT_MAX;
+}
 
-	*(term->esc.bp - 1) = '\0'; /* omit final character */
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v;
 
-	logging(DEBUG, "csi: CSI %s\n", term->esc.buf + 1);
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
 
-	reset_parm(&parm);
-	parse_arg(term->esc.buf + 1, &parm, ';', isdigit); /* skip '[' */
+size_t lz_compress(const uint8_t *src, size_t size, uint8_t *dst)
+{
+	/* dst must have lz_bound(size) bytes */
+	uint32_t table[1 << LZ_HASH_BITS] = { 0 }; /* position + 1 */
+	uint32_t h;
+	size_t pos = 0, anchor = 0, out = 0, match, len;
+
+	while (pos + LZ_MIN_MATCH <= size) {
+		h        = lz_hash(src + pos);
+		match    = table[h];
+		table[h] = pos + 1;
+
+		if (match == 0 || pos - (match - 1) > LZ_WINDOW
+			|| memcmp(src + match - 1, src + pos, LZ_MIN_MATCH) != 0) {
+			pos++;
+			continue;
+		}
+		match--;
+		for (len = LZ_MIN_MATCH; pos + len < size && src[match + len] == src[pos + len]; len++);
 
-	if (csi_func[ch])
-		csi_func[ch](term, &parm);
+		out += varint_put(dst + out, pos - anchor);
+		memcpy(dst + out, src + anchor, pos - anchor);
+		out += pos - anchor;
+		out += varint_put(dst + out, len - LZ_MIN_MATCH);
+		out += varint_put(dst + out, pos - match);
 
-	reset_esc(term);
+		pos   += len;
+		anchor = pos;
+	}
+
+	out += varint_put(dst + out, size - anchor);
+	memcpy(dst + out, src + anchor, size - anchor);
+	return out + size - anchor;
 }
 
-void osc_sequence(struct terminal_t *term, uint8_t ch)
+bool lz_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t dst_size)
 {
-  (void) ch;
-	reset_esc(term);
+	uint64_t lit, len, offset;
+	const uint8_t *end = src + size;
+	size_t out = 0;
+
+	while (out < dst_size) {
+		if (!varint_get(&src, end, &lit) || lit > (uint64_t) (end - src) || lit > dst_size - out)
+			return false;
+		memcpy(dst + out, src, lit);
+		src += lit;
+		out += lit;
+		if (out == dst_size)
+			break;
+
+		if (!varint_get(&src, end, &len) || !varint_get(&src, end, &offset))
+			return false;
+		len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || len > dst_size - out)
+			return false;
+		for (; len > 0; len--, out++) /* may overlap */
+			dst[out] = dst[out - offset];
+	}
+	return true;
 }
 
-void dcs_sequence(struct terminal_t *term, uint8_t ch)
+/*
+	cells are run-length encoded: { varint(run) varint(code) fg bg attribute width }...
+*/
+static inline bool cell_equal(const struct cell_t *a, const struct cell_t *b)
 {
-  (void) ch;
-	reset_esc(term);
+	return a->glyphp == b->glyphp
+		&& a->color_pair.fg == b->color_pair.fg && a->color_pair.bg == b->color_pair.bg
+		&& a->attribute == b->attribute && a->width == b->width;
 }
 
-void utf8_charset(struct terminal_t *term, uint8_t ch)
+bool cells_encode(const struct cell_t *cells, int count, struct outq_t *out)
 {
-	if (0x80 <= ch && ch <= 0xBF) {
-		/* check illegal UTF-8 sequence
-			* ? byte sequence: first byte must be between 0xC2 ~ 0xFD
-			* 2 byte sequence: first byte must be between 0xC2 ~ 0xDF
-			* 3 byte sequence: second byte following 0xE0 must be between 0xA0 ~ 0xBF
-			* 4 byte sequence: second byte following 0xF0 must be between 0x90 ~ 0xBF
-			* 5 byte sequence: second byte following 0xF8 must be between 0x88 ~ 0xBF
-			* 6 byte sequence: second byte following 0xFC must be between 0x84 ~ 0xBF
-		*/
-		if ((term->charset.following_byte == 0)
-			|| (term->charset.following_byte == 1 && term->charset.count == 0 && term->charset.code <= 1)
-			|| (term->charset.following_byte == 2 && term->charset.count == 0 && term->charset.code == 0 && ch < 0xA0)
-			|| (term->charset.following_byte == 3 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x90)
-			|| (term->charset.following_byte == 4 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x88)
-			|| (term->charset.following_byte == 5 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x84))
-			term->charset.is_valid = false;
+	/* runs are gathered in buf: one outq_push() per line (or BUFSIZE bytes) */
+	uint8_t buf[BUFSIZE];
+	size_t len = 0;
+	int run;
+	bool ok = true;
+
+	for (int x = 0; x < count; x += run) {
+		for (run = 1; x + run < count && cell_equal(&cells[x], &cells[x + run]); run++);
+
+		if (len + 2 * VARINT_MAX + 4 > sizeof(buf)) {
+			ok &= outq_push(out, buf, len);
+			len = 0;
+		}
+		len += varint_put(buf + len, run);
+		len += varint_put(buf + len, cells[x].glyphp ? cells[x].glyphp->code: DEFAULT_CHAR);
+		buf[len++] = cells[x].color_pair.fg;
+		buf[len++] = cells[x].color_pair.bg;
+		buf[len++] = cells[x].attribute;
+		buf[len++] = cells[x].width;
+	}
+	return outq_push(out, buf, len) && ok;
+}
 
-		term->charset.code <<= 6;
-		term->charset.code += ch & 0x3F;
-		term->charset.count++;
-	} else if (0xC0 <= ch && ch <= 0xDF) {
-		term->charset.code = ch & 0x1F;
-		term->charset.following_byte = 1;
-		term->charset.count = 0;
-		return;
-	} else if (0xE0 <= ch && ch <= 0xEF) {
-		term->charset.code = ch & 0x0F;
-		term->charset.following_byte = 2;
-		term->charset.count = 0;
-		return;
-	} else if (0xF0 <= ch && ch <= 0xF7) {
-		term->charset.code = ch & 0x07;
-		term->charset.following_byte = 3;
-		term->charset.count = 0;
-		return;
-	} else if (0xF8 <= ch && ch <= 0xFB) {
-		term->charset.code = ch & 0x03;
-		term->charset.following_byte = 4;
-		term->charset.count = 0;
-		return;
-	} else if (0xFC <= ch && ch <= 0xFD) {
-		term->charset.code = ch & 0x01;
-		term->charset.following_byte = 5;
-		term->charset.count = 0;
-		return;
-	} else { /* 0xFE - 0xFF: not used in UTF-8 */
-		add_char(term, REPLACEMENT_CHAR);
-		reset_charset(term);
-		return;
+bool cells_decode(struct terminal_t *term, const uint8_t **buf, const uint8_t *end,
+	struct cell_t *cells, int count)
+{
+	uint64_t run, code;
+	struct cell_t cell;
+
+	for (int x = 0; x < count; x += run) {
+		if (!varint_get(buf, end, &run) || !varint_get(buf, end, &code)
+			|| run == 0 || run > (uint64_t) (count - x) || end - *buf < 4)
+			return false;
+
+		cell.glyphp = (code < UCS2_CHARS) ? term->glyph[code]: NULL;
+		if (!cell.glyphp)
+			cell.glyphp = term->glyph[((*buf)[3] == WIDE) ? SUBSTITUTE_WIDE: SUBSTITUTE_HALF];
+		cell.color_pair.fg = (*buf)[0];
+		cell.color_pair.bg = (*buf)[1];
+		cell.attribute     = (*buf)[2];
+		cell.width         = (*buf)[3];
+		*buf += 4;
+
+		for (uint64_t i = 0; i < run; i++)
+			cells[x + i] = cell;
 	}
+	return true;
+}
 
-	if (term->charset.count >= term->charset.following_byte) {
-		/*	illegal code point (ref: http://www.unicode.org/reports/tr27/tr27-4.html)
-			0xD800   ~ 0xDFFF : surrogate pair
-			0xFDD0   ~ 0xFDEF : noncharacter
-			0xnFFFE  ~ 0xnFFFF: noncharacter (n: 0x00 ~ 0x10)
-			0x110000 ~        : invalid (unicode U+0000 ~ U+10FFFF)
-		*/
-		if (!term->charset.is_valid
-			|| (0xD800 <= term->charset.code && term->charset.code <= 0xDFFF)
-			|| (0xFDD0 <= term->charset.code && term->charset.code <= 0xFDEF)
-			|| ((term->charset.code & 0xFFFF) == 0xFFFE || (term->charset.code & 0xFFFF) == 0xFFFF)
-			|| (term->charset.code > 0x10FFFF))
-			add_char(term, REPLACEMENT_CHAR);
-		else
-			add_char(term, term->charset.code);
+bool cells_skip(const uint8_t **buf, const uint8_t *end, uint64_t count)
+{
+	/* move buf past count cells of cells_encode() without decoding them */
+	uint64_t run, code;
 
-		reset_charset(term);
+	for (uint64_t x = 0; x < count; x += run) {
+		if (!varint_get(buf, end, &run) || !varint_get(buf, end, &code)
+			|| run == 0 || run > count - x || end - *buf < 4)
+			return false;
+		*buf += 4;
 	}
+	return true;
 }
 
-void parse(struct terminal_t *term, uint8_t *buf, int size)
+/*
+	keyframe: everything parse() depends on (except partial escape sequence/UTF-8)
+	state: grid_encode_state(), cells: cells_encode() of each line
+*/
+bool grid_encode_state(struct terminal_t *term, struct outq_t *out)
+{
+	uint8_t bits = 0;
+	bool ok = true;
+
+	const uint64_t header[] = {
+		term->cols, term->lines, term->cursor.x, term->cursor.y,
+		term->scroll.top, term->scroll.bottom, term->mode, term->wrap_occured,
+		term->attribute, term->color_pair.fg, term->color_pair.bg,
+		term->state.cursor.x, term->state.cursor.y, term->state.mode, term->state.attribute,
+		term->iso2022.g[0], term->iso2022.g[1], term->iso2022.g[2], term->iso2022.g[3], term->iso2022.gl,
+		term->state.iso2022.g[0], term->state.iso2022.g[1],
+		term->state.iso2022.g[2], term->state.iso2022.g[3], term->state.iso2022.gl,
+		term->palette_modified,
+	};
+
+	for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); i++)
+		ok &= outq_varint(out, header[i]);
+
+	for (int x = 0; x < term->cols; x++) {
+		bits |= term->tabstop[x] << (x % BITS_PER_BYTE);
+		if (x % BITS_PER_BYTE == BITS_PER_BYTE - 1 || x == term->cols - 1) {
+			ok &= outq_push(out, &bits, 1);
+			bits = 0;
+		}
+	}
+
+	if (term->palette_modified) {
+		for (int i = 0; i < COLORS; i++)
+			ok &= outq_varint(out, term->virtual_palette[i]);
+	}
+	return ok;
+}
+
+bool grid_encode(struct terminal_t *term, struct outq_t *out)
+{
+	bool ok = grid_encode_state(term, out);
+
+	for (int y = 0; y < term->lines; y++)
+		ok &= cells_encode(term->cells[y], term->cols, out);
+
+	return ok;
+}
+
+bool grid_decode_state(struct terminal_t *term, const uint8_t **ptr, const uint8_t *end)
+{
+	/*
+		term must have the same size as encoded one
+		term is not modified unless whole state is valid (cursor and scroll margins in range)
+	*/
+	uint64_t header[26], code, cols = term->cols, lines = term->lines;
+	uint32_t palette[COLORS];
+	const uint8_t *buf = *ptr, *tabs;
+
+	for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); i++) {
+		if (!varint_get(&buf, end, &header[i]))
+			return false;
+	}
+	if (header[0] != cols || header[1] != lines
+		|| header[2] >= cols || header[3] >= lines || header[11] >= cols || header[12] >= lines
+		|| header[4] > header[5] || header[5] >= lines)
+		return false;
+
+	tabs = buf;
+	if ((uint64_t) (end - buf) < (cols + BITS_PER_BYTE - 1) / BITS_PER_BYTE)
+		return false;
+	buf += (cols + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+
+	for (int i = 0; header[25] && i < COLORS; i++) {
+		if (!varint_get(&buf, end, &code))
+			return false;
+		palette[i] = code;
+	}
+	if (header[25] && !unshare_palette(term))
+		return false;
+
+	term->cursor.x       = header[2];
+	term->cursor.y       = header[3];
+	term->scroll.top     = header[4];
+	term->scroll.bottom  = header[5];
+	term->mode           = header[6];
+	term->wrap_occured   = header[7];
+	term->attribute      = header[8];
+	term->color_pair.fg  = header[9];
+	term->color_pair.bg  = header[10];
+	term->state.cursor.x = header[11];
+	term->state.cursor.y = header[12];
+	term->state.mode     = header[13];
+	term->state.attribute = header[14];
+	for (int g = 0; g < 4; g++) {
+		term->iso2022.g[g]       = header[15 + g] % CHARSETS;
+		term->state.iso2022.g[g] = header[20 + g] % CHARSETS;
+	}
+	invoke_charset(term, header[19] % 4);
+	term->state.iso2022.gl    = header[24] % 4;
+	term->state.iso2022.table = (term->state.iso2022.g[term->state.iso2022.gl] == CHARSET_US_ASCII) ?
+		NULL: charset_table[term->state.iso2022.g[term->state.iso2022.gl]];
+
+	for (int x = 0; x < term->cols; x++)
+		term->tabstop[x] = (tabs[x / BITS_PER_BYTE] >> (x % BITS_PER_BYTE)) & 0x01;
+
+	if (!header[25])
+		share_palette(term);
+	else
+		memcpy(term->virtual_palette, palette, sizeof(palette));
+	term->palette_modified = header[25];
+	update_pixel_palette(term);
+
+	*ptr = buf;
+	return true;
+}
+
+bool grid_decode(struct terminal_t *term, const uint8_t *buf, size_t size)
+{
+	const uint8_t *end = buf + size;
+
+	if (!grid_decode_state(term, &buf, end))
+		return false;
+
+	for (int y = 0; y < term->lines; y++) {
+		if (!cells_decode(term, &buf, end, term->cells[y], term->cols))
+			return false;
+		term->line_dirty[y] = true;
+	}
+
+	reset_charset(term);
+	term->esc.state = STATE_RESET;
+	term->esc.bp    = term->esc.buf;
+	return true;
+}
+
+static inline uint64_t rec_now(struct recorder_t *rec)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - rec->start.tv_sec) * 1000000ULL + now.tv_nsec / 1000 - rec->start.tv_nsec / 1000;
+}
+
+bool rec_write_all(int fd, const void *buf, size_t size)
+{
+	ssize_t ret;
+	const uint8_t *ptr = buf;
+
+	while (size > 0) {
+		errno = 0;
+		if ((ret = write(fd, ptr, size)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logging(LOG_ERROR, "write: %s\n", strerror(errno));
+			return false;
+		}
+		ptr  += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+void rec_write_block(struct recorder_t *rec, enum rec_block_type type, uint64_t time,
+	const uint8_t *raw, size_t size)
+{
+	/* writer thread: compress, then write header and payload */
+	uint8_t header[2 + 3 * VARINT_MAX];
+	size_t len = 0, stored;
+	uint8_t *scratch = rec->scratch;
+	enum rec_codec codec = REC_LZ;
+
+	if (lz_bound(size) > rec->scratch_size) {
+		if ((scratch = erealloc(rec->scratch, lz_bound(size))) == NULL)
+			return;
+		rec->scratch      = scratch;
+		rec->scratch_size = lz_bound(size);
+	}
+
+	if ((stored = lz_compress(raw, size, scratch)) >= size) {
+		codec  = REC_RAW;
+		stored = size;
+	}
+
+	header[len++] = type;
+	header[len++] = codec;
+	len += varint_put(header + len, time);
+	len += varint_put(header + len, size);
+	len += varint_put(header + len, stored);
+
+	if (!rec_write_all(rec->fd, header, len)
+		|| !rec_write_all(rec->fd, (codec == REC_LZ) ? scratch: raw, stored)) {
+		/* cut partial block: next block (and its index entry) starts at rec->offset */
+		if (lseek(rec->fd, rec->offset, SEEK_SET) < 0 || ftruncate(rec->fd, rec->offset) < 0)
+			logging(LOG_ERROR, "recording: couldn't truncate: %s\n", strerror(errno));
+		return;
+	}
+
+	/* index only blocks actually written: player_seek() jumps to them */
+	if (type == REC_KEYFRAME && rec->index_count < INT_MAX) {
+		if (rec->index_count == rec->index_size) {
+			struct rec_index_t *index = erealloc(rec->index,
+				sizeof(struct rec_index_t) * (rec->index_size ? rec->index_size * 2: BUFSIZE));
+			if (index) {
+				rec->index       = index;
+				rec->index_size  = rec->index_size ? rec->index_size * 2: BUFSIZE;
+			}
+		}
+		if (rec->index_count < rec->index_size) {
+			rec->index[rec->index_count].time   = time;
+			rec->index[rec->index_count].offset = rec->offset;
+			rec->index_count++;
+		}
+	}
+
+	rec->offset       += len + stored;
+	rec->raw_bytes    += size;
+	rec->stored_bytes += stored;
+}
+
+void *rec_writer_thread(void *arg)
+{
+	struct rec_block_t *block;
+	struct recorder_t *rec = (struct recorder_t *) arg;
+
+	pthread_mutex_lock(&rec->lock);
+	while (true) {
+		if ((block = rec->head) == NULL) {
+			if (!rec->running)
+				break;
+			pthread_cond_wait(&rec->cond, &rec->lock);
+			continue;
+		}
+		if ((rec->head = block->next) == NULL)
+			rec->tail = NULL;
+		pthread_mutex_unlock(&rec->lock);
+
+		rec_write_block(rec, block->type, block->time, block->data.buf, block->data.len);
+		free(block->data.buf);
+		free(block);
+
+		pthread_mutex_lock(&rec->lock);
+		rec->queued--;
+		pthread_cond_signal(&rec->drained);
+	}
+	pthread_mutex_unlock(&rec->lock);
+
+	return NULL;
+}
+
+void rec_submit(struct recorder_t *rec, struct rec_block_t *block)
+{
+	/* parser thread: hand block to writer, wait only if disk can't keep up (REC_QUEUE_MAX) */
+	block->next = NULL;
+
+	pthread_mutex_lock(&rec->lock);
+	while (rec->queued >= REC_QUEUE_MAX)
+		pthread_cond_wait(&rec->drained, &rec->lock);
+
+	if (rec->tail)
+		rec->tail->next = block;
+	else
+		rec->head = block;
+	rec->tail = block;
+	rec->queued++;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+}
+
+struct rec_block_t *rec_block_new(enum rec_block_type type, uint64_t time)
+{
+	struct rec_block_t *block;
+
+	if ((block = ecalloc(1, sizeof(struct rec_block_t))) == NULL)
+		return NULL;
+	block->type = type;
+	block->time = time;
+	return block;
+}
+
+void rec_flush(struct recorder_t *rec)
+{
+	if (rec->cur && rec->cur->data.len > 0)
+		rec_submit(rec, rec->cur);
+	else if (rec->cur)
+		free(rec->cur);
+	rec->cur = NULL;
+}
+
+void rec_keyframe(struct recorder_t *rec, struct terminal_t *term, uint64_t now)
+{
+	struct rec_block_t *block;
+
+	/* events before keyframe must precede it in file */
+	rec_flush(rec);
+
+	if ((block = rec_block_new(REC_KEYFRAME, now)) == NULL)
+		return;
+
+	if (!grid_encode(term, &block->data)) {
+		free(block->data.buf);
+		free(block);
+		return;
+	}
+	rec_submit(rec, block);
+
+	rec->keyframe_time  = now;
+	rec->since_keyframe = 0;
+}
+
+void rec_input(struct recorder_t *rec, struct terminal_t *term, const uint8_t *buf, int size)
+{
+	/* called by parse() before parsing buf */
+	uint64_t now = rec_now(rec);
+
+	if (size <= 0)
+		return;
+
+	/* keyframe only at clean parser state: no partial escape sequence or UTF-8 */
+	if ((rec->since_keyframe >= REC_KEYFRAME_BYTES
+		|| (rec->since_keyframe > 0 && now - rec->keyframe_time >= REC_KEYFRAME_INTERVAL * 1000000ULL))
+		&& term->esc.state == STATE_RESET && term->charset.following_byte == 0)
+		rec_keyframe(rec, term, now);
+
+	if (rec->cur && (rec->cur->data.len >= REC_BLOCK_SIZE
+		|| now - rec->cur->time >= REC_FLUSH_INTERVAL * 1000000ULL))
+		rec_flush(rec);
+
+	if (!rec->cur) {
+		if ((rec->cur = rec_block_new(REC_EVENTS, now)) == NULL)
+			return;
+		rec->last = now;
+	}
+
+	outq_varint(&rec->cur->data, now - rec->last);
+	outq_varint(&rec->cur->data, size);
+	outq_push(&rec->cur->data, buf, size);
+
+	rec->last            = now;
+	rec->since_keyframe += size;
+}
+
+struct recorder_t *rec_open(struct terminal_t *term, const char *path)
+{
+	/* start recording input of term->parse(): first keyframe is the current screen */
+	int ret;
+	uint8_t header[4 + 1 + 3 * VARINT_MAX];
+	size_t len = 0;
+	struct timespec now;
+	struct recorder_t *rec;
+
+	if ((rec = ecalloc(1, sizeof(struct recorder_t))) == NULL)
+		return NULL;
+
+	errno = 0;
+	if ((rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		logging(LOG_ERROR, "couldn't open \"%s\"\n", path);
+		logging(LOG_ERROR, "open: %s\n", strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(header, "YREC", 4);
+	len = 4;
+	header[len++] = REC_VERSION;
+	len += varint_put(header + len, term->cols);
+	len += varint_put(header + len, term->lines);
+	len += varint_put(header + len, now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+
+	if (!rec_write_all(rec->fd, header, len)) {
+		eclose(rec->fd);
+		free(rec);
+		return NULL;
+	}
+	rec->offset = len;
+	clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+	pthread_mutex_init(&rec->lock, NULL);
+	pthread_cond_init(&rec->cond, NULL);
+	pthread_cond_init(&rec->drained, NULL);
+	rec->running = true;
+
+	if ((ret = pthread_create(&rec->thread, NULL, rec_writer_thread, rec)) != 0) {
+		logging(LOG_ERROR, "pthread_create: %s\n", strerror(ret));
+		pthread_cond_destroy(&rec->drained);
+		pthread_cond_destroy(&rec->cond);
+		pthread_mutex_destroy(&rec->lock);
+		eclose(rec->fd);
+		free(rec);
+		return NULL;
+	}
+
+	rec_keyframe(rec, term, 0);
+	term->recorder = rec;
+	return rec;
+}
+
+void rec_close(struct terminal_t *term)
+{
+	/* flush all blocks, then write index and footer */
+	uint8_t footer[8 + 4];
+	uint64_t index_offset, prev_time = 0, prev_offset = 0;
+	struct outq_t index = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct recorder_t *rec = term->recorder;
+
+	if (!rec)
+		return;
+	term->recorder = NULL;
+
+	rec_flush(rec);
+	pthread_mutex_lock(&rec->lock);
+	rec->running = false;
+	pthread_cond_signal(&rec->cond);
+	pthread_mutex_unlock(&rec->lock);
+	pthread_join(rec->thread, NULL);
+
+	outq_varint(&index, rec->index_count);
+	for (int i = 0; i < rec->index_count; i++) {
+		outq_varint(&index, rec->index[i].time - prev_time);
+		outq_varint(&index, rec->index[i].offset - prev_offset);
+		prev_time   = rec->index[i].time;
+		prev_offset = rec->index[i].offset;
+	}
+	index_offset = rec->offset;
+	rec_write_block(rec, REC_INDEX, rec->last, index.buf, index.len);
+
+	for (int i = 0; i < 8; i++)
+		footer[i] = index_offset >> (i * BITS_PER_BYTE);
+	memcpy(footer + 8, "YIDX", 4);
+	rec_write_all(rec->fd, footer, sizeof(footer));
+
+	logging(LOG_DEBUG, "recording: raw:%lu stored:%lu keyframes:%d\n",
+		(unsigned long) rec->raw_bytes, (unsigned long) rec->stored_bytes, rec->index_count);
+
+	eclose(rec->fd);
+	pthread_cond_destroy(&rec->drained);
+	pthread_cond_destroy(&rec->cond);
+	pthread_mutex_destroy(&rec->lock);
+	free(index.buf);
+	free(rec->index);
+	free(rec->scratch);
+	free(rec);
+}
+
+/* timeline.h */
+/*
+	in-memory history of screen: what was shown at time T
+		- capture: only dirty lines which differ from shadow (last captured cells) are stored
+		- keyframe (grid_encode()) every TIMELINE_KEYFRAME_INTERVAL, or when deltas after
+		  the last keyframe grow larger than TIMELINE_KEYFRAME_RATIO * keyframe: bounds rewind cost
+		- eviction by whole segment (keyframe + its deltas): budget (bytes) and span (time)
+	delta: varint(cursor.x) varint(cursor.y) varint(mode) varint(lines) { varint(y) cells_encode() }...
+*/
+static inline uint64_t timeline_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+bool timeline_init(struct timeline_t *tl, size_t budget, uint64_t span)
+{
+	/* budget: bytes of stored entries, span: usec kept (0: limited by budget only) */
+	memset(tl, 0, sizeof(struct timeline_t));
+	tl->budget = budget;
+	tl->span   = span;
+
+	return true;
+}
+
+void timeline_evict(struct timeline_t *tl, uint64_t now)
+{
+	/* drop oldest segment while over budget or older than span: newest keyframe always stays */
+	struct tl_entry_t *entry, *next;
+
+	while (tl->head && tl->head != tl->last_keyframe) {
+		/* head is always a keyframe: find next one */
+		for (next = tl->head->next; next && !next->keyframe; next = next->next);
+
+		if (tl->used <= tl->budget && (tl->span == 0 || !next || now - next->time <= tl->span))
+			break;
+
+		while (tl->head != next) {
+			entry    = tl->head;
+			tl->head = entry->next;
+			tl->used -= sizeof(struct tl_entry_t) + entry->size;
+			tl->evicted++;
+			free(entry);
+		}
+	}
+}
+
+void timeline_append(struct timeline_t *tl, struct outq_t *data, bool keyframe, uint64_t now)
+{
+	struct tl_entry_t *entry;
+
+	if ((entry = ecalloc(1, sizeof(struct tl_entry_t) + data->len)) == NULL)
+		return;
+
+	entry->time     = now;
+	entry->keyframe = keyframe;
+	entry->size     = data->len;
+	entry->next     = NULL;
+	memcpy(entry->data, data->buf, data->len);
+
+	if (tl->tail)
+		tl->tail->next = entry;
+	else
+		tl->head = entry;
+	tl->tail  = entry;
+	tl->used += sizeof(struct tl_entry_t) + entry->size;
+
+	if (keyframe) {
+		tl->last_keyframe  = entry;
+		tl->keyframe_size  = entry->size;
+		tl->since_keyframe = 0;
+	} else {
+		tl->since_keyframe += entry->size;
+	}
+	timeline_evict(tl, now);
+}
+
+bool timeline_keyframe(struct timeline_t *tl, struct terminal_t *term, uint64_t now)
+{
+	int *changed;
+	struct cell_t *shadow;
+
+	if (tl->cols != term->cols || tl->lines != term->lines) { /* resized */
+		if ((shadow = erealloc(tl->shadow, sizeof(struct cell_t) * term->cols * term->lines)) == NULL)
+			return false;
+		tl->shadow = shadow;
+		if ((changed = erealloc(tl->changed, sizeof(int) * term->lines)) == NULL)
+			return false;
+		tl->changed = changed;
+		tl->cols    = term->cols;
+		tl->lines   = term->lines;
+	}
+
+	tl->scratch.len = 0;
+	if (!grid_encode(term, &tl->scratch))
+		return false;
+
+	for (int y = 0; y < term->lines; y++)
+		memcpy(tl->shadow + y * term->cols, term->cells[y], sizeof(struct cell_t) * term->cols);
+	tl->cursor = term->cursor;
+	tl->mode   = term->mode;
+
+	timeline_append(tl, &tl->scratch, true, now);
+	return true;
+}
+
+int timeline_capture(struct timeline_t *tl, struct terminal_t *term)
+{
+	/*
+		call after parse() (before line_dirty is cleared by drawing)
+		return number of changed lines (-1: error)
+	*/
+	int count = 0;
+	uint64_t now = timeline_now();
+	struct cell_t *shadow;
+	struct outq_t *out = &tl->scratch;
+
+	if (!tl->last_keyframe || tl->cols != term->cols || tl->lines != term->lines
+		|| now - tl->last_keyframe->time >= TIMELINE_KEYFRAME_INTERVAL * 1000000ULL
+		|| tl->since_keyframe >= tl->keyframe_size * TIMELINE_KEYFRAME_RATIO) {
+		tl->captures++;
+		return timeline_keyframe(tl, term, now) ? term->lines: -1;
+	}
+
+	/* line numbers: collected first, header needs the count */
+	for (int y = 0; y < term->lines; y++) {
+		if (!term->line_dirty[y])
+			continue;
+		shadow = tl->shadow + y * term->cols;
+		for (int x = 0; x < term->cols; x++) {
+			if (!cell_equal(&shadow[x], &term->cells[y][x])) { /* not memcmp(): padding */
+				tl->changed[count++] = y;
+				break;
+			}
+		}
+	}
+
+	if (count == 0 && term->cursor.x == tl->cursor.x && term->cursor.y == tl->cursor.y
+		&& term->mode == tl->mode)
+		return 0;
+
+	out->len = 0;
+	outq_varint(out, term->cursor.x);
+	outq_varint(out, term->cursor.y);
+	outq_varint(out, term->mode);
+	outq_varint(out, count);
+	for (int i = 0; i < count; i++) {
+		outq_varint(out, tl->changed[i]);
+		cells_encode(term->cells[tl->changed[i]], term->cols, out);
+		memcpy(tl->shadow + tl->changed[i] * term->cols, term->cells[tl->changed[i]],
+			sizeof(struct cell_t) * term->cols);
+	}
+	tl->cursor = term->cursor;
+	tl->mode   = term->mode;
+
+	tl->captures++;
+	timeline_append(tl, out, false, now);
+	return count;
+}
+
+bool timeline_apply(struct terminal_t *term, struct tl_entry_t *entry)
+{
+	uint64_t value[4], y;
+	const uint8_t *ptr = entry->data, *end = entry->data + entry->size;
+
+	for (int i = 0; i < 4; i++) {
+		if (!varint_get(&ptr, end, &value[i]))
+			return false;
+	}
+	term->cursor.x = value[0];
+	term->cursor.y = value[1];
+	term->mode     = value[2];
+
+	for (uint64_t i = 0; i < value[3]; i++) {
+		if (!varint_get(&ptr, end, &y) || y >= (uint64_t) term->lines
+			|| !cells_decode(term, &ptr, end, term->cells[y], term->cols))
+			return false;
+		term->line_dirty[y] = true;
+	}
+	return true;
+}
+
+bool timeline_at(struct timeline_t *tl, struct terminal_t *term, uint64_t time)
+{
+	/*
+		reconstruct screen at time (timeline_now() clock) into term (same size as captured one)
+		return false if time is older than the oldest keyframe
+	*/
+	struct tl_entry_t *entry, *keyframe = NULL;
+
+	for (entry = tl->head; entry && entry->time <= time; entry = entry->next) {
+		if (entry->keyframe)
+			keyframe = entry;
+	}
+
+	if (!keyframe || !grid_decode(term, keyframe->data, keyframe->size))
+		return false;
+
+	for (entry = keyframe->next; entry && entry->time <= time && !entry->keyframe; entry = entry->next) {
+		if (!timeline_apply(term, entry))
+			return false;
+	}
+	return true;
+}
+
+void timeline_die(struct timeline_t *tl)
+{
+	struct tl_entry_t *entry, *next;
+
+	for (entry = tl->head; entry; entry = next) {
+		next = entry->next;
+		free(entry);
+	}
+	free(tl->shadow);
+	free(tl->changed);
+	free(tl->scratch.buf);
+	memset(tl, 0, sizeof(struct timeline_t));
+}
+
+/* snapshot.h */
+/*
+	snapshot: complete state of terminals (survives restart of host process)
+	file: "YSNP" version varint(count) { varint(size) body }...
+	body: grid_encode_state()
+	      varint(esc.state) varint(len) esc.buf[len]                 (partial escape sequence)
+	      varint(charset.code) varint(following_byte) varint(count) varint(is_valid) (partial UTF-8)
+	      { varint(n) cells_encode() }...                            (n identical rows)
+	restore reads cells directly from mapped file: no read(), no intermediate buffer
+*/
+static inline bool line_equal(struct terminal_t *term, int a, int b)
+{
+	for (int x = 0; x < term->cols; x++) {
+		if (!cell_equal(&term->cells[a][x], &term->cells[b][x]))
+			return false;
+	}
+	return true;
+}
+
+bool snapshot_encode(struct terminal_t *term, struct outq_t *out)
+{
+	int y, n;
+	bool ok;
+	size_t esc_len = term->esc.bp - term->esc.buf;
+
+	ok = grid_encode_state(term, out);
+
+	ok &= outq_varint(out, term->esc.state);
+	ok &= outq_varint(out, esc_len);
+	ok &= outq_push(out, (uint8_t *) term->esc.buf, esc_len);
+
+	ok &= outq_varint(out, term->charset.code);
+	ok &= outq_varint(out, term->charset.following_byte);
+	ok &= outq_varint(out, term->charset.count);
+	ok &= outq_varint(out, term->charset.is_valid);
+
+	for (y = 0; y < term->lines; y += n) {
+		for (n = 1; y + n < term->lines && line_equal(term, y, y + n); n++);
+		ok &= outq_varint(out, n);
+		ok &= cells_encode(term->cells[y], term->cols, out);
+	}
+	return ok;
+}
+
+bool snapshot_decode(struct terminal_t *term, const uint8_t *buf, size_t size)
+{
+	/*
+		term is initialized: re-initialized if size differs
+		(fd, outq, recorder and history belong to the session: they are kept)
+		broken body: term is reset, never left half restored
+	*/
+	uint64_t cols, lines, value[4], n;
+	struct terminal_t keep;
+	const uint8_t *ptr = buf, *end = buf + size;
+
+	if (!varint_get(&ptr, end, &cols) || !varint_get(&ptr, end, &lines)
+		|| cols == 0 || lines == 0 || cols > USHRT_MAX || lines > USHRT_MAX)
+		return false;
+	if (cols != (uint64_t) term->cols || lines != (uint64_t) term->lines) {
+		keep = *term;
+		term->outq.buf = NULL; /* not freed by term_die() */
+		term_die(term);
+		if (!term_init(term, cols * CELL_WIDTH, lines * CELL_HEIGHT))
+			term_die(term);
+		term->fd            = keep.fd;
+		term->outq          = keep.outq;
+		term->defer_write   = keep.defer_write;
+		term->outq_full     = keep.outq_full;
+		term->recorder      = keep.recorder;
+		term->history       = keep.history;
+		term->on_scroll_out = keep.on_scroll_out;
+		if (!term->arena)
+			return false;
+	}
+
+	if (!grid_decode_state(term, &buf, end))
+		return false;
+
+	if (!varint_get(&buf, end, &value[0]) || !varint_get(&buf, end, &n)
+		|| (value[0] & (value[0] - 1)) || value[0] > STATE_DCS
+		|| n >= (uint64_t) term->esc.size || (uint64_t) (end - buf) < n)
+		goto broken;
+	term->esc.state = value[0];
+	memcpy(term->esc.buf, buf, n);
+	term->esc.bp    = term->esc.buf + n;
+	buf += n;
+
+	for (int i = 0; i < 4; i++) {
+		if (!varint_get(&buf, end, &value[i]))
+			goto broken;
+	}
+	if (value[0] > INT32_MAX || value[1] > 5 || value[2] > value[1]) /* up to 6 byte sequence */
+		goto broken;
+	term->charset.code           = value[0];
+	term->charset.following_byte = value[1];
+	term->charset.count          = value[2];
+	term->charset.is_valid       = value[3];
+
+	for (int y = 0; y < term->lines; y += n) {
+		if (!varint_get(&buf, end, &n) || n == 0 || n > (uint64_t) (term->lines - y)
+			|| !cells_decode(term, &buf, end, term->cells[y], term->cols))
+			goto broken;
+		for (uint64_t i = 0; i < n; i++) {
+			if (i > 0)
+				memcpy(term->cells[y + i], term->cells[y], sizeof(struct cell_t) * term->cols);
+			term->line_dirty[y + i] = true;
+		}
+	}
+	return true;
+
+broken: /* state is already applied */
+	reset(term);
+	return false;
+}
+
+bool snapshot_save(const char *path, struct terminal_t **terms, int count)
+{
+	/* written to path.tmp then renamed: old snapshot survives a crash while saving */
+	int fd;
+	bool ok = true;
+	char tmp[PATH_MAX];
+	uint8_t header[4 + VARINT_MAX * 2];
+	size_t len = 0, mark;
+	struct outq_t out = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t body = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	memcpy(header, "YSNP", 4);
+	len = 4;
+	len += varint_put(header + len, SNAP_VERSION);
+	len += varint_put(header + len, count);
+	ok &= outq_push(&out, header, len);
+
+	for (int i = 0; i < count && ok; i++) {
+		body.len = 0;
+		ok &= snapshot_encode(terms[i], &body);
+		mark = out.len;
+		ok &= outq_varint(&out, body.len) && outq_push(&out, body.buf, body.len);
+		if (!ok)
+			out.len = mark;
+	}
+	free(body.buf);
+
+	if (!ok || snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		logging(LOG_ERROR, "snapshot: couldn't encode \"%s\"\n", path);
+		free(out.buf);
+		return false;
+	}
+
+	errno = 0;
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		logging(LOG_ERROR, "open: %s: %s\n", tmp, strerror(errno));
+		free(out.buf);
+		return false;
+	}
+	ok = rec_write_all(fd, out.buf, out.len) && fsync(fd) == 0;
+	eclose(fd);
+	free(out.buf);
+
+	if (!ok || rename(tmp, path) < 0) {
+		logging(LOG_ERROR, "snapshot: couldn't write \"%s\": %s\n", path, strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+int snapshot_restore(const char *path, struct terminal_t **terms, int max)
+{
+	/*
+		restore up to max terminals (initialized by term_init(), any size)
+		return number of restored terminals (-1: not a snapshot)
+	*/
+	int fd, count = 0;
+	uint8_t *map;
+	uint64_t version, total, size;
+	const uint8_t *ptr, *end;
+	struct stat st;
+
+	if ((fd = eopen(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < 6) {
+		logging(LOG_ERROR, "\"%s\" is not a snapshot\n", path);
+		eclose(fd);
+		return -1;
+	}
+	map = emmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	eclose(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ptr = map + 4;
+	end = map + st.st_size;
+	if (memcmp(map, "YSNP", 4) != 0 || !varint_get(&ptr, end, &version)
+		|| version != SNAP_VERSION || !varint_get(&ptr, end, &total)) {
+		logging(LOG_ERROR, "\"%s\" is not a snapshot (or unknown version)\n", path);
+		emunmap(map, st.st_size);
+		return -1;
+	}
+
+	while (count < max && (uint64_t) count < total) {
+		if (!varint_get(&ptr, end, &size) || size > (uint64_t) (end - ptr)
+			|| !snapshot_decode(terms[count], ptr, size)) {
+			logging(LOG_ERROR, "snapshot: \"%s\": terminal %d is broken\n", path, count);
+			break;
+		}
+		ptr += size;
+		count++;
+	}
+
+	emunmap(map, st.st_size);
+	return count;
+}
+
+/* history.h */
+/*
+	scrollback: lines leaving the top of the screen (scroll_window()) are kept in pages
+		- page: up to HISTORY_PAGE_LINES lines, each varint(cols) cells_encode()
+		- page boundary is chosen by line content (hash): identical output ends up in
+		  identical pages even if it started at different lines of the screen
+		- sealed pages are interned in hist_store by content hash with reference count:
+		  terminals with identical output share the memory of their history
+		- oldest pages are released beyond HISTORY_LINES lines
+	history_t is used by the thread calling parse() of the terminal, hist_store is locked
+*/
+static inline uint64_t hist_hash(const uint8_t *p, size_t size)
+{
+	/* 8 bytes per step: only compared inside the process */
+	uint64_t hash = 0xCBF29CE484222325ULL ^ size, word = 0;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, p + i, sizeof(word));
+		hash  = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+	if (i < size) {
+		word = 0;
+		memcpy(&word, p + i, size - i);
+		hash  = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+	return hash ^ (hash >> 32);
+}
+
+bool hist_grow(struct hist_store_t *store)
+{
+	/* double page table: lock held */
+	size_t size = store->size ? store->size * 2: HIST_TABLE_SIZE;
+	struct hist_page_t **table, *page, *next;
+
+	if ((table = ecalloc(size, sizeof(struct hist_page_t *))) == NULL)
+		return false;
+
+	for (size_t i = 0; i < store->size; i++) {
+		for (page = store->table[i]; page; page = next) {
+			next = page->next;
+			page->next = table[page->hash & (size - 1)];
+			table[page->hash & (size - 1)] = page;
+		}
+	}
+	free(store->table);
+	store->table = table;
+	store->size  = size;
+	return true;
+}
+
+struct hist_page_t *hist_intern(const uint8_t *data, size_t size, int lines, uint64_t hash)
+{
+	/* return stored page of the same content (new reference): NULL if no memory */
+	struct hist_store_t *store = &hist_store;
+	struct hist_page_t *page = NULL;
+
+	pthread_mutex_lock(&store->lock);
+	store->interned++;
+
+	if (store->size > 0) {
+		for (page = store->table[hash & (store->size - 1)]; page; page = page->next) {
+			if (page->hash == hash && page->size == size && page->lines == (uint32_t) lines
+				&& memcmp(page->data, data, size) == 0) {
+				page->refs++;
+				store->shared++;
+				goto unlock;
+			}
+		}
+	}
+
+	if (store->count >= store->size && !hist_grow(store))
+		goto unlock;
+	if ((page = ecalloc(1, sizeof(struct hist_page_t) + size)) == NULL)
+		goto unlock;
+
+	page->hash  = hash;
+	page->refs  = 1;
+	page->lines = lines;
+	page->size  = size;
+	memcpy(page->data, data, size);
+
+	page->next = store->table[hash & (store->size - 1)];
+	store->table[hash & (store->size - 1)] = page;
+	store->count++;
+	store->bytes += sizeof(struct hist_page_t) + size;
+unlock:
+	pthread_mutex_unlock(&store->lock);
+	return page;
+}
+
+void hist_release(struct hist_page_t *page)
+{
+	/* drop reference: freed by the last one */
+	struct hist_store_t *store = &hist_store;
+	struct hist_page_t **pp;
+
+	pthread_mutex_lock(&store->lock);
+	if (--page->refs == 0) {
+		for (pp = &store->table[page->hash & (store->size - 1)]; *pp != page; pp = &(*pp)->next);
+		*pp = page->next;
+		store->count--;
+		store->bytes -= sizeof(struct hist_page_t) + page->size;
+		free(page);
+	}
+	pthread_mutex_unlock(&store->lock);
+}
+
+void history_drop(struct history_t *hist)
+{
+	/* release oldest page */
+	struct hist_page_t *page = hist->pages[hist->head];
+
+	hist->kept -= page->lines;
+	hist->head  = (hist->head + 1) % hist->size;
+	hist->count--;
+	hist_release(page);
+}
+
+bool history_grow(struct history_t *hist)
+{
+	/* double ring of pages (keeps order) */
+	int size = hist->size ? hist->size * 2: HISTORY_LINES / HISTORY_PAGE_CUT;
+	struct hist_page_t **pages;
+
+	if ((pages = ecalloc(size, sizeof(struct hist_page_t *))) == NULL)
+		return false;
+
+	for (int i = 0; i < hist->count; i++)
+		pages[i] = hist->pages[(hist->head + i) % hist->size];
+	free(hist->pages);
+	hist->pages = pages;
+	hist->head  = 0;
+	hist->size  = size;
+	return true;
+}
+
+void history_seal(struct history_t *hist)
+{
+	/* open lines become a shared page: lost if no memory */
+	struct hist_page_t *page;
+
+	if (hist->open_lines == 0)
+		return;
+
+	if ((hist->count < hist->size || history_grow(hist))
+		&& (page = hist_intern(hist->open.buf, hist->open.len, hist->open_lines, hist->hash))) {
+		hist->pages[(hist->head + hist->count) % hist->size] = page;
+		hist->count++;
+		hist->kept += page->lines;
+	}
+	hist->open.len   = 0;
+	hist->open_lines = 0;
+	hist->hash       = 0;
+
+	while (hist->kept > HISTORY_LINES && hist->count > 1)
+		history_drop(hist);
+}
+
+void history_save(struct terminal_t *term, int y)
+{
+	/* on_scroll_out of terminal: line y is about to be erased */
+	struct history_t *hist = term->history;
+	size_t start = hist->open.len;
+	uint64_t hash;
+
+	if (!outq_varint(&hist->open, term->cols)
+		|| !cells_encode(term->cells[y], term->cols, &hist->open)) {
+		hist->open.len = start;
+		return;
+	}
+	hash = hist_hash(hist->open.buf + start, hist->open.len - start);
+
+	hist->hash = (hist->hash ^ hash) * 0x9E3779B97F4A7C15ULL;
+	hist->open_lines++;
+	hist->lines++;
+
+	if (hist->open_lines >= HISTORY_PAGE_LINES || hash % HISTORY_PAGE_CUT == 0)
+		history_seal(hist);
+}
+
+struct history_t *history_open(struct terminal_t *term)
+{
+	/* start keeping lines scrolled out of term */
+	struct history_t *hist;
+
+	if (term->history)
+		return term->history;
+	if ((hist = ecalloc(1, sizeof(struct history_t))) == NULL)
+		return NULL;
+
+	term->history       = hist;
+	term->on_scroll_out = history_save;
+	return hist;
+}
+
+void history_close(struct terminal_t *term)
+{
+	struct history_t *hist = term->history;
+
+	if (!hist)
+		return;
+	term->history       = NULL;
+	term->on_scroll_out = NULL;
+
+	while (hist->count > 0)
+		history_drop(hist);
+	free(hist->pages);
+	free(hist->open.buf);
+	free(hist);
+}
+
+size_t history_usage(struct terminal_t *term)
+{
+	/* bytes of scrollback: shared pages are divided by their references */
+	struct history_t *hist = term->history;
+	struct hist_page_t *page;
+	size_t bytes;
+
+	if (!hist)
+		return 0;
+	bytes = sizeof(struct history_t) + hist->size * sizeof(struct hist_page_t *) + hist->open.size;
+
+	pthread_mutex_lock(&hist_store.lock);
+	for (int i = 0; i < hist->count; i++) {
+		page   = hist->pages[(hist->head + i) % hist->size];
+		bytes += (sizeof(struct hist_page_t) + page->size) / page->refs;
+	}
+	pthread_mutex_unlock(&hist_store.lock);
+	return bytes;
+}
+
+int history_count(struct terminal_t *term)
+{
+	/* number of lines kept */
+	return term->history ? term->history->kept + term->history->open_lines: 0;
+}
+
+int history_line(struct terminal_t *term, int n, struct cell_t *cells, int max)
+{
+	/*
+		decode line n (0: oldest kept, history_count() - 1: just above the screen)
+		return number of cells (cols of the terminal at that time): -1 if more than max
+	*/
+	struct history_t *hist = term->history;
+	struct hist_page_t *page = NULL;
+	const uint8_t *ptr, *end;
+	uint64_t cols = 0;
+	int i;
+
+	if (n < 0 || n >= history_count(term))
+		return -1;
+
+	for (i = 0; i < hist->count; i++) {
+		page = hist->pages[(hist->head + i) % hist->size];
+		if (n < (int) page->lines)
+			break;
+		n -= page->lines;
+	}
+	if (i < hist->count) {
+		ptr = page->data;
+		end = page->data + page->size;
+	} else {
+		ptr = hist->open.buf;
+		end = hist->open.buf + hist->open.len;
+	}
+
+	/* lines before n are skipped: they may be wider than max (saved before resize) */
+	for (i = 0; i < n; i++) {
+		if (!varint_get(&ptr, end, &cols) || !cells_skip(&ptr, end, cols))
+			return -1;
+	}
+	if (!varint_get(&ptr, end, &cols) || cols > (uint64_t) max
+		|| !cells_decode(term, &ptr, end, cells, cols))
+		return -1;
+	return cols;
+}
+
+/* vtenc.h */
+/*
+	re-encode terminal_t as VT sequences for an outer terminal (nested display)
+		- shadow holds what the outer terminal shows: only cells differing from it are sent
+		- cursor and pen (SGR) of the outer terminal are tracked: every cursor movement
+		  is the shortest of CUP, CUF/CUB, CR/LF, CUU/CUD, VPA/CHA or rewriting the
+		  cells in between, SGR is the shorter of delta and reset
+		- blank runs are erased by EL/ECH, repeated chars are sent by REP (if cheaper)
+		- colors DEFAULT_FG/DEFAULT_BG are mapped to default colors of the outer terminal,
+		  bold/blink/reverse are already resolved into colors of the cell
+*/
+int vtenc_utf8(uint32_t code, char *buf)
+{
+	if (code < 0x80) {
+		buf[0] = code;
+		return 1;
+	} else if (code < 0x800) {
+		buf[0] = 0xC0 | (code >> 6);
+		buf[1] = 0x80 | (code & 0x3F);
+		return 2;
+	} else if (code < 0x10000) {
+		buf[0] = 0xE0 | (code >> 12);
+		buf[1] = 0x80 | ((code >> 6) & 0x3F);
+		buf[2] = 0x80 | (code & 0x3F);
+		return 3;
+	}
+	buf[0] = 0xF0 | (code >> 18);
+	buf[1] = 0x80 | ((code >> 12) & 0x3F);
+	buf[2] = 0x80 | ((code >> 6) & 0x3F);
+	buf[3] = 0x80 | (code & 0x3F);
+	return 4;
+}
+
+static inline struct vt_pen_t vtenc_pen_of(const struct cell_t *cell)
+{
+	struct vt_pen_t pen;
+
+	pen.fg        = (cell->color_pair.fg == DEFAULT_FG) ? -1: cell->color_pair.fg;
+	pen.bg        = (cell->color_pair.bg == DEFAULT_BG) ? -1: cell->color_pair.bg;
+	pen.underline = cell->attribute & attr_mask[ATTR_UNDERLINE];
+	return pen;
+}
+
+static inline bool vtenc_blank(const struct vtenc_t *enc, const struct cell_t *cell)
+{
+	/* looks like erased cell: only background color matters */
+	return cell->glyphp == enc->space && cell->width == HALF
+		&& !(cell->attribute & attr_mask[ATTR_UNDERLINE]);
+}
+
+int vtenc_color(char *buf, int color, bool bg)
+{
+	/* SGR parameter of color: 39/49, 30-37/40-47, 90-97/100-107, 38;5;n/48;5;n */
+	if (color < 0)
+		return sprintf(buf, "%d", bg ? 49: 39);
+	else if (color < 8)
+		return sprintf(buf, "%d", (bg ? 40: 30) + color);
+	else if (color < 16)
+		return sprintf(buf, "%d", (bg ? 100: 90) + color - 8);
+	return sprintf(buf, "%d;5;%d", bg ? 48: 38, color);
+}
+
+int vtenc_sgr(struct vt_pen_t from, struct vt_pen_t to, char *buf)
+{
+	/* SGR changing pen from -> to: shorter of delta and reset (buf: at least 32 bytes) */
+	int len, reset_len;
+	char reset[32];
+
+	len = sprintf(buf, "\033[");
+	if (from.underline != to.underline)
+		len += sprintf(buf + len, "%s;", to.underline ? "4": "24");
+	if (from.fg != to.fg) {
+		len += vtenc_color(buf + len, to.fg, false);
+		buf[len++] = ';';
+	}
+	if (from.bg != to.bg) {
+		len += vtenc_color(buf + len, to.bg, true);
+		buf[len++] = ';';
+	}
+	buf[len - 1] = 'm';
+
+	/* reset: "\033[m" or "\033[0;" and only non default parameters */
+	reset_len = sprintf(reset, "\033[0;");
+	if (to.underline)
+		reset_len += sprintf(reset + reset_len, "4;");
+	if (to.fg >= 0) {
+		reset_len += vtenc_color(reset + reset_len, to.fg, false);
+		reset[reset_len++] = ';';
+	}
+	if (to.bg >= 0) {
+		reset_len += vtenc_color(reset + reset_len, to.bg, true);
+		reset[reset_len++] = ';';
+	}
+	if (reset_len == 4) /* no parameter */
+		reset_len = 3;
+	reset[reset_len - 1] = 'm';
+
+	if (reset_len < len) {
+		memcpy(buf, reset, reset_len);
+		len = reset_len;
+	}
+	return len;
+}
+
+void vtenc_set_pen(struct vtenc_t *enc, struct vt_pen_t pen, struct outq_t *out)
+{
+	char buf[32];
+
+	if (pen.fg == enc->pen.fg && pen.bg == enc->pen.bg && pen.underline == enc->pen.underline)
+		return;
+	outq_push(out, (uint8_t *) buf, vtenc_sgr(enc->pen, pen, buf));
+	enc->pen = pen;
+}
+
+int vtenc_move_seq(struct vtenc_t *enc, int y, int x, char *buf)
+{
+	/* shortest sequence moving cursor of outer terminal to (x, y) (buf: at least 32 bytes) */
+	int len, vlen, hlen, dx, dy;
+	char vbuf[16], hbuf[16];
+
+	/* one parameter form "CSI Ps H" is not accepted by every terminal (yaft included) */
+	if (y == 0 && x == 0)
+		len = sprintf(buf, "\033[H");
+	else
+		len = sprintf(buf, "\033[%d;%dH", y + 1, x + 1);
+
+	if (!enc->cursor_known)
+		return len;
+
+	/* CR + LF: works with or without ONLCR of outer tty, never scrolls (y < lines) */
+	dy = y - enc->cursor.y;
+	if (x == 0 && dy > 0 && dy <= 3 && dy + 1 < len)
+		return sprintf(buf, "\r%.*s", dy, "\n\n\n");
+
+	/* vertical part: CUU/CUD, VPA */
+	if (dy == 0)
+		vlen = 0;
+	else if (dy > 0)
+		vlen = sprintf(vbuf, (dy == 1) ? "\033[B": "\033[%dB", dy);
+	else
+		vlen = sprintf(vbuf, (dy == -1) ? "\033[A": "\033[%dA", -dy);
+	if (dy != 0 && (hlen = sprintf(hbuf, "\033[%dd", y + 1)) < vlen)
+		vlen = sprintf(vbuf, "%s", hbuf);
+
+	/* horizontal part: CR, CUF/CUB, BS, CR + CUF, CHA */
+	dx = x - enc->cursor.x;
+	if (dx == 0)
+		hlen = 0;
+	else if (x == 0)
+		hlen = sprintf(hbuf, "\r");
+	else if (dx > 0)
+		hlen = sprintf(hbuf, (dx == 1) ? "\033[C": "\033[%dC", dx);
+	else if (dx >= -3)
+		hlen = sprintf(hbuf, "%.*s", -dx, "\b\b\b");
+	else if (x < -dx)
+		hlen = sprintf(hbuf, (x == 1) ? "\r\033[C": "\r\033[%dC", x);
+	else
+		hlen = sprintf(hbuf, "\033[%dD", -dx);
+
+	if (vlen + hlen < len) {
+		memcpy(buf, vbuf, vlen);
+		memcpy(buf + vlen, hbuf, hlen);
+		len = vlen + hlen;
+	}
+	return len;
+}
+
+int vtenc_rewrite_cost(struct vtenc_t *enc, const struct cell_t *cells, int x0, int x1)
+{
+	/* bytes to rewrite unchanged cells [x0, x1) with current pen: INT_MAX if not possible */
+	int cost = 0;
+	char buf[4];
+	struct vt_pen_t pen;
+
+	for (int x = x0; x < x1; x++) {
+		pen = vtenc_pen_of(&cells[x]);
+		if (cells[x].width != HALF || pen.fg != enc->pen.fg || pen.bg != enc->pen.bg
+			|| pen.underline != enc->pen.underline)
+			return INT_MAX;
+		cost += vtenc_utf8(cells[x].glyphp->code, buf);
+	}
+	return cost;
+}
+
+void vtenc_move(struct vtenc_t *enc, const struct cell_t *cells, int y, int x, struct outq_t *out)
+{
+	int len, cost;
+	char buf[32];
+
+	if (enc->cursor_known && enc->cursor.y == y && enc->cursor.x == x)
+		return;
+	len = vtenc_move_seq(enc, y, x, buf);
+
+	/* near on the same line: rewriting unchanged cells may be shorter */
+	if (enc->cursor_known && enc->cursor.y == y && x > enc->cursor.x
+		&& (cost = vtenc_rewrite_cost(enc, cells, enc->cursor.x, x)) <= len) {
+		for (int i = enc->cursor.x; i < x; i++)
+			outq_push(out, (uint8_t *) buf, vtenc_utf8(cells[i].glyphp->code, buf));
+	} else {
+		outq_push(out, (uint8_t *) buf, len);
+	}
+	enc->cursor.x     = x;
+	enc->cursor.y     = y;
+	enc->cursor_known = true;
+}
+
+int vtenc_put(struct vtenc_t *enc, const struct cell_t *cells, int x, int count, struct outq_t *out)
+{
+	/* write cells[x] (count times if REP is used): return number of columns written */
+	int len, width, rep_len;
+	char buf[32];
+	const struct cell_t *cell = &cells[x];
+	uint32_t code = cell->glyphp->code;
+
+	vtenc_set_pen(enc, vtenc_pen_of(cell), out);
+
+	/* wide char: both halves; isolated half or wide char at last column: space */
+	width = (cell->width == WIDE && x + 1 < enc->cols) ? 2: 1;
+	if (cell->width == NEXT_TO_WIDE || (cell->width == WIDE && width == 1))
+		code = enc->space->code;
+
+	len = vtenc_utf8(code, buf);
+	outq_push(out, (uint8_t *) buf, len);
+
+	if (count > 1 && width == 1) {
+		rep_len = sprintf(buf, "\033[%db", count - 1);
+		if (rep_len < (count - 1) * len) {
+			outq_push(out, (uint8_t *) buf, rep_len);
+		} else {
+			vtenc_utf8(code, buf);
+			for (int i = 1; i < count; i++)
+				outq_push(out, (uint8_t *) buf, len);
+		}
+		width = count;
+	}
+
+	enc->cursor.x += width;
+	if (enc->cursor.x >= enc->cols)
+		enc->cursor_known = false;
+	return width;
+}
+
+void vtenc_mark(struct vtenc_t *enc, const struct cell_t *cells, const struct cell_t *shadow)
+{
+	/* changed cells, both halves of wide chars (of screen or outer terminal) go together */
+	bool again;
+
+	for (int x = 0; x < enc->cols; x++)
+		enc->changed[x] = !cell_equal(&cells[x], &shadow[x]);
+
+	do {
+		again = false;
+		for (int x = 0; x + 1 < enc->cols; x++) {
+			if ((cells[x].width == WIDE || shadow[x].width == WIDE)
+				&& enc->changed[x] != enc->changed[x + 1]) {
+				enc->changed[x] = enc->changed[x + 1] = true;
+				again = true;
+			}
+		}
+	} while (again);
+}
+
+void vtenc_line(struct vtenc_t *enc, const struct cell_t *cells, int y, struct outq_t *out)
+{
+	int x = 0, run, dirty, count, next, ech_len, move_len;
+	char buf[32];
+	struct vt_pen_t pen;
+	struct cell_t *shadow = enc->shadow + y * enc->cols;
+
+	vtenc_mark(enc, cells, shadow);
+
+	while (x < enc->cols) {
+		if (!enc->changed[x]) {
+			x++;
+			continue;
+		}
+
+		/* run of blanks with the same background: EL (to the end of line) or ECH */
+		for (run = 0, dirty = 0; x + run < enc->cols && vtenc_blank(enc, &cells[x + run])
+			&& cells[x + run].color_pair.bg == cells[x].color_pair.bg; run++)
+			dirty += enc->changed[x + run];
+
+		pen = vtenc_pen_of(&cells[x]);
+		if (run > 0 && (pen.bg < 0 || (enc->caps & VT_CAP_BCE))) {
+			for (next = x + run; next < enc->cols && !enc->changed[next]; next++);
+			if (x + run == enc->cols && dirty > 3) {
+				vtenc_move(enc, cells, y, x, out);
+				pen.fg        = enc->pen.fg; /* only background matters */
+				pen.underline = enc->pen.underline;
+				vtenc_set_pen(enc, pen, out);
+				outq_push(out, (uint8_t *) "\033[K", 3);
+				memcpy(shadow + x, cells + x, sizeof(struct cell_t) * run);
+				x += run;
+				continue;
+			}
+			ech_len  = sprintf(buf, "\033[%dX", run);
+			move_len = (next < enc->cols) ? 4: 0; /* typical CUF after ECH */
+			if ((enc->caps & VT_CAP_ECH) && ech_len + move_len < dirty) {
+				vtenc_move(enc, cells, y, x, out);
+				pen.fg        = enc->pen.fg; /* only background matters */
+				pen.underline = enc->pen.underline;
+				vtenc_set_pen(enc, pen, out);
+				outq_push(out, (uint8_t *) buf, ech_len);
+				memcpy(shadow + x, cells + x, sizeof(struct cell_t) * run);
+				x += run;
+				continue;
+			}
+		}
+
+		/* run of the same changed char: REP */
+		count = 1;
+		if ((enc->caps & VT_CAP_REP) && cells[x].width == HALF) {
+			while (x + count < enc->cols && enc->changed[x + count]
+				&& cell_equal(&cells[x], &cells[x + count]))
+				count++;
+		}
+
+		vtenc_move(enc, cells, y, x, out);
+		run = vtenc_put(enc, cells, x, count, out);
+		memcpy(shadow + x, cells + x, sizeof(struct cell_t) * run);
+		enc->cells += run;
+		x += run;
+	}
+}
+
+bool vtenc_resize(struct vtenc_t *enc, int cols, int lines)
+{
+	struct cell_t *shadow;
+	bool *changed;
+
+	if ((shadow = erealloc(enc->shadow, sizeof(struct cell_t) * cols * lines)) == NULL)
+		return false;
+	enc->shadow = shadow;
+	if ((changed = erealloc(enc->changed, sizeof(bool) * cols)) == NULL)
+		return false;
+	enc->changed = changed;
+
+	enc->cols  = cols;
+	enc->lines = lines;
+	enc->valid = false;
+	return true;
+}
+
+bool vtenc_init(struct vtenc_t *enc, struct terminal_t *term, enum vt_caps caps)
+{
+	memset(enc, 0, sizeof(struct vtenc_t));
+	enc->caps  = caps;
+	enc->space = term->glyph[DEFAULT_CHAR];
+
+	return vtenc_resize(enc, term->cols, term->lines);
+}
+
+void vtenc_die(struct vtenc_t *enc)
+{
+	free(enc->shadow);
+	free(enc->changed);
+	memset(enc, 0, sizeof(struct vtenc_t));
+}
+
+void vtenc_invalidate(struct vtenc_t *enc)
+{
+	/* outer screen was changed by someone else (reattach, resize): next frame repaints all */
+	enc->valid = false;
+}
+
+ssize_t vtenc_frame(struct vtenc_t *enc, struct terminal_t *term, struct outq_t *out)
+{
+	/*
+		append sequences updating outer terminal to the current screen of term
+		only dirty lines are compared (call before line_dirty is cleared by drawing)
+		return number of bytes appended (-1: couldn't resize shadow)
+	*/
+	char buf[32];
+	bool visible;
+	size_t len = out->len;
+	struct cell_t blank;
+
+	if ((term->cols != enc->cols || term->lines != enc->lines)
+		&& !vtenc_resize(enc, term->cols, term->lines))
+		return -1;
+
+	if (!enc->valid) {
+		/* outer screen unknown: reset pen, clear with default colors */
+		outq_push(out, (uint8_t *) "\033[m\033[H\033[2J", 10);
+		blank.glyphp        = enc->space;
+		blank.color_pair.fg = DEFAULT_FG;
+		blank.color_pair.bg = DEFAULT_BG;
+		blank.attribute     = ATTR_RESET;
+		blank.width         = HALF;
+		for (int i = 0; i < enc->cols * enc->lines; i++)
+			enc->shadow[i] = blank;
+		enc->pen          = (struct vt_pen_t) { .fg = -1, .bg = -1, .underline = false };
+		enc->cursor.x     = enc->cursor.y = 0;
+		enc->cursor_known = true;
+		enc->cursor_visible = !(term->mode & MODE_CURSOR);
+	}
+
+	for (int y = 0; y < term->lines; y++) {
+		if (term->line_dirty[y] || !enc->valid)
+			vtenc_line(enc, term->cells[y], y, out);
+	}
+	enc->valid = true;
+
+	vtenc_move(enc, term->cells[term->cursor.y], term->cursor.y, term->cursor.x, out);
+	visible = term->mode & MODE_CURSOR;
+	if (visible != enc->cursor_visible) {
+		outq_push(out, (uint8_t *) buf, sprintf(buf, "\033[?25%c", visible ? 'h': 'l'));
+		enc->cursor_visible = visible;
+	}
+
+	enc->frames++;
+	enc->bytes += out->len - len;
+	return out->len - len;
+}
+
+/* predict.h */
+/*
+	local echo prediction: keystrokes are shown before the child echoes them
+		- predict_input() takes the keys sent to the child: printable chars, BS/DEL and
+		  cursor left/right are applied to an overlay above term->cells
+		- predict_update() (after parse()) checks the real grid in order: a prediction is
+		  confirmed when its glyph (or cursor, for motion) appears, all are rolled back when
+		  the cell changes to something else or no echo arrives in PREDICT_TIMEOUT
+		- other keys make the cursor unknown: chars typed meanwhile are placed when the real
+		  cursor moves, after the ones already echoed there (same for chars of a misprediction)
+		- each of them starts a new epoch, shown only after one of its predictions is
+		  confirmed: nothing is shown at password prompts (no echo) or after misprediction
+		- disabled while a full-screen app is detected: scroll margin, origin mode or hidden cursor
+	draw by predict_line() and predict_cursor() instead of term->cells and term->cursor
+*/
+static inline struct prediction_t *predict_at(struct predict_t *pr, int i)
+{
+	return &pr->list[(pr->head + i) % PREDICT_MAX];
+}
+
+static inline bool predict_fullscreen(struct terminal_t *term)
+{
+	return term->scroll.top != 0 || term->scroll.bottom != term->lines - 1
+		|| (term->mode & MODE_ORIGIN) || !(term->mode & MODE_CURSOR);
+}
+
+static inline bool predict_resized(struct predict_t *pr)
+{
+	return pr->cols != pr->term->cols || pr->lines != pr->term->lines;
+}
+
+void predict_init(struct predict_t *pr, struct terminal_t *term)
+{
+	memset(pr, 0, sizeof(struct predict_t));
+	pr->term  = term;
+	pr->cols  = term->cols;
+	pr->lines = term->lines;
+	pr->epoch = 1; /* confirmed: 0 */
+}
+
+void predict_touch(struct predict_t *pr)
+{
+	/* overlay changed: lines of shown predictions and cursor must be redrawn */
+	struct prediction_t *p;
+
+	for (int i = 0; i < pr->count; i++) {
+		p = predict_at(pr, i);
+		if (p->epoch <= pr->confirmed)
+			pr->term->line_dirty[p->pos.y] = true;
+	}
+	pr->term->line_dirty[pr->term->cursor.y] = true;
+}
+
+void predict_lost(struct predict_t *pr)
+{
+	/* key not predictable: keep pending predictions, but don't guess where later keys go */
+	if (pr->lost) {
+		pr->blind_valid = false;
+	} else {
+		pr->lost        = true;
+		pr->lost_at     = (pr->count > 0) ? predict_at(pr, pr->count - 1)->cursor: pr->term->cursor;
+		pr->blind_valid = true;
+	}
+	pr->epoch++;
+}
+
+const struct glyph_t *predict_glyph(struct predict_t *pr, int y, int x)
+{
+	/* glyph at (x, y) after all pending predictions */
+	struct prediction_t *p;
+
+	for (int i = pr->count - 1; i >= 0; i--) {
+		p = predict_at(pr, i);
+		if (p->has_cell && p->pos.y == y && p->pos.x == x)
+			return p->cell.glyphp;
+	}
+	return pr->term->cells[y][x].glyphp;
+}
+
+bool predict_line_end(struct predict_t *pr, struct point_t cursor)
+{
+	/* no text right of cursor: line editors append (insertion shifts the rest of line) */
+	for (int x = cursor.x + 1; x < pr->cols; x++) {
+		if (predict_glyph(pr, cursor.y, x) != pr->term->glyph[DEFAULT_CHAR])
+			return false;
+	}
+	return true;
+}
+
+bool predict_base(struct predict_t *pr, struct point_t *cursor)
+{
+	/* cursor after all pending predictions: false if unknown */
+	struct terminal_t *term = pr->term;
+
+	if (pr->count >= PREDICT_MAX || pr->lost
+		|| predict_resized(pr) || predict_fullscreen(term))
+		return false;
+
+	if (pr->count > 0) {
+		*cursor = predict_at(pr, pr->count - 1)->cursor;
+		return true;
+	} else if (term->wrap_occured) {
+		return false;
+	}
+	*cursor = term->cursor;
+	return true;
+}
+
+void predict_push(struct predict_t *pr, uint32_t code, const struct cell_t *cell,
+	struct point_t pos, struct point_t cursor)
+{
+	struct prediction_t *p;
+
+	p = predict_at(pr, pr->count);
+	p->epoch    = pr->epoch;
+	p->time     = timeline_now();
+	p->code     = code;
+	p->has_cell = (cell != NULL);
+	p->pos      = pos;
+	p->cursor   = cursor;
+	p->orig     = predict_glyph(pr, pos.y, pos.x); /* echo of earlier prediction comes first */
+
+	if (cell)
+		p->cell = *cell;
+	pr->count++;
+
+	if (p->epoch <= pr->confirmed) {
+		pr->term->line_dirty[pos.y] = true;
+		pr->term->line_dirty[pr->term->cursor.y] = true;
+	}
+}
+
+static inline bool predict_printable(struct terminal_t *term, uint32_t code)
+{
+	return code < UCS2_CHARS && wcwidth(code) == 1
+		&& term->glyph[code] && term->glyph[code]->width == HALF;
+}
+
+void predict_char(struct predict_t *pr, uint32_t code)
+{
+	struct terminal_t *term = pr->term;
+	struct point_t cursor, next;
+	struct cell_t cell;
+
+	if (pr->lost && !predict_fullscreen(term) && predict_printable(term, code)) {
+		/* typed blind: placed by predict_found() */
+		if (pr->blind_count < PREDICT_MAX)
+			pr->blind[pr->blind_count++] = code;
+		else
+			pr->blind_valid = false;
+		return;
+	}
+
+	if (!predict_base(pr, &cursor) || !predict_printable(term, code)
+		|| cursor.x >= term->cols - 1 /* auto wrap */
+		|| term->cells[cursor.y][cursor.x].width != HALF
+		|| !predict_line_end(pr, cursor)) {
+		predict_lost(pr);
+		return;
+	}
+
+	cell   = pen_cell(term, term->glyph[code]);
+	next   = cursor;
+	next.x = cursor.x + 1;
+	predict_push(pr, code, &cell, cursor, next);
+}
+
+void predict_backspace(struct predict_t *pr)
+{
+	/* echo of erase: "\b \b" */
+	struct terminal_t *term = pr->term;
+	struct point_t cursor;
+	struct cell_t cell;
+
+	if (!predict_base(pr, &cursor) || cursor.x == 0
+		|| term->cells[cursor.y][cursor.x - 1].width != HALF
+		|| !predict_line_end(pr, cursor)) {
+		predict_lost(pr);
+		return;
+	}
+
+	cell = pen_cell(term, term->glyph[DEFAULT_CHAR]);
+	cell.color_pair = term->color_pair; /* bce: same as erase_cell() */
+	cell.attribute  = ATTR_RESET;
+	cursor.x--;
+	predict_push(pr, 0, &cell, cursor, cursor);
+}
+
+void predict_move(struct predict_t *pr, int offset)
+{
+	/* cursor left/right: line editors don't move right beyond text */
+	struct point_t cursor, next;
+
+	if (!predict_base(pr, &cursor)
+		|| cursor.x + offset < 0 || cursor.x + offset >= pr->term->cols
+		|| (offset > 0 && predict_line_end(pr, cursor)
+			&& predict_glyph(pr, cursor.y, cursor.x) == pr->term->glyph[DEFAULT_CHAR])) {
+		predict_lost(pr);
+		return;
+	}
+
+	next    = cursor;
+	next.x += offset;
+	predict_push(pr, 0, NULL, next, next);
+}
+
+void predict_input(struct predict_t *pr, const uint8_t *buf, size_t size)
+{
+	/* keys written to child: call before (or right after) writing them */
+	uint8_t ch;
+
+	pr->last_input = timeline_now();
+
+	for (size_t i = 0; i < size; i++) {
+		ch = buf[i];
+
+		if (pr->following > 0) {
+			if ((ch & 0xC0) != 0x80) {
+				pr->following = 0;
+				predict_lost(pr);
+			} else {
+				pr->code = (pr->code << 6) | (ch & 0x3F);
+				if (--pr->following == 0)
+					predict_char(pr, pr->code);
+			}
+		} else if (pr->esc == 1) { /* ESC */
+			pr->esc = (ch == '[' || ch == 'O') ? 2: 0;
+			if (pr->esc == 0)
+				predict_lost(pr); /* meta key */
+		} else if (pr->esc >= 2) { /* ESC [, ESC O */
+			if (0x40 <= ch && ch <= 0x7E) {
+				if (pr->esc == 2 && ch == 'C')
+					predict_move(pr, 1);
+				else if (pr->esc == 2 && ch == 'D')
+					predict_move(pr, -1);
+				else
+					predict_lost(pr);
+				pr->esc = 0;
+			} else {
+				pr->esc = 3; /* parameter or intermediate */
+			}
+		} else if (ch == ESC) {
+			pr->esc = 1;
+		} else if (ch == BS || ch == DEL) {
+			predict_backspace(pr);
+		} else if (ch < SPACE) {
+			predict_lost(pr);
+		} else if (ch < 0x80) {
+			predict_char(pr, ch);
+		} else if ((ch & 0xE0) == 0xC0) {
+			pr->code = ch & 0x1F;
+			pr->following = 1;
+		} else if ((ch & 0xF0) == 0xE0) {
+			pr->code = ch & 0x0F;
+			pr->following = 2;
+		} else if ((ch & 0xF8) == 0xF0) {
+			pr->code = ch & 0x07;
+			pr->following = 3;
+		} else {
+			predict_lost(pr);
+		}
+	}
+}
+
+void predict_place(struct predict_t *pr)
+{
+	/* cursor is known again: place chars typed blind after the ones echoed already */
+	struct terminal_t *term = pr->term;
+	struct point_t cursor = term->cursor;
+	int echoed, count;
+
+	/* longest match left of cursor */
+	echoed = (pr->blind_count < cursor.x) ? pr->blind_count: cursor.x;
+	for (; echoed > 0; echoed--) {
+		int i;
+
+		for (i = 0; i < echoed; i++) {
+			if (term->cells[cursor.y][cursor.x - echoed + i].glyphp != term->glyph[pr->blind[i]])
+				break;
+		}
+		if (i == echoed)
+			break;
+	}
+
+	count           = pr->blind_count;
+	pr->lost        = false;
+	pr->blind_count = 0;
+	for (int i = echoed; i < count && !pr->lost; i++)
+		predict_char(pr, pr->blind[i]);
+
+	if (pr->lost) /* rest of blind chars are lost */
+		pr->blind_valid = false;
+}
+
+void predict_found(struct predict_t *pr, uint64_t now)
+{
+	/* lost and nothing pending: wait until the cursor moves or input pauses */
+	struct point_t cursor = pr->term->cursor;
+
+	if (pr->blind_valid && (cursor.x != pr->lost_at.x || cursor.y != pr->lost_at.y)) {
+		predict_place(pr);
+	} else if (now - pr->last_input > PREDICT_TIMEOUT * 1000ULL) {
+		/* everything typed is echoed already (or never will be) */
+		pr->lost        = false;
+		pr->blind_count = 0;
+	}
+}
+
+void predict_reset(struct predict_t *pr, bool replay)
+{
+	/*
+		drop all predictions: with replay (misprediction), chars of them not echoed yet
+		are predicted again from the real cursor, otherwise wait for a pause of input
+	*/
+	struct prediction_t *p;
+	bool valid = !pr->lost; /* can't replay across unpredictable key */
+
+	if (!predict_resized(pr))
+		predict_touch(pr);
+
+	for (int i = 0; i < pr->count; i++) {
+		p = predict_at(pr, i);
+		pr->blind[i] = p->code;
+		if (p->code == 0)
+			valid = false;
+	}
+	pr->blind_count = pr->count;
+
+	pr->head  = pr->count = 0;
+	pr->cols  = pr->term->cols;
+	pr->lines = pr->term->lines;
+	pr->lost  = false;
+	predict_lost(pr);
+
+	if (replay && valid && pr->blind_count > 0) {
+		predict_place(pr);
+	} else {
+		pr->blind_count = 0;
+		pr->blind_valid = false;
+	}
+}
+
+bool predict_later(struct predict_t *pr, struct prediction_t *p, const struct glyph_t *real)
+{
+	/* echo of a later prediction of the same cell already overwrote p (e.g. "a" and BS) */
+	struct prediction_t *later;
+
+	for (int i = 1; i < pr->count; i++) {
+		later = predict_at(pr, i);
+		if (later->has_cell && later->pos.x == p->pos.x && later->pos.y == p->pos.y
+			&& later->cell.glyphp == real)
+			return true;
+	}
+	return false;
+}
+
+int predict_update(struct predict_t *pr)
+{
+	/*
+		check pending predictions against the real grid: call after parse()
+		and periodically while it returns non zero (timeout)
+		return number of pending predictions (-1: cursor unknown)
+	*/
+	struct terminal_t *term = pr->term;
+	struct prediction_t *p;
+	const struct glyph_t *real;
+	uint64_t now = timeline_now();
+
+	if (predict_resized(pr) || predict_fullscreen(term)) {
+		if (pr->count > 0 || !pr->lost || pr->blind_valid)
+			predict_reset(pr, false);
+		else if (now - pr->last_input > PREDICT_TIMEOUT * 1000ULL)
+			pr->lost = false; /* next key is unpredictable, or starts over */
+		return pr->lost ? -1: 0;
+	}
+
+	while (pr->count > 0) {
+		p = predict_at(pr, 0);
+
+		if (p->has_cell) {
+			real = term->cells[p->pos.y][p->pos.x].glyphp;
+			if (real == p->cell.glyphp || predict_later(pr, p, real))
+				goto confirm;
+			if (real != p->orig) {
+				logging(LOG_DEBUG, "predict: mismatch at (%d, %d)\n", p->pos.x, p->pos.y);
+				pr->rollbacks++;
+				predict_reset(pr, true);
+				break;
+			}
+		} else if (term->cursor.x == p->cursor.x && term->cursor.y == p->cursor.y) {
+			goto confirm;
+		}
+
+		if (now - p->time > PREDICT_TIMEOUT * 1000ULL) {
+			logging(LOG_DEBUG, "predict: no echo at (%d, %d)\n", p->pos.x, p->pos.y);
+			pr->expires++;
+			predict_reset(pr, false);
+		}
+		break;
+confirm:
+		if (p->epoch > pr->confirmed) {
+			pr->confirmed = p->epoch;
+			predict_touch(pr); /* rest of this epoch is shown now */
+		}
+		term->line_dirty[p->pos.y] = true;
+		pr->confirms++;
+		pr->head = (pr->head + 1) % PREDICT_MAX;
+		pr->count--;
+	}
+
+	if (pr->count == 0 && pr->lost)
+		predict_found(pr, now);
+	return pr->lost ? -1: pr->count;
+}
+
+int predict_line(struct predict_t *pr, int y, struct cell_t *line)
+{
+	/* copy line y of the real grid with shown predictions applied (term->cols cells) */
+	struct prediction_t *p;
+	int count = 0;
+
+	memcpy(line, pr->term->cells[y], sizeof(struct cell_t) * pr->term->cols);
+	if (predict_resized(pr))
+		return 0;
+
+	for (int i = 0; i < pr->count; i++) {
+		p = predict_at(pr, i);
+		if (p->has_cell && p->pos.y == y && p->epoch <= pr->confirmed) {
+			line[p->pos.x] = p->cell;
+			count++;
+		}
+	}
+	return count;
+}
+
+struct point_t predict_cursor(struct predict_t *pr)
+{
+	/* cursor after the newest shown prediction */
+	struct prediction_t *p;
+
+	if (!predict_resized(pr)) {
+		for (int i = pr->count - 1; i >= 0; i--) {
+			p = predict_at(pr, i);
+			if (p->epoch <= pr->confirmed)
+				return p->cursor;
+		}
+	}
+	return pr->term->cursor;
+}
+
+/* parse.h */
+void (*ctrl_func[CTRL_CHARS])(struct terminal_t *term) = {
+	[BS]  = bs,
+	[HT]  = tab,
+	[LF]  = newline,
+	[VT]  = newline,
+	[FF]  = newline,
+	[CR]  = carriage_return,
+	[SO]  = shift_out,
+	[SI]  = shift_in,
+	[ESC] = enter_esc,
+};
+
+void (*esc_func[ESC_CHARS])(struct terminal_t *term) = {
+	['7'] = save_state,
+	['8'] = restore_state,
+	['D'] = newline,
+	['E'] = crnl,
+	['H'] = set_tabstop,
+	['M'] = reverse_nl,
+	['P'] = enter_dcs,
+	['Z'] = identify,
+	['['] = enter_csi,
+	[']'] = enter_osc,
+	['c'] = ris,
+	['n'] = ls2,
+	['o'] = ls3,
+};
+
+void (*csi_func[ESC_CHARS])(struct terminal_t *term, struct parm_t *) = {
+	['@'] = insert_blank,
+	['A'] = curs_up,
+	['B'] = curs_down,
+	['C'] = curs_forward,
+	['D'] = curs_back,
+	['E'] = curs_nl,
+	['F'] = curs_pl,
+	['G'] = curs_col,
+	['H'] = curs_pos,
+	['J'] = erase_display,
+	['K'] = erase_line,
+	['L'] = insert_line,
+	['M'] = delete_line,
+	['P'] = delete_char,
+	['X'] = erase_char,
+	['a'] = curs_forward,
+	['c'] = device_attribute,
+	['d'] = curs_line,
+	['e'] = curs_down,
+	['f'] = curs_pos,
+	['g'] = clear_tabstop,
+	['h'] = set_mode,
+	['l'] = reset_mode,
+	['m'] = set_attr,
+	['n'] = status_report,
+	['r'] = set_margin,
+	/* XXX: not implemented because these sequences conflict DECSLRM/DECSHTS
+	['s'] = sco_save_state,
+	['u'] = sco_restore_state,
+	*/
+	['`'] = curs_col,
+};
+
+/* ctr char/esc sequence/charset function */
+void control_character(struct terminal_t *term, uint8_t ch)
+{
+	static const char *ctrl_char[] = {
+		"NUL", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK", "BEL",
+		"BS ", "HT ", "LF ", "VT ", "FF ", "CR ", "SO ", "SI ",
+		"DLE", "DC1", "DC2", "DC3", "DC4", "NAK", "SYN", "ETB",
+		"CAN", "EM ", "SUB", "ESC", "FS ", "GS ", "RS ", "US ",
+	};
+
+	*term->esc.bp = '\0';
+
+	logging(DEBUG, "ctl: %s\n", ctrl_char[ch]);
+
+	if (ctrl_func[ch])
+		ctrl_func[ch](term);
+}
+
+void esc_sequence(struct terminal_t *term, uint8_t ch)
+{
+	*term->esc.bp = '\0';
+
+	logging(DEBUG, "esc: ESC %s\n", term->esc.buf);
+
+	if (strlen(term->esc.buf) == 1 && esc_func[ch])
+		esc_func[ch](term);
+	else if (strlen(term->esc.buf) == 2 && strchr("()*+", term->esc.buf[0]))
+		designate_charset(term, term->esc.buf[0], ch);
+
+	/* not reset if csi/osc/dcs seqence */
+	if (ch == '[' || ch == ']' || ch == 'P')
+		return;
+
+	reset_esc(term);
+}
+
+void csi_sequence(struct terminal_t *term, uint8_t ch)
+{
+	struct parm_t parm;
+
+	*(term->esc.bp - 1) = '\0'; /* omit final character */
+
+	logging(DEBUG, "csi: CSI %s\n", term->esc.buf + 1);
+
+	reset_parm(&parm);
+	parse_arg(term->esc.buf + 1, &parm, ';', isdigit); /* skip '[' */
+
+	if (csi_func[ch])
+		csi_func[ch](term, &parm);
+
+	reset_esc(term);
+}
+
+void osc_sequence(struct terminal_t *term, uint8_t ch)
+{
+	int mode;
+	struct parm_t parm;
+
+	/* omit terminator: BEL or ESC '\' */
+	term->esc.bp -= (ch == BEL) ? 1: 2;
+	*term->esc.bp = '\0';
+
+	logging(LOG_DEBUG, "osc: OSC %s\n", term->esc.buf + 1);
+
+	reset_parm(&parm);
+	parse_arg(term->esc.buf + 1, &parm, ';', isgraph); /* skip ']' */
+
+	if (parm.argc > 0) {
+		mode = dec2num(parm.argv[0]);
+		if (mode == OSC_SET_PALETTE)
+			set_palette(term, &parm, ch);
+		else if (mode == OSC_SET_FG || mode == OSC_SET_BG)
+			set_default_color(term, &parm, ch);
+		else if (mode == OSC_RESET_PALETTE)
+			reset_palette(term, &parm);
+	}
+	reset_esc(term);
+}
+
+void dcs_sequence(struct terminal_t *term, uint8_t ch)
+{
+  (void) ch;
+	reset_esc(term);
+}
+
+void utf8_charset(struct terminal_t *term, uint8_t ch)
+{
+	if (0x80 <= ch && ch <= 0xBF) {
+		/* check illegal UTF-8 sequence
+			* ? byte sequence: first byte must be between 0xC2 ~ 0xFD
+			* 2 byte sequence: first byte must be between 0xC2 ~ 0xDF
+			* 3 byte sequence: second byte following 0xE0 must be between 0xA0 ~ 0xBF
+			* 4 byte sequence: second byte following 0xF0 must be between 0x90 ~ 0xBF
+			* 5 byte sequence: second byte following 0xF8 must be between 0x88 ~ 0xBF
+			* 6 byte sequence: second byte following 0xFC must be between 0x84 ~ 0xBF
+		*/
+		if ((term->charset.following_byte == 0)
+			|| (term->charset.following_byte == 1 && term->charset.count == 0 && term->charset.code <= 1)
+			|| (term->charset.following_byte == 2 && term->charset.count == 0 && term->charset.code == 0 && ch < 0xA0)
+			|| (term->charset.following_byte == 3 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x90)
+			|| (term->charset.following_byte == 4 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x88)
+			|| (term->charset.following_byte == 5 && term->charset.count == 0 && term->charset.code == 0 && ch < 0x84))
+			term->charset.is_valid = false;
+
+		term->charset.code <<= 6;
+		term->charset.code += ch & 0x3F;
+		term->charset.count++;
+	} else if (0xC0 <= ch && ch <= 0xDF) {
+		term->charset.code = ch & 0x1F;
+		term->charset.following_byte = 1;
+		term->charset.count = 0;
+		return;
+	} else if (0xE0 <= ch && ch <= 0xEF) {
+		term->charset.code = ch & 0x0F;
+		term->charset.following_byte = 2;
+		term->charset.count = 0;
+		return;
+	} else if (0xF0 <= ch && ch <= 0xF7) {
+		term->charset.code = ch & 0x07;
+		term->charset.following_byte = 3;
+		term->charset.count = 0;
+		return;
+	} else if (0xF8 <= ch && ch <= 0xFB) {
+		term->charset.code = ch & 0x03;
+		term->charset.following_byte = 4;
+		term->charset.count = 0;
+		return;
+	} else if (0xFC <= ch && ch <= 0xFD) {
+		term->charset.code = ch & 0x01;
+		term->charset.following_byte = 5;
+		term->charset.count = 0;
+		return;
+	} else { /* 0xFE - 0xFF: not used in UTF-8 */
+		add_char(term, REPLACEMENT_CHAR);
+		reset_charset(term);
+		return;
+	}
+
+	if (term->charset.count >= term->charset.following_byte) {
+		/*	illegal code point (ref: http://www.unicode.org/reports/tr27/tr27-4.html)
+			0xD800   ~ 0xDFFF : surrogate pair
+			0xFDD0   ~ 0xFDEF : noncharacter
+			0xnFFFE  ~ 0xnFFFF: noncharacter (n: 0x00 ~ 0x10)
+			0x110000 ~        : invalid (unicode U+0000 ~ U+10FFFF)
+		*/
+		if (!term->charset.is_valid
+			|| (0xD800 <= term->charset.code && term->charset.code <= 0xDFFF)
+			|| (0xFDD0 <= term->charset.code && term->charset.code <= 0xFDEF)
+			|| ((term->charset.code & 0xFFFF) == 0xFFFE || (term->charset.code & 0xFFFF) == 0xFFFF)
+			|| (term->charset.code > 0x10FFFF))
+			add_char(term, REPLACEMENT_CHAR);
+		else
+			add_char(term, term->charset.code);
+
+		reset_charset(term);
+	}
+}
+
+void parse(struct terminal_t *term, uint8_t *buf, int size)
+{
+	/*
+		CTRL CHARS      : 0x00 ~ 0x1F
+		ASCII(printable): 0x20 ~ 0x7E
+		CTRL CHARS(DEL) : 0x7F
+		UTF-8           : 0x80 ~ 0xFF
+	*/
+	uint8_t ch;
+
+	if (term->recorder)
+		rec_input(term->recorder, term, buf, size);
+
+	for (int i = 0; i < size; i++) {
+		ch = buf[i];
+		if (term->esc.state == STATE_RESET) {
+			/* interrupted by illegal byte */
+			if (term->charset.following_byte > 0 && (ch < 0x80 || ch > 0xBF)) {
+				add_char(term, REPLACEMENT_CHAR);
+				reset_charset(term);
+			}
+
+			if (ch <= 0x1F)
+				control_character(term, ch);
+			else if (ch <= 0x7F)
+				/* translate only if GL is not US-ASCII */
+				add_char(term, term->iso2022.table ? term->iso2022.table[ch]: ch);
+			else
+				utf8_charset(term, ch);
+		} else if (term->esc.state == STATE_ESC) {
+			if (push_esc(term, ch))
+				esc_sequence(term, ch);
+		} else if (term->esc.state == STATE_CSI) {
+			if (push_esc(term, ch))
+				csi_sequence(term, ch);
+		} else if (term->esc.state == STATE_OSC) {
+			if (push_esc(term, ch))
+				osc_sequence(term, ch);
+		} else if (term->esc.state == STATE_DCS) {
+			if (push_esc(term, ch))
+				dcs_sequence(term, ch);
+		}
+	}
+
+	/* batch palette updates: rebuild pixel_palette at most once per call */
+	if (term->palette_pending)
+		update_pixel_palette(term);
+
+	/* all replies of this call are written by one syscall */
+	reply_flush(term);
+}
+
+#if defined(HAVE_IO_URING)
+/* uring.h */
+/*
+	minimal io_uring wrapper (no liburing dependency)
+		- pty master is read by multishot read into provided buffer ring
+		- all queued SQEs (read arm, write, poll) are submitted by one io_uring_enter()
+*/
+enum {
+	URING_OP_READ_MULTISHOT = 49, /* IORING_OP_READ_MULTISHOT (linux 6.7): missing in old headers */
+	URING_BGID              = 0,  /* buffer group id of provided buffer ring */
+};
+
+int eio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags, void *arg, size_t argsz)
+{
+	int ret;
+	errno = 0;
+
+	if ((ret = syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz)) < 0) {
+		if (errno == EINTR || errno == ETIME)
+			return 0;
+		else
+			logging(LOG_ERROR, "io_uring_enter: %s\n", strerror(errno));
+	}
+	return ret;
+}
+
+bool uring_probe(struct uring_t *ring, int op)
+{
+	bool supported = false;
+	struct io_uring_probe *probe;
+	size_t size = sizeof(struct io_uring_probe) + UINT8_MAX * sizeof(struct io_uring_probe_op);
+
+	if ((probe = ecalloc(1, size)) == NULL)
+		return false;
+
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, UINT8_MAX) == 0
+		&& op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+		supported = true;
+
+	free(probe);
+	return supported;
+}
+
+void uring_provide(struct uring_t *ring, uint16_t bid)
+{
+	/* never touch resv field: it overlaps tail of the ring */
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uintptr_t) (ring->bufs + (size_t) bid * URING_BUF_SIZE);
+	buf->len  = URING_BUF_SIZE;
+	buf->bid  = bid;
+
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+void uring_die(struct uring_t *ring)
+{
+	if (ring->bufs)
+		emunmap(ring->bufs, (size_t) URING_BUFS * URING_BUF_SIZE);
+	if (ring->br)
+		emunmap(ring->br, URING_BUFS * sizeof(struct io_uring_buf));
+	if (ring->sqes_ptr)
+		emunmap(ring->sqes_ptr, ring->sqes_len);
+	if (ring->ring_ptr)
+		emunmap(ring->ring_ptr, ring->ring_len);
+	if (ring->fd >= 0)
+		eclose(ring->fd);
+	free(ring->deferred);
+}
+
+bool uring_init(struct uring_t *ring)
+{
+	uint8_t *ptr;
+	size_t sq_len, cq_len;
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+
+	memset(ring, 0, sizeof(struct uring_t));
+	memset(&params, 0, sizeof(params));
+
+	errno = 0;
+	if ((ring->fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &params)) < 0) {
+		logging(LOG_WARN, "io_uring_setup: %s\n", strerror(errno));
+		return false;
+	}
+
+	/* EXT_ARG: wait with timeout, SINGLE_MMAP: SQ and CQ share one mapping */
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)
+		|| !uring_probe(ring, URING_OP_READ_MULTISHOT)) {
+		logging(LOG_WARN, "io_uring: multishot read or required feature not supported\n");
+		goto err;
+	}
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_len = (sq_len > cq_len) ? sq_len: cq_len;
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ptr = emmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		ring->ring_ptr = NULL;
+		goto err;
+	}
+	ring->ring_ptr = ptr;
+
+	ring->sqes_ptr = emmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes_ptr == MAP_FAILED) {
+		ring->sqes_ptr = NULL;
+		goto err;
+	}
+
+	ring->sq_head    = (unsigned *) (ptr + params.sq_off.head);
+	ring->sq_tail    = (unsigned *) (ptr + params.sq_off.tail);
+	ring->sq_mask    = (unsigned *) (ptr + params.sq_off.ring_mask);
+	ring->sq_array   = (unsigned *) (ptr + params.sq_off.array);
+	ring->cq_head    = (unsigned *) (ptr + params.cq_off.head);
+	ring->cq_tail    = (unsigned *) (ptr + params.cq_off.tail);
+	ring->cq_mask    = (unsigned *) (ptr + params.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+	ring->sqes       = (struct io_uring_sqe *) ring->sqes_ptr;
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail   = *ring->sq_tail;
+
+	/* provided buffer ring: kernel picks a free buffer for each read completion */
+	ring->br = emmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	ring->bufs = emmap(NULL, (size_t) URING_BUFS * URING_BUF_SIZE,
+		PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring->br == MAP_FAILED || ring->bufs == MAP_FAILED) {
+		ring->br   = (ring->br == MAP_FAILED) ? NULL: ring->br;
+		ring->bufs = (ring->bufs == MAP_FAILED) ? NULL: ring->bufs;
+		goto err;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uintptr_t) ring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid         = URING_BGID;
+
+	errno = 0;
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		logging(LOG_WARN, "io_uring_register: PBUF_RING: %s\n", strerror(errno));
+		goto err;
+	}
+
+	for (int bid = 0; bid < URING_BUFS; bid++)
+		uring_provide(ring, bid);
+
+	return true;
+
+err:
+	uring_die(ring);
+	return false;
+}
+
+int uring_submit(struct uring_t *ring, unsigned wait_nr, int timeout)
+{
+	/* timeout: msec (-1: wait forever), used only if wait_nr > 0 */
+	unsigned flags = 0, to_submit;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (wait_nr > 0)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	if (wait_nr > 0 && timeout >= 0) {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uintptr_t) &ts;
+		return eio_uring_enter(ring->fd, to_submit, wait_nr,
+			flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	return eio_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+}
+
+bool uring_reserve(struct uring_t *ring, unsigned count)
+{
+	/* make room for count entries: following uring_get_sqe() calls never fail */
+	if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries) {
+		uring_submit(ring, 0, 0); /* SQ is full: submit queued entries first */
+		if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_entries) {
+			logging(LOG_ERROR, "io_uring: submission queue full\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring)
+{
+	unsigned index;
+	struct io_uring_sqe *sqe;
+
+	if (!uring_reserve(ring, 1))
+		return NULL;
+
+	index = ring->sqe_tail & *ring->sq_mask;
+	sqe   = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+bool uring_read_multishot(struct uring_t *ring, int fd, struct watch_t *watch)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return false;
+
+	sqe->opcode    = URING_OP_READ_MULTISHOT;
+	sqe->fd        = fd;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (uintptr_t) watch;
+
+	return true;
+}
+
+bool uring_write(struct uring_t *ring, int fd, const void *buf, size_t size, struct watch_t *watch)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return false;
+
+	sqe->opcode    = IORING_OP_WRITE;
+	sqe->fd        = fd;
+	sqe->addr      = (uintptr_t) buf;
+	sqe->len       = size;
+	sqe->user_data = (uintptr_t) watch;
+
+	return true;
+}
+
+bool uring_poll(struct uring_t *ring, int fd, unsigned events, bool multishot, struct watch_t *watch)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return false;
+
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = fd;
+	sqe->len           = multishot ? IORING_POLL_ADD_MULTI: 0;
+	sqe->poll32_events = events;
+	sqe->user_data     = (uintptr_t) watch;
+
+	return true;
+}
+
+bool uring_cancel_fd(struct uring_t *ring, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return false;
+
+	sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+	sqe->fd           = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data    = 0; /* completion of cancel request itself is ignored */
+
+	return true;
+}
+#endif
+
+#if defined(__linux__)
+/* ring.h */
+bool ring_init(struct ring_t *ring, size_t size)
+{
+	/* anonymous mapping: only pages actually touched become resident */
+	ring->head = ring->tail = 0;
+	ring->size = size;
+	ring->buf  = emmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+	if (ring->buf == MAP_FAILED) {
+		ring->buf  = NULL;
+		ring->size = 0;
+		return false;
+	}
+	return true;
+}
+
+void ring_die(struct ring_t *ring)
+{
+	if (ring->buf)
+		emunmap(ring->buf, ring->size);
+	ring->buf  = NULL;
+	ring->size = ring->head = ring->tail = 0;
+}
+
+static inline size_t ring_used(struct ring_t *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline size_t ring_write_span(struct ring_t *ring, uint8_t **ptr)
+{
+	/* contiguous free space from tail */
+	size_t offset = ring->tail & (ring->size - 1);
+	size_t space  = ring->size - ring_used(ring);
+
+	*ptr = ring->buf + offset;
+	return (space < ring->size - offset) ? space: ring->size - offset;
+}
+
+static inline size_t ring_read_span(struct ring_t *ring, uint8_t **ptr)
+{
+	/* contiguous data from head */
+	size_t offset = ring->head & (ring->size - 1);
+	size_t used   = ring_used(ring);
+
+	*ptr = ring->buf + offset;
+	return (used < ring->size - offset) ? used: ring->size - offset;
+}
+
+static inline void ring_consume(struct ring_t *ring, size_t size)
+{
+	ring->head += size;
+	if (ring->head == ring->tail) /* empty: restart from the top, keep spans long */
+		ring->head = ring->tail = 0;
+}
+#endif
+
+#if defined(__linux__)
+/* ptylog.h */
+/*
+	raw output log without second copy in user space
+		master --splice--> pipe --tee--> tee pipe --splice--> log file
+		                    |
+		                    +--read--> input ring (parser)
+	tee() only duplicates page references of pipe, log data never goes to user space.
+	rotation: by size (path -> path.1 -> ... path.LOG_KEEP)
+	fdatasync() and rotation are done by syncer thread, never in ptylog_read():
+		- logs are listed by last fdatasync(): thread sleeps until head is due (O(1) per wakeup)
+		- log files are owned by thread: reader only write()s to fd
+		- rotation: reader asks, thread renames and opens next file, reader switches at next read
+*/
+static inline time_t ptylog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+int ptylog_open_file(const char *path, off_t *size)
+{
+	/* not O_APPEND: splice() to append mode file fails (EINVAL) */
+	int fd;
+
+	errno = 0;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		logging(LOG_ERROR, "couldn't open \"%s\"\n", path);
+		logging(LOG_ERROR, "open: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if ((*size = lseek(fd, 0, SEEK_END)) < 0)
+		*size = 0;
+	return fd;
+}
+
+int ptylog_rotate(struct ptylog_t *log, off_t *size)
+{
+	/* syncer thread: path -> path.1 -> ... , return fd of new path */
+	char from[BUFSIZE], to[BUFSIZE];
+
+	for (int i = LOG_KEEP - 1; i >= 0; i--) {
+		if (i == 0)
+			snprintf(from, BUFSIZE, "%s", log->path);
+		else
+			snprintf(from, BUFSIZE, "%s.%d", log->path, i);
+		snprintf(to, BUFSIZE, "%s.%d", log->path, i + 1);
+
+		if (rename(from, to) < 0 && errno != ENOENT)
+			logging(LOG_ERROR, "rename: %s: %s\n", from, strerror(errno));
+	}
+	return ptylog_open_file(log->path, size);
+}
+
+void ptylog_sync(struct ptylog_t *log)
+{
+	/* syncer thread: fdatasync() file left by rotation (once reader switched) and current file */
+	uint64_t written = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+
+	if (log->old_sync_fd >= 0 && __atomic_load_n(&log->next_fd, __ATOMIC_ACQUIRE) < 0) {
+		if (fdatasync(log->old_sync_fd) < 0)
+			logging(LOG_ERROR, "fdatasync: %s\n", strerror(errno));
+		eclose(log->old_sync_fd);
+		log->old_sync_fd = -1;
+	}
+
+	if (written != log->synced_bytes) {
+		if (fdatasync(log->sync_fd) < 0)
+			logging(LOG_ERROR, "fdatasync: %s\n", strerror(errno));
+		log->synced_bytes = written;
+	}
+}
+
+void ptylog_free(struct ptylog_t *log)
+{
+	/* syncer thread (or ptylog_close() without syncer): last fdatasync() of released log */
+	if (log->old_sync_fd >= 0)
+		__atomic_store_n(&log->next_fd, -1, __ATOMIC_RELEASE); /* reader is gone */
+	ptylog_sync(log);
+	eclose(log->sync_fd);
+	free(log->path);
+	free(log);
+}
+
+static inline void ptylog_unlink(struct log_syncer_t *syncer, struct ptylog_t *log)
+{
+	/* lock held */
+	if (log->prev)
+		log->prev->next = log->next;
+	else
+		syncer->head = log->next;
+
+	if (log->next)
+		log->next->prev = log->prev;
+	else
+		syncer->tail = log->prev;
+
+	log->prev = log->next = NULL;
+}
+
+static inline void ptylog_link(struct log_syncer_t *syncer, struct ptylog_t *log, bool head)
+{
+	/* lock held: head for rotation request, tail for just synced log (keeps list ordered) */
+	if (head) {
+		log->prev = NULL;
+		log->next = syncer->head;
+		if (syncer->head)
+			syncer->head->prev = log;
+		else
+			syncer->tail = log;
+		syncer->head = log;
+	} else {
+		log->next = NULL;
+		log->prev = syncer->tail;
+		if (syncer->tail)
+			syncer->tail->next = log;
+		else
+			syncer->head = log;
+		syncer->tail = log;
+	}
+}
+
+void *ptylog_sync_thread(void *arg)
+{
+	/* handle released logs first, then head of list if rotation is requested or fdatasync() is due */
+	int fd;
+	bool rotate;
+	off_t size = 0;
+	struct timespec deadline;
+	struct ptylog_t *log;
+	struct log_syncer_t *syncer = (struct log_syncer_t *) arg;
+
+	pthread_mutex_lock(&syncer->lock);
+	while (true) {
+		if ((log = syncer->closed)) {
+			syncer->closed = log->next;
+			pthread_mutex_unlock(&syncer->lock);
+			ptylog_free(log);
+			pthread_mutex_lock(&syncer->lock);
+			continue;
+		}
+		if (syncer->stop)
+			break;
+
+		if ((log = syncer->head) == NULL) {
+			pthread_cond_wait(&syncer->cond, &syncer->lock);
+			continue;
+		}
+		if (!log->rotate && ptylog_now() - log->synced < LOG_SYNC_INTERVAL) {
+			deadline.tv_sec  = log->synced + LOG_SYNC_INTERVAL;
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&syncer->cond, &syncer->lock, &deadline);
+			continue;
+		}
+
+		ptylog_unlink(syncer, log);
+		rotate       = log->rotate;
+		log->rotate  = false;
+		syncer->busy = log;
+		pthread_mutex_unlock(&syncer->lock);
+
+		ptylog_sync(log);
+		fd = rotate ? ptylog_rotate(log, &size): -1;
+
+		pthread_mutex_lock(&syncer->lock);
+		syncer->busy = NULL;
+		log->synced  = ptylog_now();
+
+		if (fd >= 0) {
+			/* reader takes next_fd at next ptylog_read(), old file is synced and closed after that */
+			log->old_sync_fd  = log->sync_fd;
+			log->sync_fd      = fd;
+			log->synced_bytes = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+			log->next_size    = size;
+			__atomic_store_n(&log->next_fd, fd, __ATOMIC_RELEASE);
+		}
+
+		if (log->closing) {
+			log->next      = syncer->closed;
+			syncer->closed = log;
+		} else {
+			ptylog_link(syncer, log, log->rotate);
+		}
+	}
+	pthread_mutex_unlock(&syncer->lock);
+
+	return NULL;
+}
+
+void ptylog_syncer_init(struct log_syncer_t *syncer)
+{
+	pthread_condattr_t attr;
+
+	memset(syncer, 0, sizeof(struct log_syncer_t));
+	pthread_mutex_init(&syncer->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&syncer->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void ptylog_syncer_die(struct log_syncer_t *syncer)
+{
+	/* released logs are synced and freed, logs still attached are left to ptylog_close() */
+	struct ptylog_t *log;
+
+	if (syncer->running) {
+		pthread_mutex_lock(&syncer->lock);
+		syncer->stop = true;
+		pthread_cond_signal(&syncer->cond);
+		pthread_mutex_unlock(&syncer->lock);
+		pthread_join(syncer->thread, NULL);
+		syncer->running = false;
+	}
+
+	while ((log = syncer->head)) {
+		ptylog_unlink(syncer, log);
+		log->syncer = NULL;
+	}
+	pthread_cond_destroy(&syncer->cond);
+	pthread_mutex_destroy(&syncer->lock);
+}
+
+bool ptylog_attach(struct log_syncer_t *syncer, struct ptylog_t *log)
+{
+	/* start syncing and rotating log (thread is started by the first log) */
+	int ret;
+
+	if (!syncer->running) {
+		syncer->stop = false;
+		if ((ret = pthread_create(&syncer->thread, NULL, ptylog_sync_thread, syncer)) != 0) {
+			logging(LOG_ERROR, "pthread_create: %s\n", strerror(ret));
+			return false;
+		}
+		syncer->running = true;
+	}
+
+	pthread_mutex_lock(&syncer->lock);
+	log->syncer = syncer;
+	log->synced = ptylog_now();
+	ptylog_link(syncer, log, false);
+	pthread_cond_signal(&syncer->cond);
+	pthread_mutex_unlock(&syncer->lock);
+
+	return true;
+}
+
+struct ptylog_t *ptylog_open(const char *path, off_t max_size)
+{
+	struct ptylog_t *log;
+
+	if ((log = ecalloc(1, sizeof(struct ptylog_t))) == NULL)
+		return NULL;
+
+	log->path     = strdup(path);
+	log->max_size = max_size;
+	log->synced   = ptylog_now();
+	log->pipe[0]  = log->pipe[1] = log->tee[0] = log->tee[1] = -1;
+	log->next_fd  = log->old_sync_fd = -1;
+
+	if (!log->path || (log->fd = ptylog_open_file(log->path, &log->size)) < 0)
+		goto err_open;
+	log->sync_fd = log->fd;
+
+	errno = 0;
+	if (pipe2(log->pipe, O_NONBLOCK | O_CLOEXEC) < 0 || pipe2(log->tee, O_NONBLOCK | O_CLOEXEC) < 0) {
+		logging(LOG_ERROR, "pipe2: %s\n", strerror(errno));
+		goto err_pipe;
+	}
+	return log;
+
+err_pipe:
+	for (int i = 0; i < 2; i++) {
+		if (log->pipe[i] >= 0)
+			eclose(log->pipe[i]);
+	}
+	eclose(log->fd);
+err_open:
+	free(log->path);
+	free(log);
+	return NULL;
+}
+
+void ptylog_close(struct ptylog_t *log)
+{
+	/* reader side: log file is synced and closed by syncer thread */
+	struct log_syncer_t *syncer;
+
+	if (!log)
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		eclose(log->pipe[i]);
+		eclose(log->tee[i]);
+	}
+
+	if ((syncer = log->syncer) == NULL) {
+		ptylog_free(log);
+		return;
+	}
+
+	pthread_mutex_lock(&syncer->lock);
+	if (syncer->busy == log) {
+		log->closing = true;
+	} else {
+		ptylog_unlink(syncer, log);
+		log->next      = syncer->closed;
+		syncer->closed = log;
+	}
+	pthread_cond_signal(&syncer->cond);
+	pthread_mutex_unlock(&syncer->lock);
+}
+
+void ptylog_request_rotation(struct ptylog_t *log)
+{
+	/* reader: move log to head of syncer list, fd is switched when next_fd is published */
+	struct log_syncer_t *syncer = log->syncer;
+
+	log->rotating = true;
+
+	pthread_mutex_lock(&syncer->lock);
+	log->rotate = true;
+	if (syncer->busy != log) {
+		ptylog_unlink(syncer, log);
+		ptylog_link(syncer, log, true);
+	}
+	pthread_cond_signal(&syncer->cond);
+	pthread_mutex_unlock(&syncer->lock);
+}
+
+size_t ptylog_drain(struct ptylog_t *log, size_t size)
+{
+	/* tee pipe -> log file: pages are moved in kernel, return moved bytes */
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < size) {
+		errno = 0;
+		if ((ret = splice(log->tee[0], NULL, log->fd, NULL, size - done, SPLICE_F_MOVE)) > 0) {
+			done += ret;
+			log->spliced += ret;
+		} else if (ret < 0 && errno == EINTR) {
+			continue;
+		} else {
+			logging(LOG_ERROR, "splice: %s\n", strerror(errno));
+			break;
+		}
+	}
+	return done;
+}
+
+void ptylog_discard(struct ptylog_t *log, size_t size)
+{
+	/* splice() stopped: empty tee pipe, leftover would be logged after later data */
+	uint8_t buf[BUFSIZE];
+	ssize_t ret;
+
+	while (size > 0) {
+		if ((ret = read(log->tee[0], buf, (size < BUFSIZE) ? size: BUFSIZE)) > 0)
+			size -= ret;
+		else if (ret == 0 || errno != EINTR)
+			break;
+	}
+}
+
+void ptylog_copy(struct ptylog_t *log, const uint8_t *buf, size_t size)
+{
+	/* fallback of tee()/splice(): never sleeps, bytes are dropped (and counted) on error */
+	ssize_t ret;
+
+	while (size > 0) {
+		errno = 0;
+		if ((ret = write(log->fd, buf, size)) > 0) {
+			buf  += ret;
+			size -= ret;
+			log->copied += ret;
+		} else if (ret < 0 && errno == EINTR) {
+			continue;
+		} else {
+			logging(LOG_ERROR, "write: %s\n", strerror(errno));
+			log->dropped += size;
+			break;
+		}
+	}
+}
+
+ssize_t ptylog_read(struct ptylog_t *log, int fd, uint8_t *buf, size_t size)
+{
+	/*
+		replacement of read(fd, buf, size) which also logs read data
+		pipe is empty before and after each call: size is limited by pipe capacity
+	*/
+	int next_fd;
+	ssize_t len, teed, ret;
+	size_t done;
+
+	/* rotated by syncer thread: old file is synced and closed by thread */
+	if (log->rotating && (next_fd = __atomic_load_n(&log->next_fd, __ATOMIC_ACQUIRE)) >= 0) {
+		log->fd       = next_fd;
+		log->size     = log->next_size;
+		log->rotating = false;
+		__atomic_store_n(&log->next_fd, -1, __ATOMIC_RELEASE);
+	}
+
+	if (log->no_splice)
+		goto fallback;
+
+	/* master -> pipe */
+	if ((len = splice(fd, NULL, log->pipe[1], NULL, size, SPLICE_F_NONBLOCK)) < 0
+		&& (errno == EINVAL || errno == ENOSYS)) {
+		logging(LOG_WARN, "splice: %s, fallback to read() for \"%s\"\n", strerror(errno), log->path);
+		log->no_splice = true;
+		goto fallback;
+	}
+	if (len <= 0)
+		return len;
+
+	/* pipe -> tee pipe: page references only */
+	if ((teed = tee(log->pipe[0], log->tee[1], len, SPLICE_F_NONBLOCK)) < 0)
+		teed = 0;
+
+	/* pipe -> parser: the only copy to user space */
+	while ((ret = read(log->pipe[0], buf, len)) < 0 && errno == EINTR);
+	if (ret < 0) {
+		logging(LOG_ERROR, "read: %s\n", strerror(errno));
+		ptylog_discard(log, teed);
+		return ret;
+	}
+
+	/* tee() or splice() failed: rest is copied from buf, in order */
+	if ((done = ptylog_drain(log, teed)) < (size_t) teed)
+		ptylog_discard(log, teed - done);
+	if ((size_t) ret > done)
+		ptylog_copy(log, buf + done, ret - done);
+
+	goto logged;
+
+fallback:
+	/* pty driver without splice_read: one copy to log file, as ptylog_copy() after failed tee() */
+	if ((ret = read(fd, buf, size)) <= 0)
+		return ret;
+	ptylog_copy(log, buf, ret);
+
+logged:
+	log->size += ret;
+	__atomic_store_n(&log->written, log->written + ret, __ATOMIC_RELAXED);
+
+	if (log->syncer && log->max_size > 0 && log->size >= log->max_size && !log->rotating)
+		ptylog_request_rotation(log);
+
+	return ret;
+}
+
+/* spsc.h */
+/*
+	lock-free byte ring: one producer (I/O thread), one consumer (parser thread)
+		- each side writes only its own index (separate cache lines)
+		- the other index is re-read (acquire) only when the cached copy says full/empty
+*/
+struct spsc_ring_t *spsc_new(size_t size)
+{
+	struct spsc_ring_t *ring;
+
+	errno = 0;
+	if (posix_memalign((void **) &ring, CACHE_LINE, sizeof(struct spsc_ring_t)) != 0) {
+		logging(LOG_ERROR, "posix_memalign: %s\n", strerror(errno));
+		return NULL;
+	}
+	memset(ring, 0, sizeof(struct spsc_ring_t));
+
+	ring->size = size;
+	ring->buf  = emmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ring->buf == MAP_FAILED) {
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+void spsc_free(struct spsc_ring_t *ring)
+{
+	if (!ring)
+		return;
+	emunmap(ring->buf, ring->size);
+	free(ring);
+}
+
+static inline size_t spsc_write_span(struct spsc_ring_t *ring, uint8_t **ptr)
+{
+	/* producer: contiguous free space from tail */
+	size_t offset = ring->tail & (ring->size - 1), space;
+
+	if (ring->tail - ring->head_cache == ring->size)
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	space = ring->size - (ring->tail - ring->head_cache);
+	*ptr  = ring->buf + offset;
+	return (space < ring->size - offset) ? space: ring->size - offset;
+}
+
+static inline void spsc_produce(struct spsc_ring_t *ring, size_t size)
+{
+	size_t used;
+
+	ring->produced += size;
+	__atomic_store_n(&ring->tail, ring->tail + size, __ATOMIC_SEQ_CST);
+
+	if ((used = ring->tail - ring->head_cache) > ring->max_used)
+		ring->max_used = used;
+}
+
+static inline size_t spsc_read_span(struct spsc_ring_t *ring, uint8_t **ptr)
+{
+	/* consumer: contiguous data from head */
+	size_t offset = ring->head & (ring->size - 1), used;
+
+	if (ring->tail_cache == ring->head)
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+	used = ring->tail_cache - ring->head;
+	*ptr = ring->buf + offset;
+	return (used < ring->size - offset) ? used: ring->size - offset;
+}
+
+static inline void spsc_consume(struct spsc_ring_t *ring, size_t size)
+{
+	ring->consumed += size;
+	__atomic_store_n(&ring->head, ring->head + size, __ATOMIC_SEQ_CST);
+}
+
+void spsc_stats(struct spsc_ring_t *ring, struct spsc_stats_t *stats)
+{
+	/* approximate while running: each counter is read without lock */
+	stats->size        = ring->size;
+	stats->used        = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)
+		- __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	stats->max_used    = __atomic_load_n(&ring->max_used, __ATOMIC_RELAXED);
+	stats->produced    = __atomic_load_n(&ring->produced, __ATOMIC_RELAXED);
+	stats->consumed    = __atomic_load_n(&ring->consumed, __ATOMIC_RELAXED);
+	stats->full_stalls = __atomic_load_n(&ring->full_stalls, __ATOMIC_RELAXED);
+}
+
+void worker_wake(struct worker_t *worker)
+{
+	uint64_t one = 1;
+
+	if (write(worker->wakefd, &one, sizeof(one)) < 0)
+		logging(LOG_ERROR, "write: eventfd: %s\n", strerror(errno));
+}
+
+void worker_push(struct parser_pool_t *pool, struct session_t *session)
+{
+	/*
+		I/O thread or reactor_write(): session goes to the worker it last ran on (cache affinity)
+		if that worker is busy, an idle worker is woken to steal it
+	*/
+	int index = __atomic_load_n(&session->worker, __ATOMIC_RELAXED);
+	struct worker_t *worker;
+
+	worker = &pool->workers[(index >= 0) ? index:
+		(int) (__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->count)];
+
+	pthread_mutex_lock(&worker->lock);
+	worker->deque[worker->tail++ & (worker->size - 1)] = session;
+	pthread_mutex_unlock(&worker->lock);
+
+	if (__atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		worker_wake(worker);
+		return;
+	}
+
+	if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == 0)
+		return;
+	for (int i = 0; i < pool->count; i++) {
+		if (__atomic_exchange_n(&pool->workers[i].sleeping, 0, __ATOMIC_SEQ_CST)) {
+			worker_wake(&pool->workers[i]);
+			break;
+		}
+	}
+}
+
+static inline bool workers_hold(struct parser_pool_t *pool, struct session_t *session)
+{
+	/* queued, or still in worker_thread() loop: pipeline_pending() runs after queued is cleared */
+	if (__atomic_load_n(&session->queued, __ATOMIC_SEQ_CST))
+		return true;
+	for (int i = 0; i < pool->count; i++) {
+		if (__atomic_load_n(&pool->workers[i].current, __ATOMIC_SEQ_CST) == session)
+			return true;
+	}
+	return false;
+}
+
+void workers_wait(struct parser_pool_t *pool, struct session_t *session)
+{
+	/* sleep until no worker refers session */
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+	while (workers_hold(pool, session))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	__atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pipeline_notify(struct pipeline_t *pl, struct session_t *session)
+{
+	/* I/O thread: queue session once, wake parser thread only if it sleeps */
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&session->queued, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (pl->workers) {
+		worker_push(pl->workers, session);
+		return;
+	}
+
+	pl->ready[pl->ready_tail & (pl->ready_size - 1)] = session;
+	__atomic_store_n(&pl->ready_tail, pl->ready_tail + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&pl->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(pl->wakefd, &one, sizeof(one)) < 0)
+			logging(LOG_ERROR, "write: eventfd: %s\n", strerror(errno));
+	}
+}
+
+void pipeline_arm(struct reactor_t *reactor, struct session_t *session, bool arm)
+{
+	struct epoll_event ev;
+
+	ev.events   = arm ? EPOLLIN: 0;
+	ev.data.ptr = &session->pty_watch;
+	eepoll_ctl(reactor->epfd, EPOLL_CTL_MOD, session->term->fd, &ev);
+}
+
+bool pipeline_read(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		I/O thread: read until EAGAIN or pipe is full, never parse
+		if pipe is full, master is disarmed and re-armed by parser thread after consuming
+		return false if pty was closed
+	*/
+	ssize_t size;
+	size_t space, total = 0;
+	uint8_t *ptr;
+	bool closed = false;
+	struct spsc_ring_t *ring = session->pipe;
+
+	while (true) {
+		if ((space = spsc_write_span(ring, &ptr)) == 0) {
+			/* disarm first: parser's re-arm after seeing stalled must win */
+			pipeline_arm(reactor, session, false);
+			__atomic_store_n(&session->stalled, 1, __ATOMIC_SEQ_CST);
+			if (spsc_write_span(ring, &ptr) > 0
+				&& __atomic_exchange_n(&session->stalled, 0, __ATOMIC_SEQ_CST)) {
+				pipeline_arm(reactor, session, true);
+				continue;
+			}
+			ring->full_stalls++;
+			break;
+		}
+
+		errno = 0;
+		size = session->log ? ptylog_read(session->log, session->term->fd, ptr, space):
+			read(session->term->fd, ptr, space);
+
+		if (size > 0) {
+			spsc_produce(ring, size);
+			total += size;
+		} else if (size < 0 && errno == EINTR) {
+			continue;
+		} else {
+			closed = (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+			break;
+		}
+	}
+
+	if (total > 0)
+		pipeline_notify(reactor->pipeline, session);
+
+	return !closed;
+}
+
+bool pipeline_watch_write(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		EPOLLIN of master is armed by both threads (see pipeline_read()): EPOLLOUT is watched
+		on a dup of master instead, armed only by parser thread (oneshot, see pipeline_flush())
+	*/
+	struct epoll_event ev;
+
+	errno = 0;
+	if ((session->write_fd = fcntl(session->term->fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		logging(LOG_ERROR, "fcntl: F_DUPFD_CLOEXEC: %s\n", strerror(errno));
+		return false;
+	}
+
+	ev.events   = EPOLLONESHOT; /* disarmed */
+	ev.data.ptr = &session->write_watch;
+	if (eepoll_ctl(reactor->epfd, EPOLL_CTL_ADD, session->write_fd, &ev) < 0) {
+		eclose(session->write_fd);
+		session->write_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+void pipeline_flush(struct reactor_t *reactor, struct session_t *session)
+{
+	/* parser thread: write outq, rest is flushed again when master becomes writable */
+	struct epoll_event ev;
+
+	if (term_flush(session->term) <= 0 || session->write_fd < 0)
+		return;
+
+	ev.events   = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = &session->write_watch;
+	errno = 0;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, session->write_fd, &ev) < 0
+		&& errno != ENOENT) /* ENOENT: removed by I/O thread, pty was closed */
+		logging(LOG_ERROR, "epoll_ctl: %s\n", strerror(errno));
+}
+
+void pipeline_input(struct reactor_t *reactor, struct session_t *session)
+{
+	/* owner of term (worker holding queued, or parser thread): reactor_write() input -> outq */
+	ssize_t ret;
+	size_t size, space;
+	uint8_t *ptr;
+	struct terminal_t *term = session->term;
+
+	while ((size = spsc_read_span(session->writes, &ptr)) > 0) {
+		/* never more than outq accepts: the rest waits in ring, not dropped by term_queue() */
+		if ((space = OUTQ_LIMIT - outq_pending(&term->outq)) == 0) {
+			term->outq_full = true;
+			break;
+		}
+		if ((ret = term_write(term, ptr, (size < space) ? size: space)) < 0 && errno == EAGAIN)
+			break; /* outq is full: moved after it is drained (write_fd becomes writable) */
+		spsc_consume(session->writes, (ret < 0) ? size: (size_t) ret);
+	}
+
+	if (outq_pending(&session->term->outq) > 0)
+		pipeline_flush(reactor, session);
+}
+
+ssize_t pipeline_write(struct pipeline_t *pl, struct session_t *session, const void *buf, size_t size)
+{
+	/* reactor_write() with parser pool: producer of session->writes, then session is queued */
+	size_t space, done = 0;
+	uint8_t *ptr;
+
+	while (done < size && (space = spsc_write_span(session->writes, &ptr)) > 0) {
+		if (space > size - done)
+			space = size - done;
+		memcpy(ptr, (const uint8_t *) buf + done, space);
+		spsc_produce(session->writes, space);
+		done += space;
+	}
+
+	/* stored before queued: worker clearing queued sees it in pipeline_pending() */
+	if (done < size)
+		__atomic_store_n(&session->writes_full, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(&session->queued, 1, __ATOMIC_SEQ_CST))
+		worker_push(pl->workers, session);
+
+	if (done == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return done;
+}
+
+/* reactor.h */
+/*
+	event loop: one reactor owns many sessions (terminal + child)
+		- master fd is read when ready, parsed immediately
+		- idle sessions cost nothing (no scanning, no timeout polling)
+		- child exit is watched by pidfd (fallback: signalfd(SIGCHLD) + waitpid)
+		- child of destroyed session is reaped later, SIGKILL on deadline (see reactor_orphan())
+		- flooding session is throttled by its backlog, never starves others (see reactor_flow())
+
+	engine:
+		ENGINE_EPOLL: level-triggered epoll, one read() per ready master
+		ENGINE_URING: io_uring multishot read and batched write (see reactor_use_uring())
+*/
+bool reactor_init(struct reactor_t *reactor)
+{
+	reactor->engine   = ENGINE_EPOLL;
+	reactor->sessions = NULL;
+	reactor->count    = 0;
+	reactor->backlogged = 0;
+	reactor->backlog    = reactor->backlog_cursor = NULL;
+	reactor->logs       = 0;
+	reactor->orphans    = NULL;
+	reactor->batch      = NULL;
+	reactor->batch_count = 0;
+	reactor->sigfd    = -1;
+	reactor->on_exit  = NULL;
+	reactor->on_writable = NULL;
+	reactor->on_damage   = NULL;
+	reactor->pipeline = NULL;
+
+	errno = 0;
+	if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		logging(LOG_ERROR, "epoll_create1: %s\n", strerror(errno));
+		return false;
+	}
+	reactor->sig_watch.type    = WATCH_SIGCHLD;
+	reactor->sig_watch.session = NULL;
+	ptylog_syncer_init(&reactor->syncer);
+
+	return true;
+}
+
+bool reactor_use_uring(struct reactor_t *reactor)
+{
+	/* must be called before reactor_add(): keep epoll engine if io_uring is not usable */
+#if defined(HAVE_IO_URING)
+	if (reactor->count > 0 || reactor->sigfd >= 0)
+		return false;
+
+	if (!uring_init(&reactor->uring)) {
+		logging(LOG_WARN, "io_uring is not available, fallback to epoll\n");
+		return false;
+	}
+	reactor->engine = ENGINE_URING;
+	return true;
+#else
+	(void) reactor;
+	return false;
+#endif
+}
+
+void reactor_die(struct reactor_t *reactor)
+{
+	struct orphan_t *orphan;
+
+#if defined(HAVE_IO_URING)
+	if (reactor->engine == ENGINE_URING)
+		uring_die(&reactor->uring);
+#endif
+	/* no more reactor_poll(): orphans are not waited for MGR_KILL_TIMEOUT */
+	while ((orphan = reactor->orphans)) {
+		reactor->orphans = orphan->next;
+		kill(orphan->pid, SIGKILL);
+		while (waitpid(orphan->pid, NULL, 0) < 0 && errno == EINTR);
+		if (orphan->pidfd >= 0)
+			eclose(orphan->pidfd);
+		free(orphan);
+	}
+	if (reactor->sigfd >= 0)
+		eclose(reactor->sigfd);
+	eclose(reactor->epfd);
+	ptylog_syncer_die(&reactor->syncer);
+}
+
+bool reactor_watch_sigchld(struct reactor_t *reactor)
+{
+	sigset_t mask;
+	struct epoll_event ev;
+
+	if (reactor->sigfd >= 0)
+		return true;
+
+	/* SIGCHLD must be blocked in every thread for signalfd */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	errno = 0;
+	if ((reactor->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		logging(LOG_ERROR, "signalfd: %s\n", strerror(errno));
+		return false;
+	}
+
+#if defined(HAVE_IO_URING)
+	if (reactor->engine == ENGINE_URING)
+		return uring_poll(&reactor->uring, reactor->sigfd, POLLIN, true, &reactor->sig_watch);
+#endif
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &reactor->sig_watch;
+	return eepoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->sigfd, &ev) == 0;
+}
+
+#if defined(HAVE_IO_URING)
+void uring_flush(struct reactor_t *reactor, struct session_t *session)
+{
+	struct outq_t tmp;
+	struct terminal_t *term = session->term;
+
+	if (session->inflight.len > 0 || outq_pending(&term->outq) == 0 || session->deleting)
+		return;
+
+	/* swap buffers: terminal keeps queueing while submitted one is in flight */
+	tmp               = session->inflight;
+	session->inflight = term->outq;
+	term->outq        = tmp;
+	term->outq.head   = term->outq.len = 0;
+
+	session->inflight_off = session->inflight.head;
+	if (uring_write(&reactor->uring, term->fd, session->inflight.buf + session->inflight_off,
+		session->inflight.len - session->inflight_off, &session->write_watch))
+		session->uring_pending++;
+	else
+		session->inflight.len = 0;
+}
+
+bool uring_add(struct reactor_t *reactor, struct session_t *session)
+{
+	/* master stays O_NONBLOCK: -EAGAIN is waited by poll, never by a blocked kernel worker */
+	session->term->defer_write = true;
+	session->inflight.buf      = NULL;
+	session->inflight.head     = session->inflight.len = session->inflight.size = 0;
+	session->uring_pending     = 0;
+
+	/* everything that can fail before queuing: requests must not refer to a freed session */
+	if ((session->pidfd = epidfd_open(session->pid)) < 0 && !reactor_watch_sigchld(reactor))
+		return false;
+	if (!uring_reserve(&reactor->uring, (session->pidfd >= 0) ? 2: 1)) {
+		if (session->pidfd >= 0) {
+			eclose(session->pidfd);
+			session->pidfd = -1;
+		}
+		return false;
+	}
+
+	uring_read_multishot(&reactor->uring, session->term->fd, &session->pty_watch);
+	session->uring_pending++;
+	if (session->pidfd >= 0) {
+		uring_poll(&reactor->uring, session->pidfd, POLLIN, false, &session->pid_watch);
+		session->uring_pending++;
+	}
+	return true;
+}
+#endif
+
+bool reactor_add(struct reactor_t *reactor, struct session_t *session)
+{
+	int flags;
+	struct epoll_event ev;
+
+	session->alive      = true;
+	session->status     = 0;
+	session->pty_closed = false;
+	session->deleting   = false;
+	session->events     = EPOLLIN;
+	session->throttled  = session->backlogged = session->damaged = false;
+	session->backlog_prev = session->backlog_next = NULL;
+	session->write_blocked = false;
+	session->write_fd   = -1;
+	session->writable   = 0;
+	session->skip_run   = 0;
+	session->log        = NULL;
+	memset(&session->flow, 0, sizeof(session->flow));
+
+	session->pty_watch.type      = WATCH_PTY;
+	session->pty_watch.session   = session;
+	session->pid_watch.type      = WATCH_PID;
+	session->pid_watch.session   = session;
+	session->write_watch.type    = WATCH_WRITE;
+	session->write_watch.session = session;
+	session->pollout_watch.type    = WATCH_POLLOUT;
+	session->pollout_watch.session = session;
+
+	/* reactor never blocks on a single session */
+	flags = fcntl(session->term->fd, F_GETFL);
+	fcntl(session->term->fd, F_SETFL, flags | O_NONBLOCK);
+
+#if defined(HAVE_IO_URING)
+	if (reactor->engine == ENGINE_URING) {
+		if (!uring_add(reactor, session))
+			return false;
+		goto add_list;
+	}
+#endif
+
+	session->pipe    = session->writes = NULL;
+	session->worker  = -1;
+	session->queued  = session->stalled = session->writes_full = 0;
+	session->input.buf = NULL;
+	if (reactor->pipeline) {
+		if ((session->pipe = spsc_new(PIPE_RING_SIZE)) == NULL)
+			return false;
+		if ((session->writes = spsc_new(WRITE_RING_SIZE)) == NULL) {
+			spsc_free(session->pipe);
+			return false;
+		}
+	} else if (!ring_init(&session->input, INPUT_RING_SIZE)) {
+		return false;
+	}
+	session->read_hiwat = READ_BATCH_MIN;
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &session->pty_watch;
+	if (eepoll_ctl(reactor->epfd, EPOLL_CTL_ADD, session->term->fd, &ev) < 0) {
+		ring_die(&session->input);
+		spsc_free(session->pipe);
+		spsc_free(session->writes);
+		return false;
+	}
+
+	if ((reactor->pipeline && !pipeline_watch_write(reactor, session))
+		|| ((session->pidfd = epidfd_open(session->pid)) < 0 && !reactor_watch_sigchld(reactor))) {
+		if (session->write_fd >= 0) {
+			eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->write_fd, NULL);
+			eclose(session->write_fd);
+		}
+		eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->term->fd, NULL);
+		ring_die(&session->input);
+		spsc_free(session->pipe);
+		spsc_free(session->writes);
+		return false;
+	}
+
+	if (session->pidfd >= 0) {
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &session->pid_watch;
+		eepoll_ctl(reactor->epfd, EPOLL_CTL_ADD, session->pidfd, &ev);
+	}
+
+#if defined(HAVE_IO_URING)
+add_list:
+#endif
+	session->prev = NULL;
+	session->next = reactor->sessions;
+	if (reactor->sessions)
+		reactor->sessions->prev = session;
+	reactor->sessions = session;
+	reactor->count++;
+
+	return true;
+}
+
+void session_exited(struct reactor_t *reactor, struct session_t *session, int status)
+{
+	logging(LOG_DEBUG, "child process (pid:%d) exited, status:%d\n", session->pid, status);
+
+	session->alive  = false;
+	session->status = status;
+
+	if (session->pidfd >= 0) {
+		if (reactor->engine == ENGINE_EPOLL)
+			eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->pidfd, NULL);
+		eclose(session->pidfd);
+		session->pidfd = -1;
+	}
+
+	if (reactor->on_exit)
+		reactor->on_exit(session);
+}
+
+void reactor_update_write(struct reactor_t *reactor, struct session_t *session)
+{
+	/* watch EPOLLOUT only while outq is not empty, EPOLLIN only while not throttled */
+	uint32_t events;
+	struct epoll_event ev;
+
+	/* pipeline: master belongs to pipeline_read(), outq to parser thread (pipeline_flush()) */
+	if (session->pty_closed || reactor->engine != ENGINE_EPOLL || reactor->pipeline)
+		return;
+
+	events = (session->throttled ? 0: EPOLLIN)
+		| (outq_pending(&session->term->outq) > 0 ? EPOLLOUT: 0);
+	if (events == session->events)
+		return;
+
+	ev.events   = events;
+	ev.data.ptr = &session->pty_watch;
+	if (eepoll_ctl(reactor->epfd, EPOLL_CTL_MOD, session->term->fd, &ev) == 0)
+		session->events = events;
+}
+
+void reactor_writable(struct reactor_t *reactor, struct session_t *session)
+{
+	/* backpressure released (by flush, or by replies written in parse()): embedder may resume writing input */
+	bool full = session->term->outq_full;
+
+	if (session->write_blocked && !full && reactor->on_writable)
+		reactor->on_writable(session);
+	session->write_blocked = full;
+}
+
+void reactor_flush_pty(struct reactor_t *reactor, struct session_t *session)
+{
+	term_flush(session->term);
+	reactor_update_write(reactor, session);
+	reactor_writable(reactor, session);
+}
+
+ssize_t reactor_write(struct reactor_t *reactor, struct session_t *session, const void *buf, size_t size)
+{
+	/*
+		input to child (paste, key): never blocks
+			returns -1 (EAGAIN) if outq is full, on_writable() is called after drained
+			batched with other writes on io_uring engine
+			pipeline: call in parser thread only (parser pool: in one thread, see pipeline_write())
+	*/
+	ssize_t ret;
+	int err;
+
+	if (reactor->pipeline && reactor->pipeline->workers)
+		return pipeline_write(reactor->pipeline, session, buf, size);
+	if (reactor->pipeline) /* left by parser pool: keep order */
+		pipeline_input(reactor, session);
+
+	ret = term_write(session->term, buf, size);
+	err = errno; /* EAGAIN: kept for caller */
+
+	if (reactor->pipeline && outq_pending(&session->term->outq) > 0)
+		pipeline_flush(reactor, session);
+
+#if defined(HAVE_IO_URING)
+	if (reactor->engine == ENGINE_URING)
+		uring_flush(reactor, session);
+#endif
+	reactor_update_write(reactor, session);
+	reactor_writable(reactor, session);
+
+	errno = err;
+	return ret;
+}
+
+size_t reactor_parse_input(struct session_t *session, size_t budget)
+{
+	/* hand the longest contiguous spans to parse(), at most budget bytes */
+	size_t size, total = 0;
+	uint8_t *ptr;
+
+	while (total < budget && (size = ring_read_span(&session->input, &ptr)) > 0) {
+		if (size > budget - total)
+			size = budget - total;
+		parse(session->term, ptr, size);
+		ring_consume(&session->input, size);
+		total += size;
+	}
+
+	if (total > 0)
+		session->damaged = true;
+	session->flow.parsed += total;
+
+	return total;
+}
+
+void reactor_damage(struct reactor_t *reactor, struct session_t *session, size_t pending)
+{
+	/*
+		notify updated screen to embedder (on_damage)
+			pending: input known to be not parsed yet
+			- LAZY_DRAW: skip frame while more than BUFSIZE is pending (catch-up mode),
+			  but at most FRAME_SKIP_MAX frames in a row: flood stays visible
+			- !BACKGROUND_DRAW: damage is kept while vt is not active (need_redraw on activation)
+	*/
+	if (!session->damaged || !reactor->on_damage)
+		return;
+
+	if (!vt_active && !BACKGROUND_DRAW)
+		return;
+
+	if (LAZY_DRAW && pending > BUFSIZE && session->skip_run < FRAME_SKIP_MAX) {
+		session->skip_run++;
+		session->flow.frames_skipped++;
+		return;
+	}
+
+	session->damaged  = false;
+	session->skip_run = 0;
+	session->flow.frames++;
+	reactor->on_damage(session);
+}
+
+void reactor_backlog(struct reactor_t *reactor, struct session_t *session, bool backlogged)
+{
+	/* keep list of backlogged sessions: reactor_catch_up() never visits idle ones */
+	session->backlogged  = backlogged;
+	reactor->backlogged += backlogged ? 1: -1;
+
+	if (backlogged) { /* head: not visited again in current round */
+		session->backlog_prev = NULL;
+		session->backlog_next = reactor->backlog;
+		if (reactor->backlog)
+			reactor->backlog->backlog_prev = session;
+		reactor->backlog = session;
+		return;
+	}
+
+	if (reactor->backlog_cursor == session)
+		reactor->backlog_cursor = session->backlog_next;
+	if (session->backlog_prev)
+		session->backlog_prev->backlog_next = session->backlog_next;
+	else
+		reactor->backlog = session->backlog_next;
+	if (session->backlog_next)
+		session->backlog_next->backlog_prev = session->backlog_prev;
+	session->backlog_prev = session->backlog_next = NULL;
+}
+
+void reactor_flow(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		epoll: output flow control by backlog (unparsed input in ring)
+			- backlog >= FLOW_HIWAT: stop reading master, child blocks in write() (kernel throttles it)
+			- backlog <= FLOW_LOWAT: resume reading
+			- backlog is parsed PARSE_BUDGET per round by reactor_catch_up()
+		memory and latency of one session are bounded, whatever the child writes
+	*/
+	size_t backlog = ring_used(&session->input);
+
+	if (backlog > session->flow.backlog_max)
+		session->flow.backlog_max = backlog;
+
+	if (!session->throttled && backlog >= FLOW_HIWAT) {
+		session->throttled = true;
+		session->flow.throttled++;
+	} else if (session->throttled && backlog <= FLOW_LOWAT) {
+		session->throttled = false;
+	}
+
+	if (session->backlogged != (backlog > 0))
+		reactor_backlog(reactor, session, backlog > 0);
+
+	reactor_update_write(reactor, session);
+	reactor_writable(reactor, session);
+	reactor_damage(reactor, session, backlog);
+}
+
+void reactor_read_pty(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		read until EAGAIN or read_hiwat, then parse at once
+			- short read (interactive echo): parse immediately, no extra read() for EAGAIN
+			- hiwat reached (flood): hiwat grows up to ring size, amortize parse/draw
+	*/
+	ssize_t size;
+	size_t batch = 0, space, limit;
+	uint8_t *ptr;
+	bool closed = false;
+
+	if (reactor->pipeline) { /* parsed by parser thread */
+		if (!pipeline_read(reactor, session)) {
+			eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->term->fd, NULL);
+			eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->write_fd, NULL);
+			session->pty_closed = true;
+		}
+		return;
+	}
+
+	/* never read beyond FLOW_HIWAT of backlog */
+	limit = ring_used(&session->input);
+	limit = (limit < FLOW_HIWAT) ? FLOW_HIWAT - limit: 0;
+	if (limit > session->read_hiwat)
+		limit = session->read_hiwat;
+
+	while (batch < limit) {
+		if ((space = ring_write_span(&session->input, &ptr)) == 0)
+			break;
+		if (space > limit - batch)
+			space = limit - batch;
+
+		errno = 0;
+		size = session->log ? ptylog_read(session->log, session->term->fd, ptr, space):
+			read(session->term->fd, ptr, space);
+
+		if (size > 0) {
+			session->input.tail += size;
+			batch += size;
+			if (size < BUFSIZE)
+				break;
+		} else if (size < 0 && errno == EINTR) {
+			continue;
+		} else {
+			/* EIO: all slaves are closed */
+			closed = (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+			break;
+		}
+	}
+
+	if (batch >= session->read_hiwat && session->read_hiwat < session->input.size)
+		session->read_hiwat *= 2;
+	else if (batch < session->read_hiwat / 4 && session->read_hiwat > READ_BATCH_MIN)
+		session->read_hiwat /= 2;
+
+	if (closed) {
+		/* stop watching: level-triggered HUP never stops */
+		eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->term->fd, NULL);
+		session->pty_closed = true;
+		session->term->outq.head = session->term->outq.len = 0;
+	}
+
+	reactor_parse_input(session, PARSE_BUDGET);
+	reactor_flow(reactor, session);
+}
+
+void reactor_catch_up(struct reactor_t *reactor)
+{
+	/*
+		epoll: parse backlog of flooding sessions, PARSE_BUDGET per session and round
+		only backlogged sessions are visited, cursor survives reactor_del() in callbacks
+	*/
+	struct session_t *session;
+
+	for (session = reactor->backlog; session; session = reactor->backlog_cursor) {
+		reactor->backlog_cursor = session->backlog_next;
+		reactor_parse_input(session, PARSE_BUDGET);
+		reactor_flow(reactor, session);
+	}
+}
+
+void reactor_reap(struct reactor_t *reactor, struct session_t *session)
+{
+	int status;
+
+	if (waitpid(session->pid, &status, WNOHANG) == session->pid)
+		session_exited(reactor, session, status);
+}
+
+void reactor_forget(struct reactor_t *reactor, const struct watch_t *watch, const struct session_t *session)
+{
+	/* epoll: clear events of watch (or any watch of session) left in the batch being dispatched */
+	const struct watch_t *w;
+
+	for (int i = 0; i < reactor->batch_count; i++) {
+		if ((w = reactor->batch[i].data.ptr) == NULL)
+			continue;
+		if (w == watch || (session && (w == &session->pty_watch || w == &session->pid_watch
+			|| w == &session->write_watch || w == &session->pollout_watch)))
+			reactor->batch[i].data.ptr = NULL;
+	}
+}
+
+static inline uint64_t orphan_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool reactor_orphan(struct reactor_t *reactor, pid_t pid)
+{
+	/*
+		SIGHUP already sent: reap pid in reactor_housekeep(), SIGKILL if not exited in MGR_KILL_TIMEOUT
+		pipeline: call while I/O thread is stopped or pipeline lock is held
+	*/
+	struct orphan_t *orphan;
+	struct epoll_event ev;
+
+	if ((orphan = ecalloc(1, sizeof(struct orphan_t))) == NULL)
+		return false;
+
+	orphan->watch.type    = WATCH_ORPHAN;
+	orphan->watch.session = NULL;
+	orphan->pid      = pid;
+	orphan->deadline = orphan_now() + MGR_KILL_TIMEOUT;
+
+	if ((orphan->pidfd = epidfd_open(pid)) < 0) {
+		if (!reactor_watch_sigchld(reactor))
+			goto err;
+	}
+#if defined(HAVE_IO_URING)
+	else if (reactor->engine == ENGINE_URING) {
+		if (!(orphan->polled = uring_poll(&reactor->uring, orphan->pidfd, POLLIN, false, &orphan->watch)))
+			goto err;
+	}
+#endif
+	else {
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &orphan->watch;
+		if (eepoll_ctl(reactor->epfd, EPOLL_CTL_ADD, orphan->pidfd, &ev) < 0)
+			goto err;
+	}
+
+	orphan->next     = reactor->orphans;
+	reactor->orphans = orphan;
+	return true;
+
+err:
+	if (orphan->pidfd >= 0)
+		eclose(orphan->pidfd);
+	free(orphan);
+	return false;
+}
+
+void reactor_reap_orphans(struct reactor_t *reactor)
+{
+	/* reap exited orphans, SIGKILL the ones outliving their deadline */
+	struct orphan_t *orphan, **prev = &reactor->orphans;
+	uint64_t now = orphan_now();
+
+	while ((orphan = *prev)) {
+		/* -1 (ECHILD): already reaped by someone else */
+		if (!orphan->polled && waitpid(orphan->pid, NULL, WNOHANG) != 0) {
+			logging(LOG_DEBUG, "orphan (pid:%d) reaped\n", orphan->pid);
+			*prev = orphan->next;
+			if (orphan->pidfd >= 0) {
+				if (reactor->engine == ENGINE_EPOLL)
+					eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, orphan->pidfd, NULL);
+				eclose(orphan->pidfd);
+			}
+			reactor_forget(reactor, &orphan->watch, NULL);
+			free(orphan);
+			continue;
+		}
+		if (!orphan->killed && now >= orphan->deadline) {
+			kill(orphan->pid, SIGKILL);
+			orphan->killed = true;
+		}
+		prev = &orphan->next;
+	}
+}
+
+int orphan_timeout(struct reactor_t *reactor, int timeout)
+{
+	/* wake up by the nearest deadline of orphans */
+	uint64_t now = orphan_now();
+
+	for (struct orphan_t *orphan = reactor->orphans; orphan; orphan = orphan->next) {
+		if (orphan->killed)
+			continue;
+		if (orphan->deadline <= now)
+			return 0;
+		if (timeout < 0 || orphan->deadline - now < (uint64_t) timeout)
+			timeout = orphan->deadline - now;
+	}
+	return timeout;
+}
+
+void reactor_sigchld(struct reactor_t *reactor)
+{
+	struct signalfd_siginfo info;
+	struct session_t *session, *next;
+
+	while (read(reactor->sigfd, &info, sizeof(info)) == sizeof(info));
+
+	/* SIGCHLD may be merged: check only sessions without pidfd */
+	for (session = reactor->sessions; session; session = next) {
+		next = session->next;
+		if (session->alive && session->pidfd < 0)
+			reactor_reap(reactor, session);
+	}
+	if (reactor->orphans)
+		reactor_reap_orphans(reactor);
+}
+
+#if defined(HAVE_IO_URING)
+void uring_complete_read(struct reactor_t *reactor, struct session_t *session, int res, unsigned flags)
+{
+	uint16_t bid;
+
+	if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		/* reactor_del(): still parsed, read data is not in the kernel any more (handoff_send()) */
+		parse(session->term, reactor->uring.bufs + (size_t) bid * URING_BUF_SIZE, res);
+		session->flow.parsed += res;
+		if (!session->deleting)
+			session->damaged = true;
+		uring_provide(&reactor->uring, bid);
+		uring_flush(reactor, session);
+
+		/* full buffer: more data is likely queued in kernel */
+		if (!session->deleting)
+			reactor_damage(reactor, session, (res == URING_BUF_SIZE) ? (size_t) res: 0);
+	}
+
+	if (flags & IORING_CQE_F_MORE)
+		return;
+
+	/* multishot read terminated: re-arm unless pty was closed */
+	session->uring_pending--;
+	if (session->deleting)
+		return;
+
+	if (res == -EAGAIN) { /* read is not polled by kernel: poll completion (res > 0) re-arms it */
+		if (uring_poll(&reactor->uring, session->term->fd, POLLIN, false, &session->pty_watch))
+			session->uring_pending++;
+	} else if (res > 0 || res == -ENOBUFS || res == -EINTR) {
+		if (uring_read_multishot(&reactor->uring, session->term->fd, &session->pty_watch))
+			session->uring_pending++;
+	} else {
+		if (res < 0)
+			logging(LOG_DEBUG, "io_uring read: %s\n", strerror(-res));
+		session->pty_closed = true;
+	}
+}
+
+void uring_resume_write(struct reactor_t *reactor, struct session_t *session)
+{
+	/* submit rest of inflight (short write), then next outq */
+	if (session->inflight_off < session->inflight.len
+		&& uring_write(&reactor->uring, session->term->fd,
+			session->inflight.buf + session->inflight_off,
+			session->inflight.len - session->inflight_off, &session->write_watch)) {
+		session->uring_pending++;
+		return;
+	}
+	session->inflight.len = 0;
+	uring_flush(reactor, session);
+
+	term_check_outq(session->term);
+	reactor_writable(reactor, session);
+}
+
+void uring_complete_write(struct reactor_t *reactor, struct session_t *session, int res)
+{
+	session->uring_pending--;
+
+	if (res > 0) {
+		session->inflight_off += res;
+	} else if (res < 0 && res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+		logging(LOG_ERROR, "io_uring write: %s\n", strerror(-res));
+		session->inflight_off = session->inflight.len; /* drop on error */
+	}
+	/* -ECANCELED: reactor_del(), rest of inflight goes back to term->outq */
+
+	if (session->deleting)
+		return;
+
+	/* child doesn't read: wait until master is writable (WATCH_POLLOUT) */
+	if (res == -EAGAIN && uring_poll(&reactor->uring, session->term->fd,
+		POLLOUT, false, &session->pollout_watch)) {
+		session->uring_pending++;
+		return;
+	}
+	uring_resume_write(reactor, session);
+}
+
+void uring_dispatch(struct reactor_t *reactor, struct io_uring_cqe *cqe)
+{
+	struct watch_t *watch;
+
+	if ((watch = (struct watch_t *) (uintptr_t) cqe->user_data) == NULL)
+		return;
+
+	if (watch->type == WATCH_PTY) {
+		uring_complete_read(reactor, watch->session, cqe->res, cqe->flags);
+	} else if (watch->type == WATCH_WRITE) {
+		uring_complete_write(reactor, watch->session, cqe->res);
+	} else if (watch->type == WATCH_POLLOUT) {
+		watch->session->uring_pending--;
+		if (!watch->session->deleting)
+			uring_resume_write(reactor, watch->session);
+	} else if (watch->type == WATCH_PID) {
+		watch->session->uring_pending--;
+		if (!watch->session->deleting)
+			reactor_reap(reactor, watch->session);
+	} else if (watch->type == WATCH_ORPHAN) {
+		((struct orphan_t *) watch)->polled = false;
+		reactor_reap_orphans(reactor);
+	} else if (watch->type == WATCH_SIGCHLD) {
+		reactor_sigchld(reactor);
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_poll(&reactor->uring, reactor->sigfd, POLLIN, true, &reactor->sig_watch);
+	}
+}
+
+void uring_wait_session(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		reactor_del(): wait for completions of session, never dispatch others here
+		(no callback of other sessions inside reactor_del()): they are kept for next reactor_poll()
+	*/
+	unsigned head, tail, size, count;
+	struct io_uring_cqe cqe, *deferred;
+	struct watch_t *watch;
+	struct uring_t *ring = &reactor->uring;
+
+	/* already deferred by reactor_del() of another session */
+	count = ring->deferred_head;
+	for (unsigned i = ring->deferred_head; i < ring->deferred_count; i++) {
+		watch = (struct watch_t *) (uintptr_t) ring->deferred[i].user_data;
+		if (watch->session == session)
+			uring_dispatch(reactor, &ring->deferred[i]);
+		else
+			ring->deferred[count++] = ring->deferred[i];
+	}
+	ring->deferred_count = count;
+
+	if (session->uring_pending == 0 || uring_submit(ring, 1, -1) < 0)
+		return;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = ring->cqes[head & *ring->cq_mask];
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if ((watch = (struct watch_t *) (uintptr_t) cqe.user_data) == NULL)
+			continue;
+		if (watch->session == session) {
+			uring_dispatch(reactor, &cqe);
+			continue;
+		}
+
+		if (ring->deferred_count == ring->deferred_size) {
+			size = ring->deferred_size ? ring->deferred_size * 2: URING_ENTRIES;
+			if ((deferred = erealloc(ring->deferred, size * sizeof(struct io_uring_cqe))) == NULL) {
+				uring_dispatch(reactor, &cqe); /* no memory: handle it now */
+				continue;
+			}
+			ring->deferred      = deferred;
+			ring->deferred_size = size;
+		}
+		ring->deferred[ring->deferred_count++] = cqe;
+	}
+}
+
+int reactor_poll_uring(struct reactor_t *reactor, int timeout)
+{
+	int count = 0;
+	unsigned head, tail;
+	struct io_uring_cqe cqe;
+	struct uring_t *ring = &reactor->uring;
+
+	/* completions deferred by reactor_del() first (reactor_del() in callback appends to them) */
+	while (ring->deferred_head < ring->deferred_count) {
+		cqe = ring->deferred[ring->deferred_head++];
+		uring_dispatch(reactor, &cqe);
+		count++;
+	}
+	ring->deferred_head = ring->deferred_count = 0;
+	if (count > 0)
+		timeout = 0;
+	else if (reactor->orphans)
+		timeout = orphan_timeout(reactor, timeout);
+
+	/* submit all queued requests and wait for completion by one syscall */
+	if (uring_submit(ring, (timeout == 0) ? 0: 1, timeout) < 0)
+		return -1;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++, count++) {
+		cqe = ring->cqes[head & *ring->cq_mask];
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		uring_dispatch(reactor, &cqe);
+	}
+
+	if (reactor->orphans) /* SIGKILL on deadline */
+		reactor_reap_orphans(reactor);
+
+	/* requests queued while handling completions are submitted without waiting */
+	uring_submit(ring, 0, 0);
+
+	return count;
+}
+#endif
+
+bool reactor_log(struct reactor_t *reactor, struct session_t *session, const char *path, off_t max_size)
+{
+	/*
+		log raw output of session to path (see ptylog.h)
+		pipeline: call while I/O thread is stopped or pipeline lock is held
+	*/
+	if (reactor->engine != ENGINE_EPOLL) {
+		logging(LOG_ERROR, "ptylog is not supported by io_uring engine\n");
+		return false;
+	}
+
+	if (session->log || (session->log = ptylog_open(path, max_size)) == NULL)
+		return false;
+
+	if (!ptylog_attach(&reactor->syncer, session->log)) {
+		ptylog_close(session->log);
+		session->log = NULL;
+		return false;
+	}
+	reactor->logs++;
+	return true;
+}
+
+void reactor_dispatch(struct reactor_t *reactor, struct epoll_event *events, int nfds)
+{
+	/* callbacks may delete sessions: their later events in this batch are cleared */
+	struct watch_t *watch;
+
+	reactor->batch       = events;
+	reactor->batch_count = nfds;
+
+	for (int i = 0; i < nfds; i++) {
+		if ((watch = (struct watch_t *) events[i].data.ptr) == NULL)
+			continue;
+
+		if (watch->type == WATCH_PTY) {
+			if ((events[i].events & EPOLLOUT) && !reactor->pipeline)
+				reactor_flush_pty(reactor, watch->session);
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && events[i].data.ptr)
+				reactor_read_pty(reactor, watch->session);
+		} else if (watch->type == WATCH_WRITE) { /* pipeline: write_fd, flushed by parser thread */
+			__atomic_store_n(&watch->session->writable, 1, __ATOMIC_SEQ_CST);
+			pipeline_notify(reactor->pipeline, watch->session);
+		} else if (watch->type == WATCH_PID) {
+			reactor_reap(reactor, watch->session);
+		} else if (watch->type == WATCH_ORPHAN) {
+			reactor_reap_orphans(reactor);
+		} else if (watch->type == WATCH_SIGCHLD) {
+			reactor_sigchld(reactor);
+		}
+	}
+
+	reactor->batch       = NULL;
+	reactor->batch_count = 0;
+}
+
+int reactor_timeout(struct reactor_t *reactor, int timeout)
+{
+	/* wake up in time for reactor_housekeep() */
+	if (reactor->orphans)
+		timeout = orphan_timeout(reactor, timeout);
+	return timeout;
+}
+
+void reactor_housekeep(struct reactor_t *reactor)
+{
+	/* after every wait, even if it timed out (pipeline: I/O thread) */
+	if (reactor->orphans) /* SIGKILL on deadline */
+		reactor_reap_orphans(reactor);
+}
+
+int reactor_poll(struct reactor_t *reactor, int timeout)
+{
+	/* timeout: msec (-1: block until any event) */
+	int nfds;
+	struct epoll_event events[REACTOR_EVENTS];
+
+#if defined(HAVE_IO_URING)
+	if (reactor->engine == ENGINE_URING)
+		return reactor_poll_uring(reactor, timeout);
+#endif
+
+	/* backlog is parsed without sleeping */
+	if (reactor->backlogged > 0)
+		timeout = 0;
+	else
+		timeout = reactor_timeout(reactor, timeout);
+
+	if ((nfds = eepoll_wait(reactor->epfd, events, REACTOR_EVENTS, timeout)) > 0)
+		reactor_dispatch(reactor, events, nfds);
+
+	if (nfds >= 0)
+		reactor_catch_up(reactor);
+
+	reactor_housekeep(reactor);
+
+	return nfds;
+}
+
+void reactor_del(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		nothing read from or queued for master is lost (handoff_send() hands term over):
+		io_uring: reads completed while cancelling are parsed, unwritten input goes back to term->outq
+	*/
+#if defined(HAVE_IO_URING)
+	struct outq_t tmp, *inflight = &session->inflight;
+
+	if (reactor->engine == ENGINE_URING) {
+		/* wait for all requests referring this session: completions must not outlive it */
+		session->deleting = true;
+		uring_cancel_fd(&reactor->uring, session->term->fd);
+		if (session->pidfd >= 0)
+			uring_cancel_fd(&reactor->uring, session->pidfd);
+		while (session->uring_pending > 0)
+			uring_wait_session(reactor, session);
+
+		/* inflight rest, then outq queued meanwhile: inflight buffer becomes outq */
+		if (session->inflight_off < inflight->len) {
+			inflight->head = session->inflight_off;
+			if (outq_push(inflight, session->term->outq.buf + session->term->outq.head,
+				outq_pending(&session->term->outq))) {
+				tmp                 = session->term->outq;
+				session->term->outq = *inflight;
+				*inflight           = tmp;
+			} else {
+				logging(LOG_ERROR, "dropped %zu bytes of unwritten input\n", inflight->len - inflight->head);
+			}
+		}
+
+		session->term->defer_write = false;
+		free(inflight->buf);
+		inflight->buf  = NULL;
+		inflight->head = inflight->len = inflight->size = 0;
+	} else
+#endif
+	{
+		if (!session->pty_closed)
+			eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->term->fd, NULL);
+		if (session->write_fd >= 0) {
+			if (!session->pty_closed)
+				eepoll_ctl(reactor->epfd, EPOLL_CTL_DEL, session->write_fd, NULL);
+			eclose(session->write_fd);
+			session->write_fd = -1;
+		}
+		if (session->backlogged)
+			reactor_backlog(reactor, session, false);
+		ring_die(&session->input);
+		spsc_free(session->pipe);
+		spsc_free(session->writes);
+		session->pipe = session->writes = NULL;
+	}
+
+	if (session->log) {
+		ptylog_close(session->log);
+		session->log = NULL;
+		reactor->logs--;
+	}
+
+	if (session->pidfd >= 0) {
+		eclose(session->pidfd);
+		session->pidfd = -1;
+	}
+	reactor_forget(reactor, NULL, session);
+
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		reactor->sessions = session->next;
+	if (session->next)
+		session->next->prev = session->prev;
+	session->prev = session->next = NULL;
+	reactor->count--;
+}
+
+void reactor_flow_stats(struct session_t *session, struct flow_stats_t *stats)
+{
+	struct spsc_stats_t pipe;
+
+	*stats = session->flow;
+
+	if (session->pipe) { /* pipeline: throttled when SPSC ring is full */
+		spsc_stats(session->pipe, &pipe);
+		stats->backlog     = pipe.used;
+		stats->backlog_max = pipe.max_used;
+		stats->parsed      = pipe.consumed;
+		stats->throttled   = pipe.full_stalls;
+	} else {
+		stats->backlog = session->input.buf ? ring_used(&session->input): 0;
+	}
+}
+
+/* pipeline.h */
+/*
+	optional pipelined mode: reading and parsing overlap on separate cores
+		I/O thread   : reactor (epoll) reads masters into per session SPSC ring
+		parser thread: embedder calls pipeline_parse() in a loop
+
+	constraints while running:
+		- term (parse, term_write, outq) belongs to parser thread only:
+		  reactor_write() is called in parser thread, on_writable() and on_damage() too
+		- parser pool: term belongs to the worker holding session->queued (see worker_thread()):
+		  reactor_write() is called in one embedder thread, input goes to session->writes
+		  (SPSC ring) and session is queued, the worker moves it to outq in pipeline_consume()
+		  on_writable() and on_damage() are called in workers
+		- on_exit() is called in I/O thread
+		- add sessions by pipeline_add(); remove by pipeline_del() only after
+		  child exited and pty closed (no more events refer to the session)
+*/
+bool pipeline_init(struct pipeline_t *pl, struct reactor_t *reactor)
+{
+	if (reactor->engine != ENGINE_EPOLL || reactor->count > 0) {
+		logging(LOG_ERROR, "pipeline: requires epoll engine without sessions\n");
+		return false;
+	}
+
+	memset(pl, 0, sizeof(struct pipeline_t));
+	pl->reactor    = reactor;
+	pl->ready_size = PIPELINE_SESSIONS;
+
+	if ((pl->ready = ecalloc(pl->ready_size, sizeof(struct session_t *))) == NULL)
+		return false;
+
+	errno = 0;
+	if ((pl->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		logging(LOG_ERROR, "eventfd: %s\n", strerror(errno));
+		free(pl->ready);
+		return false;
+	}
+	pthread_mutex_init(&pl->lock, NULL);
+	reactor->pipeline = pl;
+
+	return true;
+}
+
+void pipeline_die(struct pipeline_t *pl)
+{
+	pl->reactor->pipeline = NULL;
+	pthread_mutex_destroy(&pl->lock);
+	eclose(pl->wakefd);
+	free(pl->ready);
+}
+
+void *pipeline_io_thread(void *arg)
+{
+	int nfds;
+	struct pipeline_t *pl = (struct pipeline_t *) arg;
+	struct epoll_event events[REACTOR_EVENTS];
+
+	while (__atomic_load_n(&pl->running, __ATOMIC_ACQUIRE)) {
+		nfds = eepoll_wait(pl->reactor->epfd, events, REACTOR_EVENTS,
+			reactor_timeout(pl->reactor, PIPELINE_TIMEOUT));
+		if (nfds < 0)
+			continue;
+
+		pthread_mutex_lock(&pl->lock);
+		if (nfds > 0)
+			reactor_dispatch(pl->reactor, events, nfds);
+		reactor_housekeep(pl->reactor);
+		pthread_mutex_unlock(&pl->lock);
+	}
+	return NULL;
+}
+
+bool pipeline_start(struct pipeline_t *pl)
+{
+	int ret;
+
+	__atomic_store_n(&pl->running, 1, __ATOMIC_RELEASE);
+	if ((ret = pthread_create(&pl->io_thread, NULL, pipeline_io_thread, pl)) != 0) {
+		logging(LOG_ERROR, "pthread_create: %s\n", strerror(ret));
+		pl->running = 0;
+		return false;
+	}
+	return true;
+}
+
+void pipeline_stop(struct pipeline_t *pl)
+{
+	__atomic_store_n(&pl->running, 0, __ATOMIC_RELEASE);
+	pthread_join(pl->io_thread, NULL);
+}
+
+bool pipeline_add(struct pipeline_t *pl, struct session_t *session)
+{
+	bool ret;
+
+	pthread_mutex_lock(&pl->lock);
+	ret = (pl->reactor->count < (int) pl->ready_size) && reactor_add(pl->reactor, session);
+	pthread_mutex_unlock(&pl->lock);
+
+	return ret;
+}
+
+bool pipeline_del(struct pipeline_t *pl, struct session_t *session)
+{
+	/* parser thread: final read may have queued session just before pty_closed */
+	bool ret;
+
+	pthread_mutex_lock(&pl->lock);
+	ret = (!session->alive && session->pty_closed) || !pl->running;
+	pthread_mutex_unlock(&pl->lock);
+
+	if (!ret)
+		return false;
+
+	/* parser pool: wait for the worker still parsing it (never queued again: no more events) */
+	if (pl->workers)
+		workers_wait(pl->workers, session);
+
+	pthread_mutex_lock(&pl->lock);
+	/* holding lock, I/O thread doesn't produce: drop it from ready queue (see pipeline_drain()) */
+	for (size_t i = pl->ready_head; i != pl->ready_tail; i++) {
+		if (pl->ready[i & (pl->ready_size - 1)] == session)
+			pl->ready[i & (pl->ready_size - 1)] = NULL;
+	}
+	reactor_del(pl->reactor, session);
+	pthread_mutex_unlock(&pl->lock);
+
+	return true;
+}
+
+static inline bool pipeline_pending(struct session_t *session)
+{
+	/* input left in pipe, write_fd became writable, or reactor_write() input while outq has space */
+	return __atomic_load_n(&session->pipe->tail, __ATOMIC_SEQ_CST) != session->pipe->head
+		|| __atomic_load_n(&session->writable, __ATOMIC_SEQ_CST)
+		|| ((__atomic_load_n(&session->writes->tail, __ATOMIC_SEQ_CST) != session->writes->head
+			|| __atomic_load_n(&session->writes_full, __ATOMIC_SEQ_CST)) && !session->term->outq_full);
+}
+
+void pipeline_consume(struct pipeline_t *pl, struct session_t *session)
+{
+	size_t size;
+	uint8_t *ptr;
+
+	while ((size = spsc_read_span(session->pipe, &ptr)) > 0) {
+		parse(session->term, ptr, size);
+		spsc_consume(session->pipe, size);
+		session->damaged = true;
+	}
+
+	/* space is available again: resume reading */
+	if (__atomic_load_n(&session->stalled, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(&session->stalled, 0, __ATOMIC_SEQ_CST))
+		pipeline_arm(pl->reactor, session, true);
+
+	/* replies and input left in outq: flushed again when write_fd reports EPOLLOUT */
+	__atomic_store_n(&session->writable, 0, __ATOMIC_SEQ_CST);
+	if (outq_pending(&session->term->outq) > 0)
+		pipeline_flush(pl->reactor, session);
+	pipeline_input(pl->reactor, session);
+	reactor_writable(pl->reactor, session);
+
+	/* reactor_write() was refused: writes drained, embedder may resume */
+	if (__atomic_load_n(&session->writes_full, __ATOMIC_SEQ_CST) && spsc_read_span(session->writes, &ptr) == 0
+		&& __atomic_exchange_n(&session->writes_full, 0, __ATOMIC_SEQ_CST) && pl->reactor->on_writable)
+		pl->reactor->on_writable(session);
+
+	/* on_damage() is called in parser thread */
+	reactor_damage(pl->reactor, session, spsc_read_span(session->pipe, &ptr));
+}
+
+int pipeline_drain(struct pipeline_t *pl)
+{
+	int count = 0;
+	size_t tail;
+	struct session_t *session;
+
+	tail = __atomic_load_n(&pl->ready_tail, __ATOMIC_SEQ_CST);
+	while (pl->ready_head != tail) {
+		session = pl->ready[pl->ready_head & (pl->ready_size - 1)];
+		__atomic_store_n(&pl->ready_head, pl->ready_head + 1, __ATOMIC_RELEASE);
+		if (!session) /* removed by pipeline_del() */
+			continue;
+
+		/* clear flag before consuming: data arriving later queues session again */
+		do {
+			__atomic_store_n(&session->queued, 0, __ATOMIC_SEQ_CST);
+			pipeline_consume(pl, session);
+			count++;
+		} while (pipeline_pending(session) && !__atomic_exchange_n(&session->queued, 1, __ATOMIC_SEQ_CST));
+
+		tail = __atomic_load_n(&pl->ready_tail, __ATOMIC_SEQ_CST);
+	}
+	return count;
+}
+
+int pipeline_parse(struct pipeline_t *pl, int timeout)
+{
+	/*
+		parser thread: parse all sessions having input
+		timeout: msec to sleep if nothing to parse (-1: forever, 0: never sleep)
+		return number of parsed sessions
+	*/
+	int count;
+	uint64_t value;
+	struct pollfd pfd = { .fd = pl->wakefd, .events = POLLIN };
+
+	if ((count = pipeline_drain(pl)) > 0 || timeout == 0)
+		return count;
+
+	/* announce sleep, then re-check: I/O thread writes eventfd only if we sleep */
+	__atomic_store_n(&pl->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pl->ready_tail, __ATOMIC_SEQ_CST) == pl->ready_head) {
+		pl->wakeups++;
+		poll(&pfd, 1, timeout);
+		if (read(pl->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			logging(LOG_ERROR, "read: eventfd: %s\n", strerror(errno));
+	}
+	__atomic_store_n(&pl->sleeping, 0, __ATOMIC_SEQ_CST);
+
+	if ((count = pipeline_drain(pl)) == 0)
+		pl->empty_wakeups++;
+	return count;
+}
+
+/*
+	parser pool: worker threads parse sessions instead of pipeline_parse()
+		- each worker owns a deque, sessions are pushed by I/O thread to their last worker
+		- owner takes the oldest session (fairness), thieves take the newest
+		  (the oldest is likely to be taken by owner soon, and is hot in its cache)
+		- session->queued is set while session is queued or being parsed:
+		  exactly one worker parses a session at a time, no global lock
+*/
+struct session_t *worker_take(struct worker_t *worker, bool steal)
+{
+	struct session_t *session = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->head != worker->tail)
+		session = steal ? worker->deque[--worker->tail & (worker->size - 1)]:
+			worker->deque[worker->head++ & (worker->size - 1)];
+	pthread_mutex_unlock(&worker->lock);
+
+	return session;
+}
+
+bool workers_have_job(struct parser_pool_t *pool)
+{
+	bool found = false;
+
+	for (int i = 0; i < pool->count && !found; i++) {
+		pthread_mutex_lock(&pool->workers[i].lock);
+		found = (pool->workers[i].head != pool->workers[i].tail);
+		pthread_mutex_unlock(&pool->workers[i].lock);
+	}
+	return found;
+}
+
+void worker_sleep(struct worker_t *worker)
+{
+	/* announce sleep, then re-check: pusher writes eventfd only if we sleep */
+	uint64_t value;
+	struct parser_pool_t *pool = worker->pool;
+	struct pollfd pfd = { .fd = worker->wakefd, .events = POLLIN };
+
+	__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+	if (!workers_have_job(pool) && __atomic_load_n(&pool->running, __ATOMIC_SEQ_CST)) {
+		worker->wakeups++;
+		poll(&pfd, 1, PIPELINE_TIMEOUT);
+		if (read(worker->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			logging(LOG_ERROR, "read: eventfd: %s\n", strerror(errno));
+	}
+
+	__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+void *worker_thread(void *arg)
+{
+	struct worker_t *worker = (struct worker_t *) arg;
+	struct parser_pool_t *pool = worker->pool;
+	struct session_t *session;
+
+	while (__atomic_load_n(&pool->running, __ATOMIC_ACQUIRE)) {
+		if ((session = worker_take(worker, false)) == NULL) {
+			for (int i = 1; i < pool->count && !session; i++)
+				session = worker_take(&pool->workers[(worker->index + i) % pool->count], true);
+			if (!session) {
+				worker_sleep(worker);
+				continue;
+			}
+			worker->stolen++;
+		}
+		__atomic_store_n(&session->worker, worker->index, __ATOMIC_RELAXED);
+		__atomic_store_n(&worker->current, session, __ATOMIC_SEQ_CST);
+
+		/* clear flag after consuming: I/O thread never queues a session being parsed */
+		do {
+			pipeline_consume(pool->pl, session);
+			worker->parsed++;
+			__atomic_store_n(&session->queued, 0, __ATOMIC_SEQ_CST);
+		} while (pipeline_pending(session) && !__atomic_exchange_n(&session->queued, 1, __ATOMIC_SEQ_CST));
+		__atomic_store_n(&worker->current, NULL, __ATOMIC_SEQ_CST);
+
+		/* current is cleared before waiting is read: pipeline_del() never misses the wakeup */
+		if (__atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST) > 0) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_broadcast(&pool->cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	return NULL;
+}
+
+void workers_free(struct parser_pool_t *pool)
+{
+	for (int i = 0; i < pool->count; i++) {
+		pthread_mutex_destroy(&pool->workers[i].lock);
+		if (pool->workers[i].wakefd >= 0)
+			eclose(pool->workers[i].wakefd);
+		free(pool->workers[i].deque);
+	}
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+void workers_stop(struct pipeline_t *pl)
+{
+	/* sessions left in deques are moved to ready queue of pipeline_parse() */
+	uint64_t one = 1;
+	struct parser_pool_t *pool = pl->workers;
+	struct session_t *session;
+
+	if (!pool)
+		return;
+
+	__atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+	for (int i = 0; i < pool->count; i++) {
+		worker_wake(&pool->workers[i]);
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	/* holding lock, I/O thread doesn't produce: we are the producer of ready queue */
+	pthread_mutex_lock(&pl->lock);
+	pl->workers = NULL;
+	for (int i = 0; i < pool->count; i++) {
+		while ((session = worker_take(&pool->workers[i], false))) {
+			pl->ready[pl->ready_tail & (pl->ready_size - 1)] = session;
+			__atomic_store_n(&pl->ready_tail, pl->ready_tail + 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	if (__atomic_exchange_n(&pl->sleeping, 0, __ATOMIC_SEQ_CST)
+		&& write(pl->wakefd, &one, sizeof(one)) < 0)
+		logging(LOG_ERROR, "write: eventfd: %s\n", strerror(errno));
+	workers_free(pool);
+}
+
+bool workers_start(struct pipeline_t *pl, int count)
+{
+	/*
+		count: number of worker threads (0: number of online cpus)
+		call in parser thread: sessions left in ready queue are moved to deques
+	*/
+	int ret;
+	struct parser_pool_t *pool;
+	struct worker_t *worker;
+	struct session_t *session;
+
+	if (count <= 0 && (count = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		count = 1;
+
+	if ((pool = ecalloc(1, sizeof(struct parser_pool_t))) == NULL)
+		return false;
+
+	/* worker_t is aligned to CACHE_LINE: owners' locks and counters never share a line */
+	errno = 0;
+	if (posix_memalign((void **) &pool->workers, CACHE_LINE, count * sizeof(struct worker_t)) != 0) {
+		logging(LOG_ERROR, "posix_memalign: %s\n", strerror(errno));
+		free(pool);
+		return false;
+	}
+	memset(pool->workers, 0, count * sizeof(struct worker_t));
+	pool->pl      = pl;
+	pool->count   = count;
+	pool->running = 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (int i = 0; i < count; i++) {
+		worker         = &pool->workers[i];
+		worker->pool   = pool;
+		worker->index  = i;
+		worker->size   = pl->ready_size;
+		worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		pthread_mutex_init(&worker->lock, NULL);
+		if ((worker->deque = ecalloc(worker->size, sizeof(struct session_t *))) == NULL
+			|| worker->wakefd < 0) {
+			logging(LOG_ERROR, "parser pool: couldn't create worker\n");
+			pool->count = i + 1;
+			workers_free(pool);
+			return false;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if ((ret = pthread_create(&pool->workers[i].thread, NULL, worker_thread, &pool->workers[i])) != 0) {
+			logging(LOG_ERROR, "pthread_create: %s\n", strerror(ret));
+			__atomic_store_n(&pool->running, 0, __ATOMIC_RELEASE);
+			for (int j = 0; j < i; j++) {
+				worker_wake(&pool->workers[j]);
+				pthread_join(pool->workers[j].thread, NULL);
+			}
+			workers_free(pool);
+			return false;
+		}
+	}
+
+	/* I/O thread sees pool from next dispatch: holding lock, we are the consumer of ready queue */
+	pthread_mutex_lock(&pl->lock);
+	pl->workers = pool;
+	while (pl->ready_head != pl->ready_tail) {
+		session = pl->ready[pl->ready_head & (pl->ready_size - 1)];
+		__atomic_store_n(&pl->ready_head, pl->ready_head + 1, __ATOMIC_RELEASE);
+		if (session) /* queued flag is kept: now in a deque */
+			worker_push(pool, session);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return true;
+}
+#endif
+
+/* pool.h */
+/*
+	pool of pre-opened pty pairs (and optionally pre-spawned shells)
+		- refill thread keeps "size" entries ready
+		- pool_claim() takes one entry and only sets window size (TIOCSWINSZ):
+		  pre-spawned shell receives SIGWINCH and its prompt is already in the master
+*/
+bool pool_entry_new(struct pty_pool_t *pool, struct pty_entry_t *entry)
+{
+	if (eopenpty(&entry->master, &entry->slave, NULL, NULL, &pool->winsize) < 0)
+		return false;
+
+	fcntl(entry->master, F_SETFD, FD_CLOEXEC);
+	fcntl(entry->slave, F_SETFD, FD_CLOEXEC);
+	entry->pid = -1;
+
+	if (pool->prespawn) {
+		if ((entry->pid = espawn(entry->master, entry->slave, pool->file, pool->argv, pool->envp)) < 0) {
+			eclose(entry->slave);
+			eclose(entry->master);
+			return false;
+		}
+		eclose(entry->slave);
+		entry->slave = -1;
+	}
+	return true;
+}
+
+void pool_entry_free(struct pty_entry_t *entry)
+{
+	/* never call with pool->lock held: waits up to POOL_KILL_TIMEOUT for pre-spawned shell */
+	int pidfd;
+	struct pollfd pfd;
+
+	if (entry->slave >= 0)
+		eclose(entry->slave);
+	eclose(entry->master); /* hangup: pre-spawned shell receives SIGHUP */
+
+	if (entry->pid <= 0)
+		return;
+
+	kill(entry->pid, SIGHUP);
+	if ((pidfd = epidfd_open(entry->pid)) >= 0) {
+		pfd.fd     = pidfd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, POOL_KILL_TIMEOUT) < 0 && errno == EINTR);
+		eclose(pidfd);
+	} else {
+		for (int i = 0; i < POOL_KILL_TIMEOUT && waitpid(entry->pid, NULL, WNOHANG) == 0; i++)
+			usleep(1000);
+	}
+
+	/* shell ignoring SIGHUP (or already reaped above: ECHILD) */
+	if (waitpid(entry->pid, NULL, WNOHANG) == 0) {
+		kill(entry->pid, SIGKILL);
+		while (waitpid(entry->pid, NULL, 0) < 0 && errno == EINTR);
+	}
+}
+
+void *pool_refill_thread(void *arg)
+{
+	bool ok;
+	struct timespec deadline;
+	struct pty_entry_t entry;
+	struct pty_pool_t *pool = (struct pty_pool_t *) arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running) {
+		if (pool->count >= pool->size) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		/* open/spawn without lock: claim never waits for refill */
+		pthread_mutex_unlock(&pool->lock);
+		ok = pool_entry_new(pool, &entry);
+		pthread_mutex_lock(&pool->lock);
+
+		if (!ok) { /* fd or process limit: retry later, pool_die() wakes us up */
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += SLEEP_TIME * 1000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec  += 1;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if (pool->running)
+				pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline);
+			continue;
+		}
+
+		if (pool->running && pool->count < pool->size) {
+			pool->entries[pool->count++] = entry;
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		pool_entry_free(&entry);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+bool pool_init(struct pty_pool_t *pool, int size, bool prespawn,
+	const char *file, char *const argv[], char *const envp[])
+{
+	int ret;
+	pthread_condattr_t attr;
+
+	pool->size     = size;
+	pool->count    = 0;
+	pool->prespawn = prespawn;
+	pool->file     = file;
+	pool->argv     = argv;
+	pool->envp     = envp;
+	pool->hits     = pool->misses = 0;
+	pool->running  = true;
+
+	pool->winsize.ws_row    = 24;
+	pool->winsize.ws_col    = 80;
+	pool->winsize.ws_xpixel = pool->winsize.ws_ypixel = 0;
+
+	if ((pool->entries = ecalloc(size, sizeof(struct pty_entry_t))) == NULL)
+		return false;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if ((ret = pthread_create(&pool->thread, NULL, pool_refill_thread, pool)) != 0) {
+		logging(LOG_ERROR, "pthread_create: %s\n", strerror(ret));
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->lock);
+		free(pool->entries);
+		return false;
+	}
+	return true;
+}
+
+void pool_die(struct pty_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->running = false;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_join(pool->thread, NULL);
+
+	for (int i = 0; i < pool->count; i++)
+		pool_entry_free(&pool->entries[i]);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->entries);
+}
+
+pid_t pool_claim(struct pty_pool_t *pool, int *amaster, const struct winsize *winsize)
+{
+	/* like espawnpty(): return pid of shell, master of pty is stored to *amaster */
+	int status;
+	bool found = false;
+	struct pty_entry_t entry;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count > 0) {
+		entry = pool->entries[--pool->count];
+		/* pre-spawned shell may have died while waiting: only fds are closed, without lock */
+		if (entry.pid > 0 && waitpid(entry.pid, &status, WNOHANG) != 0) {
+			entry.pid = -1;
+			pthread_mutex_unlock(&pool->lock);
+			pool_entry_free(&entry);
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+		found = true;
+		break;
+	}
+	if (found)
+		pool->hits++;
+	else
+		pool->misses++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!found && !pool_entry_new(pool, &entry))
+		return -1;
+
+	if (entry.pid < 0) { /* only pty is ready */
+		entry.pid = espawn(entry.master, entry.slave, pool->file, pool->argv, pool->envp);
+		eclose(entry.slave);
+		if (entry.pid < 0) {
+			eclose(entry.master);
+			return -1;
+		}
+	}
+
+	if (winsize)
+		ioctl(entry.master, TIOCSWINSZ, winsize);
+	*amaster = entry.master;
+
+	return entry.pid;
+}
+
+/* player.h */
+/*
+	playback of recording (see record.h)
+		- file is mapped, blocks are decompressed on demand
+		- player_seek(): nearest keyframe before target, then replay events up to target
+	term must have the recorded size (player->cols, player->lines), replies of parse() are discarded
+*/
+bool player_block(struct player_t *player, size_t pos, struct rec_block_header_t *header)
+{
+	/* parse block header at pos */
+	uint64_t value[3];
+	const uint8_t *ptr = player->map + pos, *end = player->map + player->size;
+
+	if (pos + 2 > player->size)
+		return false;
+
+	header->type  = ptr[0];
+	header->codec = ptr[1];
+	ptr += 2;
+	for (int i = 0; i < 3; i++) {
+		if (!varint_get(&ptr, end, &value[i]))
+			return false;
+	}
+	header->time     = value[0];
+	header->raw_size = value[1];
+	header->payload  = ptr - player->map;
+	header->next     = header->payload + value[2];
+
+	return value[2] <= (uint64_t) (end - ptr) && header->type <= REC_INDEX && header->codec <= REC_LZ;
+}
+
+bool player_load(struct player_t *player, struct rec_block_header_t *header, struct outq_t *out)
+{
+	/* decompress payload of block into out */
+	const uint8_t *payload = player->map + header->payload;
+	size_t stored = header->next - header->payload;
+
+	out->head = out->len = 0;
+	if (header->raw_size > out->size) {
+		uint8_t *buf = erealloc(out->buf, header->raw_size);
+		if (!buf)
+			return false;
+		out->buf  = buf;
+		out->size = header->raw_size;
+	}
+
+	if (header->codec == REC_RAW) {
+		if (stored != header->raw_size)
+			return false;
+		memcpy(out->buf, payload, stored);
+	} else if (!lz_decompress(payload, stored, out->buf, header->raw_size)) {
+		return false;
+	}
+	out->len = header->raw_size;
+	return true;
+}
+
+bool player_add_index(struct player_t *player, uint64_t time, size_t offset)
+{
+	struct rec_index_t *index;
+
+	if (player->index_count == player->index_size) {
+		index = erealloc(player->index,
+			sizeof(struct rec_index_t) * (player->index_size ? player->index_size * 2: BUFSIZE));
+		if (!index)
+			return false;
+		player->index      = index;
+		player->index_size = player->index_size ? player->index_size * 2: BUFSIZE;
+	}
+	player->index[player->index_count].time   = time;
+	player->index[player->index_count].offset = offset;
+	player->index_count++;
+	return true;
+}
+
+bool player_read_index(struct player_t *player)
+{
+	/* footer -> index block; if recording was not closed, scan block headers instead */
+	uint64_t offset = 0, count, time = 0, pos = 0, dt, dpos;
+	const uint8_t *ptr, *end;
+	struct rec_block_header_t header;
+	struct outq_t index = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	if (player->size >= player->data + 12 && memcmp(player->map + player->size - 4, "YIDX", 4) == 0) {
+		for (int i = 0; i < 8; i++)
+			offset |= (uint64_t) player->map[player->size - 12 + i] << (i * BITS_PER_BYTE);
+
+		if (offset < player->size && player_block(player, offset, &header)
+			&& header.type == REC_INDEX && player_load(player, &header, &index)) {
+			ptr = index.buf;
+			end = index.buf + index.len;
+			if (varint_get(&ptr, end, &count)) {
+				for (uint64_t i = 0; i < count; i++) {
+					if (!varint_get(&ptr, end, &dt) || !varint_get(&ptr, end, &dpos))
+						break;
+					time += dt;
+					pos  += dpos;
+					player_add_index(player, time, pos);
+				}
+			}
+			player->end      = offset;
+			player->duration = header.time;
+			if ((uint64_t) player->index_count == count) {
+				free(index.buf);
+				return true;
+			}
+		}
+		/* broken index: fall back to scan */
+		free(index.buf);
+		player->index_count = 0;
+		player->duration    = 0;
+	}
+
+	/* scan: only block headers are read */
+	player->end = player->size;
+	for (pos = player->data; player_block(player, pos, &header); pos = header.next) {
+		if (header.type == REC_KEYFRAME)
+			player_add_index(player, header.time, pos);
+		else if (header.type == REC_INDEX) {
+			player->end = pos;
+			break;
+		}
+		if (header.time > player->duration)
+			player->duration = header.time;
+	}
+	return true;
+}
+
+bool player_open(struct player_t *player, const char *path)
+{
+	int fd;
+	struct stat st;
+	uint64_t value[3];
+	const uint8_t *ptr, *end;
+
+	memset(player, 0, sizeof(struct player_t));
+
+	if ((fd = eopen(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || st.st_size < 5) {
+		logging(LOG_ERROR, "\"%s\" is not a recording\n", path);
+		eclose(fd);
+		return false;
+	}
+	player->size = st.st_size;
+	player->map  = emmap(NULL, player->size, PROT_READ, MAP_SHARED, fd, 0);
+	eclose(fd);
+	if (player->map == MAP_FAILED)
+		return false;
+
+	ptr = player->map + 5;
+	end = player->map + player->size;
+	if (memcmp(player->map, "YREC", 4) != 0 || player->map[4] != REC_VERSION) {
+		logging(LOG_ERROR, "\"%s\" is not a recording (or unknown version)\n", path);
+		goto err;
+	}
+	for (int i = 0; i < 3; i++) {
+		if (!varint_get(&ptr, end, &value[i]))
+			goto err;
+	}
+	player->cols  = value[0];
+	player->lines = value[1];
+	player->start = value[2];
+	player->data  = ptr - player->map;
+	player->pos   = player->data;
+
+	if (player_read_index(player))
+		return true;
+err:
+	emunmap(player->map, player->size);
+	return false;
+}
+
+void player_close(struct player_t *player)
+{
+	emunmap(player->map, player->size);
+	free(player->index);
+	free(player->block.buf);
+}
+
+uint64_t player_play(struct player_t *player, struct terminal_t *term, uint64_t time)
+{
+	/* apply events up to time (usec from start), return time of last applied event */
+	int fd = term->fd;
+	uint64_t delta, size;
+	const uint8_t *ptr, *end;
+	struct rec_block_header_t header;
+
+	term->fd = -1; /* no child: replies are discarded */
+
+	while (true) {
+		if (player->block_pos < player->block.len) {
+			ptr = player->block.buf + player->block_pos;
+			end = player->block.buf + player->block.len;
+			if (!varint_get(&ptr, end, &delta) || !varint_get(&ptr, end, &size)
+				|| size > (uint64_t) (end - ptr)) {
+				player->block.len = 0; /* broken block: skip */
+				continue;
+			}
+			if (player->time + delta > time)
+				break;
+
+			parse(term, (uint8_t *) ptr, size);
+			player->time     += delta;
+			player->block_pos = (ptr + size) - player->block.buf;
+			continue;
+		}
+
+		/* next events block */
+		if (player->pos >= player->end || !player_block(player, player->pos, &header))
+			break;
+		if (header.time > time)
+			break;
+		player->pos = header.next;
+
+		if (header.type == REC_EVENTS && player_load(player, &header, &player->block)) {
+			player->block_pos = 0;
+			player->time      = header.time;
+		}
+	}
+
+	term->fd = fd;
+	return player->time;
+}
+
+bool player_seek(struct player_t *player, struct terminal_t *term, uint64_t time)
+{
+	/* restore nearest keyframe before time, then replay */
+	int low = 0, high = player->index_count - 1, mid, found = -1;
+	struct rec_block_header_t header;
+	struct outq_t keyframe = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+
+	if (player->cols != term->cols || player->lines != term->lines) {
+		logging(LOG_ERROR, "player: terminal is not %dx%d\n", player->cols, player->lines);
+		return false;
+	}
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (player->index[mid].time <= time) {
+			found = mid;
+			low   = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	/* keyframe is skipped if playback position is already between it and time */
+	if (found >= 0 && !(player->time >= player->index[found].time && player->time <= time
+		&& player->pos > player->index[found].offset)) {
+		if (!player_block(player, player->index[found].offset, &header)
+			|| !player_load(player, &header, &keyframe)
+			|| !grid_decode(term, keyframe.buf, keyframe.len)) {
+			free(keyframe.buf);
+			return false;
+		}
+		free(keyframe.buf);
+
+		player->pos       = header.next;
+		player->time      = header.time;
+		player->block.len = player->block_pos = 0;
+	} else if (found < 0 || player->time > time) {
+		reset(term);
+		player->pos       = player->data;
+		player->time      = 0;
+		player->block.len = player->block_pos = 0;
+	}
+
+	player_play(player, term, time);
+	return true;
+}
+
+#if defined(__linux__)
+/* mgr.h */
+/*
+	session manager: create/destroy session (pty + child + terminal) and look up by id
+		- glyph_index and default_palette are shared by all terminals (see shared_init())
+		- mgr_usage(): bytes owned by each session, for capacity planning
+*/
+static inline size_t mgr_slot(uint32_t id, size_t size)
+{
+	return (id * 2654435761U) & (size - 1);
+}
+
+static inline void mgr_place(struct session_t **table, size_t size, struct session_t *session)
+{
+	size_t i;
+
+	for (i = mgr_slot(session->id, size); table[i]; i = (i + 1) & (size - 1));
+	table[i] = session;
+}
+
+bool mgr_insert(struct session_mgr_t *mgr, struct session_t *session)
+{
+	struct session_t **table;
+
+	/* keep load factor <= 1/2 */
+	if ((size_t) (mgr->count + 1) * 2 > mgr->table_size) {
+		if ((table = ecalloc(mgr->table_size * 2, sizeof(struct session_t *))) == NULL)
+			return false;
+		for (size_t i = 0; i < mgr->table_size; i++) {
+			if (mgr->table[i])
+				mgr_place(table, mgr->table_size * 2, mgr->table[i]);
+		}
+		free(mgr->table);
+		mgr->table       = table;
+		mgr->table_size *= 2;
+	}
+
+	mgr_place(mgr->table, mgr->table_size, session);
+	mgr->count++;
+	return true;
+}
+
+void mgr_remove(struct session_mgr_t *mgr, struct session_t *session)
+{
+	/* backward shift deletion: no tombstone */
+	size_t i, j, k, mask = mgr->table_size - 1;
+
+	for (i = mgr_slot(session->id, mgr->table_size); mgr->table[i] != session; i = (i + 1) & mask) {
+		if (mgr->table[i] == NULL)
+			return;
+	}
+	mgr->table[i] = NULL;
+	mgr->count--;
+
+	for (j = (i + 1) & mask; mgr->table[j]; j = (j + 1) & mask) {
+		k = mgr_slot(mgr->table[j]->id, mgr->table_size);
+		/* move entry j to hole i unless its home slot k lies in (i, j] */
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			mgr->table[i] = mgr->table[j];
+			mgr->table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+bool mgr_init(struct session_mgr_t *mgr, struct reactor_t *reactor, struct pty_pool_t *pool)
+{
+	mgr->reactor    = reactor;
+	mgr->pool       = pool;
+	mgr->count      = 0;
+	mgr->next_id    = 1;
+	mgr->table_size = MGR_TABLE_SIZE;
+
+	return (mgr->table = ecalloc(mgr->table_size, sizeof(struct session_t *))) != NULL;
+}
+
+struct session_t *mgr_lookup(struct session_mgr_t *mgr, uint32_t id)
+{
+	for (size_t i = mgr_slot(id, mgr->table_size); mgr->table[i]; i = (i + 1) & (mgr->table_size - 1)) {
+		if (mgr->table[i]->id == id)
+			return mgr->table[i];
+	}
+	return NULL;
+}
+
+void mgr_kill(struct reactor_t *reactor, struct session_t *session)
+{
+	/*
+		SIGHUP, then SIGKILL if child doesn't exit in MGR_KILL_TIMEOUT
+		reactor: never waits here, child is handed to reactor_orphan() (status is unknown)
+	*/
+	int status = -1;
+	pid_t ret;
+
+	if (!session->alive)
+		return;
+
+	kill(session->pid, SIGHUP);
+	if ((ret = waitpid(session->pid, &status, WNOHANG)) == 0 && reactor && reactor_orphan(reactor, session->pid))
+		goto done;
+
+	for (int i = 0; ret == 0 && !reactor && i < MGR_KILL_TIMEOUT; i++) {
+		usleep(1000);
+		ret = waitpid(session->pid, &status, WNOHANG);
+	}
+	if (ret == 0) {
+		kill(session->pid, SIGKILL);
+		while ((ret = waitpid(session->pid, &status, 0)) < 0 && errno == EINTR);
+	}
+done:
+	/* -1 (ECHILD): already reaped by someone else */
+	session->alive  = false;
+	session->status = (ret == session->pid) ? status: -1;
+}
+
+struct session_t *mgr_create(struct session_mgr_t *mgr, int width, int height,
+	const char *file, char *const argv[], char *const envp[])
+{
+	/* file, argv, envp: ignored if pty_pool_t is used (see pool_init()) */
+	struct session_t *session;
+	struct terminal_t *term;
+	struct winsize ws;
+
+	session = ecalloc(1, sizeof(struct session_t));
+	term    = ecalloc(1, sizeof(struct terminal_t));
+	if (!session || !term)
+		goto err_alloc;
+
+	if (!term_init(term, width, height))
+		goto err_alloc;
+
+	ws.ws_row    = term->lines;
+	ws.ws_col    = term->cols;
+	ws.ws_xpixel = width;
+	ws.ws_ypixel = height;
+
+	session->term  = term;
+	session->pidfd = -1;
+	session->pid   = mgr->pool ? pool_claim(mgr->pool, &term->fd, &ws):
+		espawnpty(&term->fd, file, argv, envp, NULL, &ws);
+	if (session->pid < 0)
+		goto err_spawn;
+	session->alive = true;
+
+	if (mgr->reactor && !reactor_add(mgr->reactor, session))
+		goto err_add;
+
+	/* id 0 is never used */
+	if ((session->id = mgr->next_id++) == 0)
+		session->id = mgr->next_id++;
+	if (!mgr_insert(mgr, session))
+		goto err_insert;
+
+	return session;
+
+err_insert:
+	if (mgr->reactor)
+		reactor_del(mgr->reactor, session);
+err_add:
+	eclose(term->fd);
+	mgr_kill(mgr->reactor, session);
+err_spawn:
+	term_die(term);
+err_alloc:
+	free(term);
+	free(session);
+	return NULL;
+}
+
+void mgr_destroy(struct session_mgr_t *mgr, struct session_t *session)
+{
+	struct terminal_t *term = session->term;
+
+	mgr_remove(mgr, session);
+	if (mgr->reactor)
+		reactor_del(mgr->reactor, session);
+
+	eclose(term->fd); /* hangup */
+	mgr_kill(mgr->reactor, session);
+
+	rec_close(term);
+	history_close(term);
+	term_die(term);
+	free(term);
+	free(session);
+}
+
+void mgr_die(struct session_mgr_t *mgr)
+{
+	for (size_t i = 0; i < mgr->table_size; ) {
+		if (mgr->table[i])
+			mgr_destroy(mgr, mgr->table[i]); /* entries may shift into slot i */
+		else
+			i++;
+	}
+	free(mgr->table);
+	mgr->table = NULL;
+	mgr->table_size = 0;
+}
+
+size_t resident_bytes(void *addr, size_t size)
+{
+	/* pages of anonymous mapping actually touched */
+	size_t page = sysconf(_SC_PAGESIZE), pages = (size + page - 1) / page, count = 0;
+	unsigned char *vec;
+
+	if ((vec = ecalloc(pages, 1)) == NULL)
+		return size;
+
+	if (mincore(addr, size, vec) < 0) {
+		free(vec);
+		return size;
+	}
+	for (size_t i = 0; i < pages; i++)
+		count += vec[i] & 0x01;
+	free(vec);
+
+	return count * page;
+}
+
+void mgr_usage(struct session_t *session, struct mem_usage_t *usage)
+{
+	struct terminal_t *term = session->term;
+	struct recorder_t *rec  = term->recorder;
+
+	memset(usage, 0, sizeof(struct mem_usage_t));
+
+	usage->terminal = sizeof(struct terminal_t) + sizeof(struct session_t);
+	usage->grid     = term->lines * (sizeof(struct cell_t *) + sizeof(struct cell_t) * term->cols)
+		+ term->lines * sizeof(bool) + term->cols * sizeof(bool);
+	usage->esc      = term->esc.size;
+	usage->palette  = term->palette ? sizeof(struct palette_t): 0;
+	usage->outq     = term->outq.size;
+	if (session->writes)
+		usage->outq += sizeof(struct spsc_ring_t) + resident_bytes(session->writes->buf, session->writes->size);
+	usage->scrollback = history_usage(term);
+
+	if (session->input.buf)
+		usage->input = resident_bytes(session->input.buf, session->input.size);
+	if (session->pipe)
+		usage->input = sizeof(struct spsc_ring_t) + resident_bytes(session->pipe->buf, session->pipe->size);
+
+	usage->other = session->inflight.size;
+	if (session->log)
+		usage->other += sizeof(struct ptylog_t) + strlen(session->log->path) + 1;
+	if (rec)
+		usage->other += sizeof(struct recorder_t) + rec->scratch_size
+			+ sizeof(struct rec_index_t) * rec->index_size
+			+ (rec->cur ? sizeof(struct rec_block_t) + rec->cur->data.size: 0);
+
+	usage->total = usage->terminal + usage->grid + usage->esc + usage->palette
+		+ usage->outq + usage->input + usage->scrollback + usage->other;
+}
+
+void mgr_usage_total(struct session_mgr_t *mgr, struct mem_usage_t *usage)
+{
+	struct mem_usage_t u;
+
+	memset(usage, 0, sizeof(struct mem_usage_t));
+	for (size_t i = 0; i < mgr->table_size; i++) {
+		if (!mgr->table[i])
+			continue;
+		mgr_usage(mgr->table[i], &u);
+		usage->terminal   += u.terminal;
+		usage->grid       += u.grid;
+		usage->esc        += u.esc;
+		usage->palette    += u.palette;
+		usage->outq       += u.outq;
+		usage->input      += u.input;
+		usage->scrollback += u.scrollback;
+		usage->other      += u.other;
+		usage->total      += u.total;
+	}
+	usage->shared = sizeof(glyph_index) + sizeof(default_palette);
+}
+#endif
+
+#if defined(__linux__)
+/* sync.h */
+/*
+	screen state sync to viewers (like mosh SSP): viewers never replay missed output
+		- server keeps generation of last change of each line (and its changed span)
+		- delta from generation G: lines changed after G, only the span if the viewer
+		  already had the previous version of the line, then cursor and mode
+		- at most SYNC_WINDOW deltas in flight per viewer: lagging viewer gets
+		  one collapsed delta when it acks, intermediate states are never sent
+		- fan-out: output is parsed once, lines are kept in order of last change
+		  (delta costs O(changed lines)) and encoded deltas are cached by (from, to):
+		  viewers at the same generation share one encoding, new viewers share
+		  one snapshot (delta from generation 0)
+	message: u32(size of type + payload, little endian) type payload
+		SYNC_HELLO: varint(cols) varint(lines) (server -> viewer, also after resize)
+		SYNC_DELTA: varint(gen) varint(cursor.x) varint(cursor.y) varint(mode) varint(count)
+		            { varint(y) varint(x) varint(n) cells_encode(n cells) }...
+		SYNC_ACK  : varint(gen) (viewer -> server)
+	peer sending a message larger than SYNC_FRAME_MAX (viewer: SYNC_ACK_MAX) is disconnected
+*/
+bool sync_frame(struct outq_t *out, enum sync_msg type, struct outq_t *payload)
+{
+	uint8_t header[5];
+	uint32_t size = payload->len + 1;
+
+	for (int i = 0; i < 4; i++)
+		header[i] = size >> (i * BITS_PER_BYTE);
+	header[4] = type;
+
+	return outq_push(out, header, sizeof(header)) && outq_push(out, payload->buf, payload->len);
+}
+
+int sync_next(struct outq_t *in, size_t max, uint8_t *type, const uint8_t **payload, size_t *size)
+{
+	/* next complete message in in (consumed): 0 if incomplete, -1 if broken or larger than max */
+	uint32_t len = 0;
+	uint8_t *ptr = in->buf + in->head;
+
+	if (outq_pending(in) < 4)
+		return 0;
+	for (int i = 0; i < 4; i++)
+		len |= (uint32_t) ptr[i] << (i * BITS_PER_BYTE);
+	if (len == 0 || len > max) {
+		logging(LOG_WARN, "sync: broken message (size:%u)\n", len);
+		return -1;
+	}
+	if (outq_pending(in) < 4 + (size_t) len)
+		return 0;
+
+	*type    = ptr[4];
+	*payload = ptr + 5;
+	*size    = len - 1;
+	in->head += 4 + len;
+	return 1;
+}
+
+ssize_t sync_recv(int fd, struct outq_t *in, size_t max)
+{
+	/*
+		append readable data to in: return 0 on EOF
+		stops at one message of max bytes, the rest is read after sync_next() consumed it
+	*/
+	ssize_t ret;
+	uint8_t buf[BUFSIZE * 4];
+
+	if (in->head == in->len)
+		in->head = in->len = 0;
+
+	while (outq_pending(in) < 4 + max) {
+		if ((ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+			if (!outq_push(in, buf, ret))
+				return -1;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+		return ret;
+	}
+	return 1;
+}
+
+bool sync_send(int fd, struct outq_t *out)
+{
+	/* flush as much as possible without blocking: false on error */
+	ssize_t ret;
+
+	while (outq_pending(out) > 0) {
+		if ((ret = send(fd, out->buf + out->head, outq_pending(out), MSG_DONTWAIT | MSG_NOSIGNAL)) > 0) {
+			out->head += ret;
+		} else if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		} else {
+			return false;
+		}
+	}
+	out->head = out->len = 0;
+	return true;
+}
+
+bool sync_resize(struct sync_server_t *srv)
+{
+	/* (re)allocate shadow: every line is changed at new generation */
+	struct cell_t *shadow;
+	struct sync_line_t *line;
+	struct terminal_t *term = srv->term;
+
+	shadow = erealloc(srv->shadow, sizeof(struct cell_t) * term->cols * term->lines);
+	if (shadow)
+		srv->shadow = shadow;
+	line = erealloc(srv->line, sizeof(struct sync_line_t) * term->lines);
+	if (line)
+		srv->line = line;
+	if (!shadow || !line)
+		return false;
+
+	srv->cols   = term->cols;
+	srv->lines  = term->lines;
+	srv->recent = 0;
+	srv->gen++;
+	for (int y = 0; y < term->lines; y++) {
+		memcpy(srv->shadow + y * term->cols, term->cells[y], sizeof(struct cell_t) * term->cols);
+		srv->line[y].gen   = srv->line[y].prev_gen = srv->gen;
+		srv->line[y].x0    = 0;
+		srv->line[y].x1    = term->cols - 1;
+		srv->line[y].newer = y - 1;
+		srv->line[y].older = (y + 1 < term->lines) ? y + 1: -1;
+	}
+	srv->cursor = term->cursor;
+	srv->mode   = term->mode;
+
+	return true;
+}
+
+bool sync_init(struct sync_server_t *srv, struct terminal_t *term, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(srv, 0, sizeof(struct sync_server_t));
+	srv->term = term;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		logging(LOG_ERROR, "socket path too long: %s\n", path);
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	errno = 0;
+	if ((srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		logging(LOG_ERROR, "socket: %s\n", strerror(errno));
+		return false;
+	}
+	unlink(path);
+	if (bind(srv->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+		|| listen(srv->fd, SOMAXCONN) < 0) {
+		logging(LOG_ERROR, "bind/listen: %s: %s\n", path, strerror(errno));
+		eclose(srv->fd);
+		return false;
+	}
+
+	if (!sync_resize(srv)) {
+		eclose(srv->fd);
+		return false;
+	}
+	return true;
+}
+
+void sync_hello(struct sync_server_t *srv, struct sync_viewer_t *viewer)
+{
+	srv->scratch.len = 0;
+	outq_varint(&srv->scratch, srv->cols);
+	outq_varint(&srv->scratch, srv->lines);
+	sync_frame(&viewer->out, SYNC_HELLO, &srv->scratch);
+
+	/* viewer has nothing: next delta is full state */
+	viewer->sent     = 0;
+	viewer->inflight = 0;
+}
+
+void sync_touch(struct sync_server_t *srv, int y)
+{
+	/* move line to head of line list (line changed at current generation) */
+	struct sync_line_t *line = &srv->line[y];
+
+	if (srv->recent == y)
+		return;
+	srv->line[line->newer].older = line->older;
+	if (line->older >= 0)
+		srv->line[line->older].newer = line->newer;
+
+	line->newer = -1;
+	line->older = srv->recent;
+	srv->line[srv->recent].newer = y;
+	srv->recent = y;
+}
+
+void sync_encode(struct sync_server_t *srv, uint64_t from, struct outq_t *frame)
+{
+	/* encode SYNC_DELTA from generation from to current generation */
+	int count = 0, x0, x1, y;
+	struct sync_line_t *line;
+	struct outq_t *out = &srv->scratch;
+
+	for (y = srv->recent; y >= 0 && srv->line[y].gen > from; y = srv->line[y].older)
+		count++;
+
+	out->len = 0;
+	outq_varint(out, srv->gen);
+	outq_varint(out, srv->cursor.x);
+	outq_varint(out, srv->cursor.y);
+	outq_varint(out, srv->mode);
+	outq_varint(out, count);
+
+	for (y = srv->recent; y >= 0 && srv->line[y].gen > from; y = line->older) {
+		line = &srv->line[y];
+		/* viewer has previous version of line: only changed span */
+		if (line->prev_gen <= from && from > 0) {
+			x0 = line->x0;
+			x1 = line->x1;
+		} else {
+			x0 = 0;
+			x1 = srv->cols - 1;
+		}
+		outq_varint(out, y);
+		outq_varint(out, x0);
+		outq_varint(out, x1 - x0 + 1);
+		cells_encode(srv->shadow + y * srv->cols + x0, x1 - x0 + 1, out);
+	}
+
+	frame->head = frame->len = 0;
+	sync_frame(frame, SYNC_DELTA, out);
+	srv->encodes++;
+}
+
+void sync_delta(struct sync_server_t *srv, struct sync_viewer_t *viewer)
+{
+	struct sync_cache_t *cache = NULL;
+
+	for (int i = 0; i < SYNC_CACHE; i++) {
+		if (srv->cache[i].from == viewer->sent && srv->cache[i].to == srv->gen) {
+			cache = &srv->cache[i];
+			break;
+		}
+	}
+
+	if (!cache) {
+		/* prefer an entry of older generation, then round robin */
+		for (int i = 0; i < SYNC_CACHE && !cache; i++) {
+			if (srv->cache[i].to != srv->gen)
+				cache = &srv->cache[i];
+		}
+		if (!cache)
+			cache = &srv->cache[srv->cache_next++ % SYNC_CACHE];
+		sync_encode(srv, viewer->sent, &cache->frame);
+		cache->from = viewer->sent;
+		cache->to   = srv->gen;
+	}
+	outq_push(&viewer->out, cache->frame.buf, cache->frame.len);
+
+	viewer->sent = srv->gen;
+	viewer->inflight++;
+	srv->deltas++;
+}
+
+void sync_viewer_close(struct sync_server_t *srv, struct sync_viewer_t *viewer)
+{
+	struct sync_viewer_t **vp;
+
+	for (vp = &srv->viewers; *vp; vp = &(*vp)->next) {
+		if (*vp == viewer) {
+			*vp = viewer->next;
+			break;
+		}
+	}
+	eclose(viewer->fd);
+	free(viewer->in.buf);
+	free(viewer->out.buf);
+	free(viewer);
+	srv->count--;
+}
+
+void sync_flush(struct sync_server_t *srv, struct sync_viewer_t *viewer)
+{
+	if (!sync_send(viewer->fd, &viewer->out)) {
+		sync_viewer_close(srv, viewer);
+		return;
+	}
+
+	/* send collapsed delta only if viewer keeps up: nothing queued, window not full */
+	if (outq_pending(&viewer->out) == 0 && viewer->inflight < SYNC_WINDOW && viewer->sent < srv->gen) {
+		sync_delta(srv, viewer);
+		if (!sync_send(viewer->fd, &viewer->out))
+			sync_viewer_close(srv, viewer);
+	}
+}
+
+int sync_update(struct sync_server_t *srv)
+{
+	/*
+		call after parse() (before line_dirty is cleared by drawing)
+		return number of changed lines
+	*/
+	int count = 0, x0, x1;
+	struct cell_t *shadow;
+	struct sync_viewer_t *viewer, *next;
+	struct terminal_t *term = srv->term;
+
+	if (term->cols != srv->cols || term->lines != srv->lines) {
+		if (!sync_resize(srv))
+			return -1;
+		for (viewer = srv->viewers; viewer; viewer = viewer->next)
+			sync_hello(srv, viewer);
+		count = term->lines;
+		goto flush;
+	}
+
+	for (int y = 0; y < term->lines; y++) {
+		if (!term->line_dirty[y])
+			continue;
+		shadow = srv->shadow + y * term->cols;
+		for (x0 = 0; x0 < term->cols && cell_equal(&shadow[x0], &term->cells[y][x0]); x0++);
+		if (x0 == term->cols)
+			continue;
+		for (x1 = term->cols - 1; cell_equal(&shadow[x1], &term->cells[y][x1]); x1--);
+
+		if (count++ == 0)
+			srv->gen++;
+		srv->line[y].prev_gen = srv->line[y].gen;
+		srv->line[y].gen      = srv->gen;
+		srv->line[y].x0       = x0;
+		srv->line[y].x1       = x1;
+		sync_touch(srv, y);
+		memcpy(shadow + x0, &term->cells[y][x0], sizeof(struct cell_t) * (x1 - x0 + 1));
+	}
+
+	if (count == 0 && (term->cursor.x != srv->cursor.x || term->cursor.y != srv->cursor.y
+		|| term->mode != srv->mode))
+		srv->gen++;
+	srv->cursor = term->cursor;
+	srv->mode   = term->mode;
+
+flush:
+	for (viewer = srv->viewers; viewer; viewer = next) {
+		next = viewer->next;
+		sync_flush(srv, viewer);
+	}
+	return count;
+}
+
+void sync_accept(struct sync_server_t *srv)
+{
+	int fd;
+	struct sync_viewer_t *viewer;
+
+	while ((fd = accept4(srv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		/* sync_poll() watches at most SYNC_VIEWERS */
+		if (srv->count >= SYNC_VIEWERS) {
+			logging(LOG_WARN, "sync: too many viewers, refused\n");
+			eclose(fd);
+			continue;
+		}
+		if ((viewer = ecalloc(1, sizeof(struct sync_viewer_t))) == NULL) {
+			eclose(fd);
+			continue;
+		}
+		viewer->fd   = fd;
+		viewer->next = srv->viewers;
+		srv->viewers = viewer;
+		srv->count++;
+
+		sync_hello(srv, viewer);
+		sync_flush(srv, viewer);
+	}
+}
+
+void sync_viewer_read(struct sync_server_t *srv, struct sync_viewer_t *viewer)
+{
+	int ret;
+	uint8_t type;
+	uint64_t gen;
+	size_t size;
+	const uint8_t *payload;
+
+	if (sync_recv(viewer->fd, &viewer->in, SYNC_ACK_MAX) <= 0) {
+		sync_viewer_close(srv, viewer);
+		return;
+	}
+
+	while ((ret = sync_next(&viewer->in, SYNC_ACK_MAX, &type, &payload, &size)) > 0) {
+		if (type == SYNC_ACK && varint_get(&payload, payload + size, &gen) && gen <= viewer->sent) {
+			viewer->acked = gen;
+			if (viewer->inflight > 0)
+				viewer->inflight--;
+		}
+	}
+	if (ret < 0) {
+		sync_viewer_close(srv, viewer);
+		return;
+	}
+	sync_flush(srv, viewer);
+}
+
+int sync_poll(struct sync_server_t *srv, int timeout)
+{
+	/* accept viewers, read acks, send pending deltas: return number of ready fds */
+	int nfds, i = 1;
+	struct pollfd fds[1 + SYNC_VIEWERS];
+	struct sync_viewer_t *viewers[SYNC_VIEWERS], *viewer;
+
+	fds[0].fd     = srv->fd;
+	fds[0].events = POLLIN;
+	for (viewer = srv->viewers; viewer && i <= SYNC_VIEWERS; viewer = viewer->next, i++) {
+		fds[i].fd       = viewer->fd;
+		fds[i].events   = POLLIN | (outq_pending(&viewer->out) > 0 ? POLLOUT: 0);
+		viewers[i - 1]  = viewer;
+	}
+
+	if ((nfds = poll(fds, i, timeout)) <= 0)
+		return nfds;
+
+	/* viewers first: accept may change the list */
+	for (int j = 1; j < i; j++) {
+		if (fds[j].revents & (POLLIN | POLLHUP | POLLERR))
+			sync_viewer_read(srv, viewers[j - 1]);
+		else if (fds[j].revents & POLLOUT)
+			sync_flush(srv, viewers[j - 1]);
+	}
+	if (fds[0].revents & POLLIN)
+		sync_accept(srv);
+
+	return nfds;
+}
+
+void sync_die(struct sync_server_t *srv)
+{
+	while (srv->viewers)
+		sync_viewer_close(srv, srv->viewers);
+	eclose(srv->fd);
+	free(srv->shadow);
+	free(srv->line);
+	free(srv->scratch.buf);
+	for (int i = 0; i < SYNC_CACHE; i++)
+		free(srv->cache[i].frame.buf);
+}
+
+/* reference viewer: rebuilds terminal_t from deltas */
+bool sync_client_apply(struct sync_client_t *client, const uint8_t *ptr, size_t size)
+{
+	uint64_t value[5], y, x, n;
+	const uint8_t *end = ptr + size;
+	struct terminal_t *term = &client->term;
+
+	for (int i = 0; i < 5; i++) {
+		if (!varint_get(&ptr, end, &value[i]))
+			return false;
+	}
+	if (value[1] >= (uint64_t) term->cols || value[2] >= (uint64_t) term->lines)
+		return false;
+
+	client->gen    = value[0];
+	term->cursor.x = value[1];
+	term->cursor.y = value[2];
+	term->mode     = value[3];
+
+	for (uint64_t i = 0; i < value[4]; i++) {
+		if (!varint_get(&ptr, end, &y) || !varint_get(&ptr, end, &x) || !varint_get(&ptr, end, &n)
+			|| y >= (uint64_t) term->lines || x + n > (uint64_t) term->cols
+			|| !cells_decode(term, &ptr, end, term->cells[y] + x, n))
+			return false;
+		term->line_dirty[y] = true;
+	}
+	client->deltas++;
+	return true;
+}
+
+bool sync_client_hello(struct sync_client_t *client, const uint8_t *ptr, size_t size)
+{
+	uint64_t cols, lines;
+	const uint8_t *end = ptr + size;
+
+	if (!varint_get(&ptr, end, &cols) || !varint_get(&ptr, end, &lines))
+		return false;
+
+	if (client->ready)
+		term_die(&client->term);
+	client->ready = term_init(&client->term, cols * CELL_WIDTH, lines * CELL_HEIGHT);
+	client->term.fd = -1;
+	return client->ready;
+}
+
+int sync_client_poll(struct sync_client_t *client, int timeout)
+{
+	/* apply received deltas and ack them: return number of deltas (-1: disconnected) */
+	int count = 0, ret;
+	uint8_t type;
+	size_t size;
+	const uint8_t *payload;
+	struct outq_t ack = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+	if (sync_recv(client->fd, &client->in, SYNC_FRAME_MAX) <= 0)
+		return -1;
+
+	while ((ret = sync_next(&client->in, SYNC_FRAME_MAX, &type, &payload, &size)) > 0) {
+		if (type == SYNC_HELLO && !sync_client_hello(client, payload, size))
+			return -1;
+		if (type == SYNC_DELTA && client->ready) {
+			if (!sync_client_apply(client, payload, size))
+				return -1;
+			count++;
+		}
+	}
+	if (ret < 0)
+		return -1;
+
+	/* one ack for all deltas of this round */
+	if (count > 0) {
+		outq_varint(&ack, client->gen);
+		for (int i = 0; i < count; i++)
+			sync_frame(&client->out, SYNC_ACK, &ack);
+		free(ack.buf);
+		if (!sync_send(client->fd, &client->out))
+			return -1;
+	}
+	return count;
+}
+
+void sync_disconnect(struct sync_client_t *client)
+{
+	eclose(client->fd);
+	if (client->ready)
+		term_die(&client->term);
+	free(client->in.buf);
+	free(client->out.buf);
+	client->ready = false;
+}
+
+bool sync_connect(struct sync_client_t *client, const char *path)
+{
+	struct sockaddr_un addr;
+
+	memset(client, 0, sizeof(struct sync_client_t));
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	errno = 0;
+	if ((client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+		|| connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		logging(LOG_ERROR, "connect: %s: %s\n", path, strerror(errno));
+		if (client->fd >= 0)
+			eclose(client->fd);
+		return false;
+	}
+
+	/* wait for hello */
+	while (!client->ready) {
+		if (sync_client_poll(client, -1) < 0) {
+			sync_disconnect(client);
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+#if defined(__linux__)
+/* shm.h */
+/*
+	shared grid: cells, cursor and damage generations in a memfd segment
+		- other processes (renderer, indexer) map the fd read-only: no raw output,
+		  no parsing, no syscall per frame (only after the segment grew)
+		- each line has a seqlock: writer makes seq odd, writes cells, makes it even;
+		  reader copies a row and retries if seq was odd or changed
+		- header seqlock covers cursor, mode, generation and layout (resize)
+		- segment never shrinks (F_SEAL_SHRINK): old mappings of readers stay valid
+		- layout is versioned: readers check magic, version and structure sizes
+*/
+static inline size_t shm_align(size_t size)
+{
+	return (size + CACHE_LINE - 1) & ~((size_t) CACHE_LINE - 1);
+}
+
+static inline struct shm_line_t *shm_line(const uint8_t *map, const struct shm_header_t *header, int y)
+{
+	return (struct shm_line_t *) (map + header->line_offset) + y;
+}
+
+static inline struct shm_cell_t *shm_cells(const uint8_t *map, const struct shm_header_t *header, int y)
+{
+	return (struct shm_cell_t *) (map + header->cell_offset) + y * header->cols;
+}
+
+static inline void shm_write_begin(uint64_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shm_write_end(uint64_t *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+bool shm_write_line(struct shm_grid_t *shm, int y, uint64_t gen, bool force)
+{
+	/* copy line y of term if changed (or force): return true if written */
+	int x;
+	struct shm_cell_t cell, *dst = shm_cells(shm->map, shm->header, y);
+	struct shm_line_t *line = shm_line(shm->map, shm->header, y);
+	struct cell_t *src = shm->term->cells[y];
+
+	for (x = 0; x < shm->term->cols; x++) {
+		cell.code      = src[x].glyphp->code;
+		cell.fg        = src[x].color_pair.fg;
+		cell.bg        = src[x].color_pair.bg;
+		cell.attribute = src[x].attribute;
+		cell.width     = src[x].width;
+		if (force || memcmp(&cell, &dst[x], sizeof(struct shm_cell_t)) != 0)
+			break;
+	}
+	if (x == shm->term->cols)
+		return false;
+
+	shm_write_begin(&line->seq);
+	for (; x < shm->term->cols; x++) {
+		dst[x].code      = src[x].glyphp->code;
+		dst[x].fg        = src[x].color_pair.fg;
+		dst[x].bg        = src[x].color_pair.bg;
+		dst[x].attribute = src[x].attribute;
+		dst[x].width     = src[x].width;
+	}
+	line->gen = gen;
+	shm_write_end(&line->seq);
+
+	shm->lines_written++;
+	return true;
+}
+
+bool shm_layout(struct shm_grid_t *shm)
+{
+	/* (re)compute layout for size of term: segment grows, never shrinks (header is locked) */
+	uint8_t *map;
+	size_t line_offset, cell_offset, size;
+	struct terminal_t *term = shm->term;
+
+	line_offset = shm_align(sizeof(struct shm_header_t));
+	cell_offset = shm_align(line_offset + sizeof(struct shm_line_t) * term->lines);
+	size        = cell_offset + sizeof(struct shm_cell_t) * term->cols * term->lines;
+
+	if (size > shm->size) {
+		errno = 0;
+		if (ftruncate(shm->fd, size) < 0) {
+			logging(LOG_ERROR, "ftruncate: %s\n", strerror(errno));
+			return false;
+		}
+		if (shm->map && (map = mremap(shm->map, shm->size, size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+			logging(LOG_ERROR, "mremap: %s\n", strerror(errno));
+			return false;
+		} else if (!shm->map
+			&& (map = emmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0)) == MAP_FAILED) {
+			return false;
+		}
+		shm->map    = map;
+		shm->size   = size;
+		shm->header = (struct shm_header_t *) map;
+	}
+
+	/* old cells may overlap new line table: readers recheck header seq after reading a line */
+	memset(shm->map + line_offset, 0, sizeof(struct shm_line_t) * term->lines);
+	shm->header->size        = shm->size;
+	shm->header->cols        = term->cols;
+	shm->header->lines       = term->lines;
+	shm->header->line_offset = line_offset;
+	shm->header->cell_offset = cell_offset;
+	return true;
+}
+
+bool shm_init(struct shm_grid_t *shm, struct terminal_t *term)
+{
+	struct shm_header_t *header;
+
+	memset(shm, 0, sizeof(struct shm_grid_t));
+	shm->term = term;
+
+	errno = 0;
+	if ((shm->fd = memfd_create("yaft-grid", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		logging(LOG_ERROR, "memfd_create: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (!shm_layout(shm)) {
+		if (shm->map)
+			emunmap(shm->map, shm->size);
+		eclose(shm->fd);
+		return false;
+	}
+	if (fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		logging(LOG_WARN, "fcntl: F_ADD_SEALS: %s\n", strerror(errno));
+
+	header              = shm->header;
+	header->magic       = SHM_MAGIC;
+	header->version     = SHM_VERSION;
+	header->header_size = sizeof(struct shm_header_t);
+	header->line_size   = sizeof(struct shm_line_t);
+	header->cell_size   = sizeof(struct shm_cell_t);
+	header->gen         = 1;
+	header->cursor      = term->cursor;
+	header->mode        = term->mode;
+
+	for (int y = 0; y < term->lines; y++)
+		shm_write_line(shm, y, header->gen, true);
+
+	return true;
+}
+
+int shm_update(struct shm_grid_t *shm)
 {
 	/*
-		CTRL CHARS      : 0x00 ~ 0x1F
-		ASCII(printable): 0x20 ~ 0x7E
-		CTRL CHARS(DEL) : 0x7F
-		UTF-8           : 0x80 ~ 0xFF
+		call after parse() (before line_dirty is cleared by drawing)
+		return number of changed lines (-1: couldn't grow segment)
 	*/
-	uint8_t ch;
+	int count = 0;
+	bool resized;
+	struct terminal_t *term = shm->term;
+	struct shm_header_t *header = shm->header;
+	uint64_t gen = header->gen + 1;
+
+	resized = (term->cols != (int) header->cols || term->lines != (int) header->lines);
+	if (resized) {
+		shm_write_begin(&header->seq);
+		if (!shm_layout(shm)) {
+			header = shm->header;
+			shm_write_end(&header->seq);
+			return -1;
+		}
+		header = shm->header;
+	}
 
-	for (int i = 0; i < size; i++) {
-		ch = buf[i];
-		if (term->esc.state == STATE_RESET) {
-			/* interrupted by illegal byte */
-			if (term->charset.following_byte > 0 && (ch < 0x80 || ch > 0xBF)) {
-				add_char(term, REPLACEMENT_CHAR);
-				reset_charset(term);
+	for (int y = 0; y < term->lines; y++) {
+		if (resized || term->line_dirty[y])
+			count += shm_write_line(shm, y, gen, resized);
+	}
+
+	if (count > 0 || resized || term->cursor.x != header->cursor.x
+		|| term->cursor.y != header->cursor.y || (uint32_t) term->mode != header->mode) {
+		if (!resized)
+			shm_write_begin(&header->seq);
+		header->gen    = gen;
+		header->cursor = term->cursor;
+		header->mode   = term->mode;
+		shm_write_end(&header->seq);
+		shm->updates++;
+	} else if (resized) {
+		shm_write_end(&header->seq);
+	}
+	return count;
+}
+
+void shm_die(struct shm_grid_t *shm)
+{
+	emunmap(shm->map, shm->size);
+	eclose(shm->fd);
+	memset(shm, 0, sizeof(struct shm_grid_t));
+}
+
+/* reader: runs in other process, fd is received from writer (fork, SCM_RIGHTS, /proc/PID/fd) */
+bool shm_map(struct shm_view_t *view)
+{
+	off_t size;
+	const uint8_t *map;
+
+	errno = 0;
+	if ((size = lseek(view->fd, 0, SEEK_END)) < (off_t) sizeof(struct shm_header_t)) {
+		logging(LOG_ERROR, "shared grid: invalid size: %s\n", strerror(errno));
+		return false;
+	}
+	if ((map = emmap(NULL, size, PROT_READ, MAP_SHARED, view->fd, 0)) == MAP_FAILED)
+		return false;
+
+	if (view->map)
+		emunmap((void *) view->map, view->size);
+	view->map    = map;
+	view->size   = size;
+	view->header = (const struct shm_header_t *) map;
+	return true;
+}
+
+bool shm_attach(struct shm_view_t *view, int fd)
+{
+	/* fd is owned by view: closed by shm_detach() */
+	const struct shm_header_t *header;
+
+	memset(view, 0, sizeof(struct shm_view_t));
+	view->fd = fd;
+
+	if (!shm_map(view))
+		return false;
+
+	header = view->header;
+	if (header->magic != SHM_MAGIC || header->version != SHM_VERSION
+		|| header->header_size != sizeof(struct shm_header_t)
+		|| header->line_size != sizeof(struct shm_line_t)
+		|| header->cell_size != sizeof(struct shm_cell_t)) {
+		logging(LOG_ERROR, "shared grid: unknown layout (version %u)\n", header->version);
+		emunmap((void *) view->map, view->size);
+		return false;
+	}
+	return true;
+}
+
+static inline void shm_wait(struct shm_view_t *view)
+{
+	/* writer is in the middle of an update: it may be preempted, don't burn its cpu */
+	view->retries++;
+	sched_yield();
+}
+
+void shm_read_header(struct shm_view_t *view, struct shm_header_t *copy)
+{
+	/* consistent copy of header: cols, lines, cursor, mode, gen */
+	uint64_t seq;
+
+	while (true) {
+		if ((seq = __atomic_load_n(&view->header->seq, __ATOMIC_ACQUIRE)) & 1) {
+			shm_wait(view);
+			continue;
+		}
+		memcpy(copy, view->header, sizeof(struct shm_header_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&view->header->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		view->retries++;
+	}
+}
+
+int shm_read_line(struct shm_view_t *view, int y, struct shm_cell_t *cells, int max, uint64_t *gen)
+{
+	/*
+		copy consistent row y to cells (max cells), gen: generation of last change of row
+		return number of cells copied (-1: y is out of range, or row is longer than max)
+		to skip unchanged rows, compare gen with the one of previous read
+	*/
+	uint64_t seq, line_seq;
+	struct shm_header_t header;
+	const struct shm_line_t *line;
+
+	while (true) {
+		if ((seq = __atomic_load_n(&view->header->seq, __ATOMIC_ACQUIRE)) & 1) {
+			shm_wait(view);
+			continue;
+		}
+		memcpy(&header, view->header, sizeof(struct shm_header_t));
+
+		/* segment grew: remap (only syscalls of reader) */
+		if (header.size > view->size) {
+			if (!shm_map(view))
+				return -1;
+			continue;
+		}
+		if (y < 0 || y >= (int) header.lines || (int) header.cols > max) {
+			if (__atomic_load_n(&view->header->seq, __ATOMIC_ACQUIRE) != seq)
+				continue;
+			return -1;
+		}
+
+		line = shm_line(view->map, &header, y);
+		if ((line_seq = __atomic_load_n(&line->seq, __ATOMIC_ACQUIRE)) & 1) {
+			shm_wait(view);
+			continue;
+		}
+		memcpy(cells, shm_cells(view->map, &header, y), sizeof(struct shm_cell_t) * header.cols);
+		*gen = line->gen;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&line->seq, __ATOMIC_RELAXED) == line_seq
+			&& __atomic_load_n(&view->header->seq, __ATOMIC_RELAXED) == seq)
+			return header.cols;
+		view->retries++;
+	}
+}
+
+void shm_detach(struct shm_view_t *view)
+{
+	if (view->map)
+		emunmap((void *) view->map, view->size);
+	eclose(view->fd);
+	memset(view, 0, sizeof(struct shm_view_t));
+}
+#endif
+
+#if defined(__linux__)
+/* handoff.h */
+/*
+	live handoff: sessions of session_mgr_t move to a new process (binary upgrade)
+		- old process: input already read from master is parsed, then master is detached
+		  (bytes arriving later stay in the kernel): nothing is lost or parsed twice
+		- batches of up to HANDOFF_FDS sessions: handoff_header_t with master fds (SCM_RIGHTS)
+		  then payload { varint(id) varint(pid) varint(outq len) outq varint(size) snapshot }...
+		- header of count 0 ends handoff, new process acks it by one byte 'Y':
+		  until then either side can roll back (new process closes its copies of masters)
+		- input queued by old process (outq) is written by new process only after 'Y'
+		- ptylog is not handed off: closed after 'Y', kept open on rollback
+		- children are not reparented: the new process watches them by pidfd,
+		  exit status is not available unless it is the same process after execve()
+	sock: connected SOCK_STREAM unix socket (socketpair() kept across execve(), or by path)
+	pipeline and parser pool must be stopped before handoff_send()
+*/
+bool handoff_write(int sock, const void *buf, size_t size)
+{
+	ssize_t ret;
+	const uint8_t *ptr = buf;
+
+	while (size > 0) {
+		if ((ret = send(sock, ptr, size, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			logging(LOG_ERROR, "send: %s\n", strerror(errno));
+			return false;
+		}
+		ptr  += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+bool handoff_read(int sock, void *buf, size_t size)
+{
+	ssize_t ret;
+	uint8_t *ptr = buf;
+
+	while (size > 0) {
+		if ((ret = recv(sock, ptr, size, MSG_WAITALL)) <= 0) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			logging(LOG_ERROR, "recv: %s\n", ret < 0 ? strerror(errno): "connection closed");
+			return false;
+		}
+		ptr  += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+bool handoff_send_batch(int sock, struct session_t **sessions, int count, struct outq_t *payload)
+{
+	int *fds;
+	struct handoff_header_t header;
+	struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "YHND", 4);
+	header.version = HANDOFF_VERSION;
+	header.count   = count;
+	header.size    = payload->len;
+
+	if (count > 0) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmsg               = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level   = SOL_SOCKET;
+		cmsg->cmsg_type    = SCM_RIGHTS;
+		cmsg->cmsg_len     = CMSG_LEN(sizeof(int) * count);
+		fds = (int *) CMSG_DATA(cmsg);
+		for (int i = 0; i < count; i++)
+			fds[i] = sessions[i]->term->fd;
+	}
+
+	/* header is sent by one sendmsg(): fds are attached to its first byte */
+	errno = 0;
+	while (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(header)) {
+		if (errno == EINTR)
+			continue;
+		logging(LOG_ERROR, "sendmsg: %s\n", strerror(errno));
+		return false;
+	}
+	return handoff_write(sock, payload->buf, payload->len);
+}
+
+void handoff_drain(struct session_t *session)
+{
+	/* parse input already read from master but not parsed yet */
+	size_t size;
+	uint8_t *ptr;
+
+	if (session->input.buf)
+		reactor_parse_input(session, SIZE_MAX);
+	while (session->pipe && (size = spsc_read_span(session->pipe, &ptr)) > 0) {
+		parse(session->term, ptr, size);
+		spsc_consume(session->pipe, size);
+	}
+	/* reactor_write() input not moved to outq by parser pool */
+	while (session->writes && (size = spsc_read_span(session->writes, &ptr)) > 0) {
+		term_queue(session->term, ptr, size);
+		spsc_consume(session->writes, size);
+	}
+}
+
+void handoff_flush(struct session_mgr_t *mgr, struct session_t *session)
+{
+	/* write outq kept while master was detached */
+	if (outq_pending(&session->term->outq) == 0)
+		return;
+	if (!mgr->reactor)
+		term_flush(session->term);
+#if defined(HAVE_IO_URING)
+	else if (mgr->reactor->engine == ENGINE_URING)
+		uring_flush(mgr->reactor, session);
+#endif
+	else
+		reactor_flush_pty(mgr->reactor, session);
+}
+
+void handoff_release(struct session_mgr_t *mgr, struct session_t *session, bool attached)
+{
+	/* forget session without killing child: the other process has a copy of master */
+	mgr_remove(mgr, session);
+	if (attached && mgr->reactor)
+		reactor_del(mgr->reactor, session);
+	eclose(session->term->fd);
+	rec_close(session->term);
+	history_close(session->term);
+	term_die(session->term);
+	free(session->term);
+	free(session);
+}
+
+int handoff_send(struct session_mgr_t *mgr, int sock)
+{
+	/*
+		send all sessions of mgr: return number of sessions sent (-1: failed)
+		on success sessions are released (master closed, child not killed)
+		on failure sessions are added to reactor again (with their ptylog) and stay in mgr,
+		a session which couldn't be added again is destroyed
+	*/
+	int count = 0, batch = 0;
+	bool ok = true;
+	char ack = 0;
+	struct session_t **sessions, *session;
+	struct ptylog_t **logs;
+	struct outq_t payload = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct outq_t snap    = { .buf = NULL, .head = 0, .len = 0, .size = 0 };
+	struct terminal_t *term;
+
+	sessions = ecalloc(mgr->count + 1, sizeof(struct session_t *));
+	logs     = ecalloc(mgr->count + 1, sizeof(struct ptylog_t *));
+	if (!sessions || !logs) {
+		free(sessions);
+		free(logs);
+		return -1;
+	}
+	for (size_t i = 0; i < mgr->table_size; i++) {
+		if (mgr->table[i])
+			sessions[count++] = mgr->table[i];
+	}
+
+	/*
+		stop reading: from now on output of children waits in the kernel
+		io_uring: reactor_del() parses reads completed while cancelling, moves unwritten input to outq
+	*/
+	for (int i = 0; i < count; i++) {
+		handoff_drain(sessions[i]);
+		if (!mgr->reactor)
+			continue;
+		/* ptylog is kept open for rollback (reactor_del() closes it) */
+		if ((logs[i] = sessions[i]->log)) {
+			sessions[i]->log = NULL;
+			mgr->reactor->logs--;
+		}
+		reactor_del(mgr->reactor, sessions[i]);
+	}
+
+	for (int i = 0; i < count && ok; i++) {
+		session = sessions[i];
+		term    = session->term;
+
+		snap.len = 0;
+		ok &= snapshot_encode(term, &snap);
+		ok &= outq_varint(&payload, session->id);
+		ok &= outq_varint(&payload, session->pid);
+		ok &= outq_varint(&payload, outq_pending(&term->outq));
+		ok &= outq_push(&payload, term->outq.buf + term->outq.head, outq_pending(&term->outq));
+		ok &= outq_varint(&payload, snap.len);
+		ok &= outq_push(&payload, snap.buf, snap.len);
+
+		if (ok && (++batch == HANDOFF_FDS || i == count - 1)) {
+			ok = handoff_send_batch(sock, sessions + i + 1 - batch, batch, &payload);
+			payload.len = 0;
+			batch = 0;
+		}
+	}
+	payload.len = 0;
+	ok = ok && handoff_send_batch(sock, NULL, 0, &payload) && handoff_read(sock, &ack, 1) && ack == 'Y';
+	free(payload.buf);
+	free(snap.buf);
+
+	if (!ok) {
+		logging(LOG_ERROR, "handoff: failed, sessions are kept\n");
+		for (int i = 0; i < count && mgr->reactor; i++) {
+			if (reactor_add(mgr->reactor, sessions[i])) {
+				if ((sessions[i]->log = logs[i]))
+					mgr->reactor->logs++;
+				handoff_flush(mgr, sessions[i]);
+				continue;
 			}
+			/* not watched by reactor: never usable again */
+			logging(LOG_ERROR, "handoff: couldn't restore session (id:%u), destroyed\n", sessions[i]->id);
+			if (logs[i])
+				ptylog_close(logs[i]);
+			mgr_kill(mgr->reactor, sessions[i]);
+			handoff_release(mgr, sessions[i], false);
+		}
+		free(sessions);
+		free(logs);
+		return -1;
+	}
 
-			if (ch <= 0x1F)
-				control_character(term, ch);
-			else if (ch <= 0x7F)
-				add_char(term, ch);
-			else
-				utf8_charset(term, ch);
-		} else if (term->esc.state == STATE_ESC) {
-			if (push_esc(term, ch))
-				esc_sequence(term, ch);
-		} else if (term->esc.state == STATE_CSI) {
-			if (push_esc(term, ch))
-				csi_sequence(term, ch);
-		} else if (term->esc.state == STATE_OSC) {
-			if (push_esc(term, ch))
-				osc_sequence(term, ch);
-		} else if (term->esc.state == STATE_DCS) {
-			if (push_esc(term, ch))
-				dcs_sequence(term, ch);
+	/* new process owns masters and children now */
+	for (int i = 0; i < count; i++) {
+		if (logs[i])
+			ptylog_close(logs[i]);
+		handoff_release(mgr, sessions[i], false);
+	}
+	free(sessions);
+	free(logs);
+	return count;
+}
+
+struct session_t *handoff_session(struct session_mgr_t *mgr, int fd, const uint8_t **ptr, const uint8_t *end)
+{
+	/* decode one session of payload: restore terminal, add to reactor and mgr */
+	uint64_t id, pid, len, size, cols, lines;
+	const uint8_t *pending, *snap;
+	struct session_t *session;
+	struct terminal_t *term;
+
+	if (!varint_get(ptr, end, &id) || !varint_get(ptr, end, &pid)
+		|| !varint_get(ptr, end, &len) || len > (uint64_t) (end - *ptr))
+		return NULL;
+	pending = *ptr;
+	*ptr   += len;
+
+	/* terminal is initialized by size of snapshot: snapshot_decode() doesn't re-initialize */
+	if (!varint_get(ptr, end, &size) || size > (uint64_t) (end - *ptr))
+		return NULL;
+	snap  = *ptr;
+	*ptr += size;
+	if (!varint_get(&snap, *ptr, &cols) || !varint_get(&snap, *ptr, &lines)
+		|| cols == 0 || lines == 0 || cols > USHRT_MAX || lines > USHRT_MAX)
+		return NULL;
+	snap = *ptr - size;
+
+	session = ecalloc(1, sizeof(struct session_t));
+	term    = ecalloc(1, sizeof(struct terminal_t));
+	if (!session || !term || !term_init(term, cols * CELL_WIDTH, lines * CELL_HEIGHT))
+		goto err_alloc;
+	term->fd = fd;
+
+	if (!snapshot_decode(term, snap, size))
+		goto err_term;
+
+	/* replies and input not written to child yet */
+	if (len > 0)
+		term_queue(term, pending, len);
+
+	session->term  = term;
+	session->pid   = pid;
+	session->pidfd = -1;
+	session->alive = true;
+	session->id    = (id == 0 || mgr_lookup(mgr, id)) ? mgr->next_id++: id;
+	if (session->id >= mgr->next_id)
+		mgr->next_id = session->id + 1;
+
+	if (mgr->reactor && !reactor_add(mgr->reactor, session))
+		goto err_term;
+	if (!mgr_insert(mgr, session)) {
+		if (mgr->reactor)
+			reactor_del(mgr->reactor, session);
+		goto err_term;
+	}
+	return session;
+
+err_term:
+	term_die(term);
+err_alloc:
+	free(term);
+	free(session);
+	return NULL;
+}
+
+int handoff_recv(struct session_mgr_t *mgr, int sock)
+{
+	/*
+		receive sessions into mgr (added to mgr->reactor): return number of sessions
+		sessions keep their ids unless already used in mgr
+		return -1 if failed: received sessions are released, old process keeps all sessions
+	*/
+	int total = 0, nfds, *fds;
+	bool ok = true;
+	struct handoff_header_t header;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	uint8_t *payload = NULL, *buf;
+	size_t size = 0;
+	struct session_t **received = NULL, **tmp, *session;
+	const uint8_t *ptr, *end;
+	ssize_t ret;
+
+	while (ok) {
+		iov.iov_base       = &header;
+		iov.iov_len        = sizeof(header);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = &iov;
+		msg.msg_iovlen     = 1;
+		msg.msg_control    = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		errno = 0;
+		while ((ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+		if (ret <= 0) {
+			logging(LOG_ERROR, "recvmsg: %s\n", ret < 0 ? strerror(errno): "connection closed");
+			ok = false;
+			break;
+		}
+
+		nfds = 0;
+		fds  = NULL;
+		if ((cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			fds  = (int *) CMSG_DATA(cmsg);
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		}
+
+		/* rest of header (fds came with its first byte) */
+		if (!handoff_read(sock, (uint8_t *) &header + ret, sizeof(header) - ret)
+			|| memcmp(header.magic, "YHND", 4) != 0 || header.version != HANDOFF_VERSION
+			|| header.count != (uint32_t) nfds || (msg.msg_flags & MSG_CTRUNC)) {
+			logging(LOG_ERROR, "handoff: protocol error\n");
+			for (int i = 0; i < nfds; i++)
+				eclose(fds[i]);
+			ok = false;
+			break;
+		}
+		if (header.count == 0) {
+			ok = handoff_write(sock, "Y", 1);
+			break;
+		}
+
+		if ((tmp = erealloc(received, sizeof(struct session_t *) * (total + nfds))) == NULL) {
+			for (int i = 0; i < nfds; i++)
+				eclose(fds[i]);
+			ok = false;
+			break;
+		}
+		received = tmp;
+
+		if (header.size > size) {
+			if ((buf = erealloc(payload, header.size)) == NULL) {
+				for (int i = 0; i < nfds; i++)
+					eclose(fds[i]);
+				ok = false;
+				break;
+			}
+			payload = buf;
+			size    = header.size;
+		}
+		if (!handoff_read(sock, payload, header.size)) {
+			for (int i = 0; i < nfds; i++)
+				eclose(fds[i]);
+			ok = false;
+			break;
+		}
+
+		ptr = payload;
+		end = payload + header.size;
+		for (int i = 0; i < nfds; i++) {
+			if (ok && (session = handoff_session(mgr, fds[i], &ptr, end))) {
+				received[total++] = session;
+				continue;
+			}
+			/* broken session: hang up its master, rest of batch is skipped */
+			logging(LOG_ERROR, "handoff: couldn't restore session\n");
+			eclose(fds[i]);
+			ok = false;
 		}
 	}
+	free(payload);
+
+	if (!ok) {
+		for (int i = 0; i < total; i++)
+			handoff_release(mgr, received[i], true);
+		free(received);
+		return -1;
+	}
+
+	/* committed: input queued by old process is written only now (never twice on rollback) */
+	for (int i = 0; i < total; i++)
+		handoff_flush(mgr, received[i]);
+	free(received);
+	return total;
 }
+#endif
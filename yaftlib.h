@@ -5,12 +5,15 @@
 /* yaft.h */
 #define _XOPEN_SOURCE 600
 #define _DARWIN_C_SOURCE
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -19,13 +22,29 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#if defined(__linux__)
+	#include <sys/epoll.h>
+	#include <sys/signalfd.h>
+	#include <sys/syscall.h>
+	#include <poll.h>
+	#include <sys/eventfd.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#if __has_include(<linux/io_uring.h>)
+		#include <linux/io_uring.h>
+		#define HAVE_IO_URING
+	#endif
+#endif
+
 #include "glyph.h"
 #include "color.h"
 
@@ -33,7 +52,8 @@ enum char_code {
 	/* 7 bit */
 	BEL = 0x07, BS  = 0x08, HT  = 0x09,
 	LF  = 0x0A, VT  = 0x0B, FF  = 0x0C,
-	CR  = 0x0D, ESC = 0x1B, DEL = 0x7F,
+	CR  = 0x0D, SO  = 0x0E, SI  = 0x0F,
+	ESC = 0x1B, DEL = 0x7F,
 	/* others */
 	SPACE     = 0x20,
 	BACKSLASH = 0x5C,
@@ -47,6 +67,19 @@ enum misc {
 	ESCSEQ_SIZE        = 1024,             /* limit size of terminal escape sequence */
 	SELECT_TIMEOUT     = 15000,            /* used by select() */
 	SLEEP_TIME         = 30000,            /* sleep time at EAGAIN, EWOULDBLOCK (usec) */
+	OUTQ_LIMIT         = 64 * 1024,        /* max bytes queued for child (replies, input) */
+	REPLY_SIZE         = 1024,             /* replies gathered during one parse() call */
+	CACHE_LINE         = 64,               /* separate data written by different threads */
+	VARINT_MAX         = 10,               /* max bytes of LEB128 encoded uint64_t */
+	REC_VERSION        = 1,                /* format version of recording */
+	SNAP_VERSION       = 1,                /* format version of snapshot */
+	SYNC_CACHE         = 4,                /* state sync: encoded deltas shared by viewers */
+	SHM_MAGIC          = 0x4D485359,       /* shared grid: "YSHM" (little endian) */
+	SHM_VERSION        = 1,                /* shared grid: layout version */
+	HANDOFF_VERSION    = 1,                /* handoff: protocol version */
+	HANDOFF_FDS        = 128,              /* handoff: master fds per message (SCM_MAX_FD: 253) */
+	PREDICT_MAX        = 64,               /* prediction: keystrokes waiting for echo */
+	HUGE_PAGE_SIZE     = 2 * 1024 * 1024,  /* transparent huge page (x86_64, arm64 with 4K pages) */
 	MAX_ARGS           = 16,               /* max parameters of csi/osc sequence */
 	UCS2_CHARS         = 0x10000,          /* number of UCS2 glyphs */
 	CTRL_CHARS         = 0x20,             /* number of ctrl_func */
@@ -83,8 +116,59 @@ const uint32_t bit_mask[] = {
 	0x1FFFFFFF, 0x3FFFFFFF, 0x7FFFFFFF, 0xFFFFFFFF,
 };
 
+enum charset_table {
+	CHARSET_US_ASCII = 0, /* ESC ( B: no translation */
+	CHARSET_DEC_SPECIAL,  /* ESC ( 0: DEC Special Graphics (line drawing) */
+	CHARSET_UK,           /* ESC ( A: United Kingdom */
+	CHARSETS,
+};
+
+/* translation of GL (0x00 - 0x7F) to UCS2: indexed by enum charset_table */
+const uint16_t charset_table[CHARSETS][0x80] = {
+	[CHARSET_DEC_SPECIAL] = {
+		0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+		0x0008, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 0x000F,
+		0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017,
+		0x0018, 0x0019, 0x001A, 0x001B, 0x001C, 0x001D, 0x001E, 0x001F,
+		0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+		0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+		0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+		0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+		0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+		0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+		0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+		0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x00A0,
+		0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+		0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+		0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+		0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7, 0x007F,
+	},
+	[CHARSET_UK] = {
+		0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+		0x0008, 0x0009, 0x000A, 0x000B, 0x000C, 0x000D, 0x000E, 0x000F,
+		0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017,
+		0x0018, 0x0019, 0x001A, 0x001B, 0x001C, 0x001D, 0x001E, 0x001F,
+		0x0020, 0x0021, 0x0022, 0x00A3, 0x0024, 0x0025, 0x0026, 0x0027,
+		0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+		0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+		0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+		0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+		0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+		0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+		0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+		0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+		0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+		0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+		0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x007F,
+	},
+};
+
 enum osc {
-	OSC_GWREPT = 8900, /* OSC Ps: mode number of yaft GWREPT */
+	OSC_SET_PALETTE   = 4,    /* OSC Ps: set/query color palette */
+	OSC_SET_FG        = 10,   /* OSC Ps: set/query default foreground color */
+	OSC_SET_BG        = 11,   /* OSC Ps: set/query default background color */
+	OSC_RESET_PALETTE = 104,  /* OSC Ps: reset color palette */
+	OSC_GWREPT        = 8900, /* OSC Ps: mode number of yaft GWREPT */
 };
 
 enum term_mode {
@@ -133,10 +217,38 @@ struct charset_t {
 	bool is_valid;
 };
 
+struct iso2022_t {
+	enum charset_table g[4]; /* designated charset of G0 - G3 */
+	int gl;                  /* G0 - G3 invoked into GL by SI, SO, LS2, LS3 */
+	const uint16_t *table;   /* translation table of GL: NULL if US-ASCII */
+};
+
+struct pixel_palette_t { /* virtual_palette converted to each pixel format */
+	uint32_t bpp32[COLORS];   /* 32bpp: (MSB) 00 RR GG BB (LSB) */
+	uint8_t bpp24[COLORS][3]; /* 24bpp: byte order in memory B, G, R */
+	uint16_t bpp16[COLORS];   /* 16bpp: RGB565 */
+};
+
+struct palette_t { /* shared by all terminals (default_palette) until changed by OSC */
+	uint32_t virtual_palette[COLORS];
+	struct pixel_palette_t pixel_palette;
+};
+
+struct outq_t { /* pending output to master of pseudo terminal: buf[head] - buf[len - 1] */
+	uint8_t *buf;
+	size_t head, len, size;
+};
+
+struct reply_t { /* replies to child: flushed by one writev() at the end of parse() */
+	char buf[REPLY_SIZE];
+	int len;
+};
+
 struct state_t {   /* for save, restore state */
 	struct point_t cursor;
 	enum term_mode mode;
 	enum char_attr attribute;
+	struct iso2022_t iso2022;
 };
 
 struct terminal_t {
@@ -144,6 +256,9 @@ struct terminal_t {
 	int width, height;                       /* terminal size (pixel) */
 	int cols, lines;                         /* terminal size (cell) */
 	struct cell_t **cells;                   /* pointer to each cell: cells[y * lines + x] */
+	void *arena;                             /* cells, line_dirty, tabstop, esc.buf: see term_layout() */
+	size_t arena_size;
+	bool arena_mapped;                       /* mmap()ed for huge pages: not malloc()ed */
 	struct margin_t scroll;                  /* scroll margin */
 	struct point_t cursor;                   /* cursor pos (x, y) */
 	bool *line_dirty;                        /* dirty flag */
@@ -154,10 +269,190 @@ struct terminal_t {
 	struct color_pair_t color_pair;          /* color (fg, bg) */
 	enum char_attr attribute;                /* bold, underscore, etc... */
 	struct charset_t charset;                /* store UTF-8 byte stream */
+	struct iso2022_t iso2022;                /* G0 - G3 charset designation and invocation */
 	struct esc_t esc;                        /* store escape sequence */
-	uint32_t virtual_palette[COLORS];        /* virtual color palette: always 32bpp */
-	bool palette_modified;                   /* true if palette changed by OSC 4/104 */
-	const struct glyph_t *glyph[UCS2_CHARS]; /* array of pointer to glyphs[] */
+	struct outq_t outq;                      /* replies and input waiting for write */
+	bool defer_write;                        /* queue to outq instead of write() immediately */
+	bool outq_full;                          /* backpressure: OUTQ_LIMIT reached, not drained yet */
+	struct reply_t reply;                    /* replies of current parse() call */
+	uint32_t *virtual_palette;               /* virtual color palette: always 32bpp */
+	bool palette_modified;                   /* true if palette changed by OSC 4/10/11/104 */
+	bool palette_pending;                    /* pixel_palette must be rebuilt at the end of parse() */
+	struct pixel_palette_t *pixel_palette;   /* derived from virtual_palette */
+	struct palette_t *palette;               /* private palette: NULL while default_palette is used */
+	struct recorder_t *recorder;             /* input of parse() is recorded: NULL if not */
+	struct history_t *history;               /* scrollback: NULL if not kept (see history_open()) */
+	void (*on_scroll_out)(struct terminal_t *term, int y); /* line y leaves top of the screen */
+	const struct glyph_t **glyph;            /* glyph_index: shared by all terminals */
+};
+
+enum rec_block_type {
+	REC_EVENTS = 0, /* timestamped input of parse() */
+	REC_KEYFRAME,   /* serialized terminal (grid_encode()) */
+	REC_INDEX,      /* time and offset of all keyframes: last block */
+};
+
+enum rec_codec {
+	REC_RAW = 0,
+	REC_LZ,         /* lz_compress() */
+};
+
+struct rec_block_t { /* block waiting for writer thread */
+	enum rec_block_type type;
+	uint64_t time;                /* usec from start: first event or keyframe */
+	struct outq_t data;           /* uncompressed payload */
+	struct rec_block_t *next;
+};
+
+struct rec_index_t { uint64_t time, offset; };
+
+struct recorder_t {
+	int fd;
+	struct timespec start;        /* CLOCK_MONOTONIC: time 0 */
+	/* parser thread */
+	struct rec_block_t *cur;      /* events block being filled */
+	uint64_t last;                /* time of last event */
+	uint64_t keyframe_time;
+	size_t since_keyframe;        /* input bytes after last keyframe */
+	/* queue: parser thread -> writer thread */
+	struct rec_block_t *head, *tail;
+	int queued;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond, drained;
+	bool running;
+	/* writer thread */
+	uint64_t offset;              /* file offset of next block */
+	uint8_t *scratch;             /* compressed block */
+	size_t scratch_size;
+	struct rec_index_t *index;
+	int index_count, index_size;
+	uint64_t raw_bytes, stored_bytes;
+};
+
+struct rec_block_header_t {
+	enum rec_block_type type;
+	enum rec_codec codec;
+	uint64_t time, raw_size;
+	size_t payload, next;         /* offset of payload and next block */
+};
+
+struct player_t {
+	uint8_t *map;                 /* whole recording (read only) */
+	size_t size;
+	int cols, lines;
+	uint64_t start;               /* CLOCK_REALTIME usec of time 0 */
+	uint64_t duration;
+	size_t data, end;             /* offset of first block, end of event blocks */
+	struct rec_index_t *index;    /* keyframes: sorted by time */
+	int index_count, index_size;
+	size_t pos;                   /* next block to read */
+	struct outq_t block;          /* current events block (decompressed) */
+	size_t block_pos;
+	uint64_t time;                /* time of last applied event */
+};
+
+struct tl_entry_t { /* timeline: keyframe or line delta */
+	uint64_t time;                /* timeline_now() */
+	bool keyframe;
+	size_t size;
+	struct tl_entry_t *next;
+	uint8_t data[];
+};
+
+struct timeline_t {
+	struct tl_entry_t *head, *tail;   /* oldest (always keyframe) ... newest */
+	struct tl_entry_t *last_keyframe;
+	size_t used, budget;              /* bytes of entries */
+	uint64_t span;                    /* usec kept (0: unlimited) */
+	size_t keyframe_size;             /* of last keyframe */
+	size_t since_keyframe;            /* bytes of deltas after last keyframe */
+	int cols, lines;
+	struct cell_t *shadow;            /* cells at last capture: lines * cols */
+	int *changed;                     /* line numbers of current capture */
+	struct point_t cursor;
+	enum term_mode mode;
+	struct outq_t scratch;            /* entry being encoded */
+	uint64_t captures, evicted;
+};
+
+struct hist_page_t { /* lines of scrollback: immutable, shared by terminals (see hist_intern()) */
+	uint64_t hash;
+	uint32_t refs;                /* hist_store.lock */
+	uint32_t lines;
+	size_t size;
+	struct hist_page_t *next;     /* hash chain */
+	uint8_t data[];               /* each line: varint(cols) cells_encode() */
+};
+
+struct hist_store_t { /* process-wide: pages of the same content are stored once */
+	pthread_mutex_t lock;
+	struct hist_page_t **table;   /* power of 2 */
+	size_t size, count;
+	size_t bytes;                 /* pages and their data */
+	uint64_t interned, shared;    /* pages sealed, found already stored */
+};
+
+struct history_t { /* scrollback of terminal: sealed pages and the page being filled */
+	struct hist_page_t **pages;   /* ring: oldest is pages[head] */
+	int head, count, size;
+	int kept;                     /* lines in pages */
+	struct outq_t open;           /* lines not sealed yet */
+	int open_lines;
+	uint64_t hash;                /* of open lines */
+	uint64_t lines;               /* total lines saved */
+};
+
+enum vt_caps { /* optional sequences understood by outer terminal */
+	VT_CAP_ECH = 0x01, /* CSI Ps X: erase characters */
+	VT_CAP_REP = 0x02, /* CSI Ps b: repeat preceding character */
+	VT_CAP_BCE = 0x04, /* erase fills with current background color */
+};
+
+struct vt_pen_t { int16_t fg, bg; bool underline; }; /* -1: default color of outer terminal */
+
+struct vtenc_t { /* re-encodes terminal_t for outer terminal: see vtenc_frame() */
+	enum vt_caps caps;
+	int cols, lines;
+	struct cell_t *shadow;        /* cells shown by outer terminal: lines * cols */
+	bool *changed;                /* cells of current line to be sent */
+	bool valid;                   /* false: outer screen is unknown (full repaint) */
+	struct point_t cursor;        /* cursor of outer terminal */
+	bool cursor_known;            /* false: after writing last column (pending wrap) */
+	bool cursor_visible;
+	struct vt_pen_t pen;          /* SGR state of outer terminal */
+	const struct glyph_t *space;
+	uint64_t frames, bytes, cells;
+};
+
+struct prediction_t { /* tentative echo of one keystroke */
+	uint64_t epoch;
+	uint64_t time;                /* usec: sent to child */
+	uint32_t code;                /* char typed: 0 for BS and cursor motion */
+	bool has_cell;                /* false: cursor motion only */
+	struct point_t pos;           /* predicted cell */
+	struct cell_t cell;
+	const struct glyph_t *orig;   /* glyph at pos before this keystroke */
+	struct point_t cursor;        /* cursor after this keystroke */
+};
+
+struct predict_t { /* local echo: overlay above term->cells, see predict_input() */
+	struct terminal_t *term;
+	int cols, lines;
+	struct prediction_t list[PREDICT_MAX]; /* pending: oldest is list[head] */
+	int head, count;
+	uint64_t epoch;               /* bumped by keys not predictable and by rollback */
+	uint64_t confirmed;           /* newest epoch with echo seen: only these are shown */
+	bool lost;                    /* cursor unknown: wait until it moves, or for a pause of input */
+	struct point_t lost_at;       /* cursor when lost */
+	uint32_t blind[PREDICT_MAX];  /* chars typed while lost: placed after the cursor moves */
+	int blind_count;
+	bool blind_valid;             /* false: other keys typed while lost */
+	uint64_t last_input;          /* usec: last predict_input() */
+	int esc;                      /* input state: 0, ESC, CSI/SS3, CSI with parameters */
+	uint32_t code;                /* input state: UTF-8 */
+	int following;
+	uint64_t confirms, rollbacks, expires;
 };
 
 struct parm_t { /* for parse_arg() */
@@ -165,6 +460,372 @@ struct parm_t { /* for parse_arg() */
 	char *argv[MAX_ARGS];
 };
 
+struct pty_entry_t { /* pre-opened pty pair */
+	int master, slave;   /* slave: -1 if shell is already spawned */
+	pid_t pid;           /* pre-spawned shell: -1 if not spawned yet */
+};
+
+struct pty_pool_t {
+	struct pty_entry_t *entries;      /* ready entries (stack) */
+	int count, size;                  /* size: number of entries kept ready */
+	bool prespawn;                    /* spawn shell when entry is created */
+	const char *file;                 /* shell: see espawn() */
+	char *const *argv, *const *envp;
+	struct winsize winsize;           /* initial size, fixed by pool_claim() */
+	pthread_t thread;                 /* refill thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;              /* CLOCK_MONOTONIC: refill thread waits, also before retry */
+	bool running;
+	uint64_t hits, misses;            /* claims served from pool / opened on demand */
+};
+
+#if defined(__linux__)
+enum watch_type {
+	WATCH_PTY = 0, /* master of pseudo terminal */
+	WATCH_PID,     /* pidfd of child process */
+	WATCH_SIGCHLD, /* signalfd: used if pidfd is not available */
+	WATCH_WRITE,   /* io_uring: write to master of pseudo terminal */
+	WATCH_POLLOUT, /* io_uring: master accepts writes again after -EAGAIN */
+	WATCH_ORPHAN,  /* pidfd of child left by destroyed session (see reactor_orphan()) */
+};
+
+enum io_engine {
+	ENGINE_EPOLL = 0, /* epoll + read()/write() */
+	ENGINE_URING,     /* io_uring: multishot read, batched write */
+};
+
+struct watch_t { /* registered to epoll as epoll_data.ptr */
+	enum watch_type type;
+	struct session_t *session;
+};
+
+struct ring_t { /* byte ring: head (consumed) and tail (produced) are free running */
+	uint8_t *buf;
+	size_t size; /* power of 2 */
+	size_t head, tail;
+};
+
+struct spsc_ring_t { /* single producer (I/O thread), single consumer (parser thread) */
+	_Alignas(CACHE_LINE) size_t tail; /* producer: free running, store-release */
+	size_t head_cache;                /* producer: last seen head */
+	uint64_t produced;                /* producer: total bytes written */
+	uint64_t full_stalls;             /* producer: times reading stopped because ring was full */
+	size_t max_used;                  /* producer: occupancy high-water mark */
+	_Alignas(CACHE_LINE) size_t head; /* consumer: free running, store-release */
+	size_t tail_cache;                /* consumer: last seen tail */
+	uint64_t consumed;                /* consumer: total bytes parsed */
+	_Alignas(CACHE_LINE) uint8_t *buf;
+	size_t size;                      /* power of 2 */
+};
+
+struct spsc_stats_t { /* snapshot of spsc_ring_t counters */
+	size_t used, size, max_used;
+	uint64_t produced, consumed, full_stalls;
+};
+
+struct ptylog_t { /* raw output log of a session: see ptylog_read() */
+	/* reader (reactor or pipeline I/O thread) */
+	int fd;                  /* log file */
+	int pipe[2];             /* master -> pipe -> read() for parser */
+	int tee[2];              /* tee() of pipe -> splice() to log file */
+	char *path;              /* rotated to path.1 ... path.LOG_KEEP */
+	off_t size, max_size;    /* bytes in current file, rotate when exceeded (0: never) */
+	bool rotating;           /* rotation requested, next_fd not taken yet */
+	bool no_splice;          /* master has no splice_read (EINVAL/ENOSYS): read() and write() */
+	uint64_t written;        /* bytes written to log files (atomic) */
+	uint64_t spliced, copied; /* logged bytes: by splice() / by fallback write() */
+	uint64_t dropped;         /* bytes not logged: fallback write() failed */
+	struct log_syncer_t *syncer; /* NULL: synced and rotated by nobody until ptylog_close() */
+	/* syncer -> reader: file opened by rotation (atomic, -1: none), published with next_size */
+	int next_fd;
+	off_t next_size;
+	/* syncer thread */
+	int sync_fd;             /* dup of current file: reader may close fd any time */
+	int old_sync_fd;         /* dup of file before rotation: until reader took next_fd */
+	uint64_t synced_bytes;   /* written at last fdatasync() */
+	time_t synced;           /* CLOCK_MONOTONIC (sec) of last fdatasync() */
+	bool rotate, closing;    /* lock held: requested by reader */
+	struct ptylog_t *prev, *next; /* lock held: list of syncer */
+};
+
+struct log_syncer_t { /* fdatasync() and rotation of ptylogs, off the read path */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;     /* CLOCK_MONOTONIC */
+	bool running, stop;
+	struct ptylog_t *head, *tail; /* ordered by synced: head is due first */
+	struct ptylog_t *closed;      /* released by reader: last fdatasync(), then freed */
+	struct ptylog_t *busy;        /* handled by thread with lock released */
+};
+
+struct flow_stats_t { /* output flow control of a session: see reactor_flow() */
+	size_t backlog, backlog_max;      /* unparsed input (bytes) */
+	uint64_t parsed;                  /* total bytes parsed */
+	uint64_t throttled;               /* times reading master was stopped */
+	uint64_t frames, frames_skipped;  /* on_damage() calls / deferred by LAZY_DRAW */
+};
+
+struct session_t {
+	struct terminal_t *term;        /* term->fd: master of pseudo terminal */
+	pid_t pid;                      /* child process (shell) */
+	int pidfd;                      /* -1 if pidfd is not available */
+	bool alive;                     /* child process is alive or not */
+	int status;                     /* exit status of child (waitpid), -1: unknown */
+	bool pty_closed;                /* master returned EOF or EIO */
+	uint32_t events;                /* epoll: registered events of master */
+	bool throttled;                 /* epoll: reading stopped by backlog (FLOW_HIWAT) */
+	bool backlogged;                /* epoll: input ring has unparsed data */
+	bool damaged;                   /* screen updated, on_damage() not called yet */
+	bool write_blocked;             /* term->outq_full seen by reactor: on_writable() when released */
+	int skip_run;                   /* frames skipped in a row (LAZY_DRAW) */
+	struct flow_stats_t flow;
+	struct ptylog_t *log;           /* epoll, pipeline: raw output log (NULL: disabled) */
+	struct ring_t input;            /* epoll: data read from master, not parsed yet */
+	size_t read_hiwat;              /* epoll: adaptive limit of bytes read by one round */
+	struct session_t *backlog_prev, *backlog_next; /* epoll: list of backlogged sessions */
+	struct spsc_ring_t *pipe;       /* pipeline: input handed from I/O thread to parser thread */
+	int queued;                     /* pipeline: in ready queue (atomic) */
+	int stalled;                    /* pipeline: master disarmed because pipe was full (atomic) */
+	int write_fd;                   /* pipeline: dup of master watched for EPOLLOUT, -1 if unused */
+	int writable;                   /* pipeline: write_fd became writable, not flushed yet (atomic) */
+	int worker;                     /* parser pool: last worker (affinity), -1 if none (atomic) */
+	struct spsc_ring_t *writes;     /* parser pool: reactor_write() input, moved to outq by worker holding queued */
+	int writes_full;                /* parser pool: reactor_write() refused input, on_writable() when drained (atomic) */
+	struct watch_t pty_watch, pid_watch, write_watch, pollout_watch;
+	struct outq_t inflight;         /* io_uring: buffer of submitted write */
+	size_t inflight_off;            /* io_uring: already written bytes of inflight */
+	int uring_pending;              /* io_uring: number of requests not completed */
+	bool deleting;                  /* io_uring: waiting for cancellation */
+	struct session_t *prev, *next;  /* list of sessions owned by reactor */
+	uint32_t id;                    /* session_mgr_t: 0 if not managed */
+	void *data;                     /* for embedder */
+};
+
+#if defined(HAVE_IO_URING)
+struct uring_t {
+	int fd;
+	void *ring_ptr, *sqes_ptr;         /* mmap of SQ/CQ ring and SQE array */
+	size_t ring_len, sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries, sqe_tail;     /* sqe_tail: local tail, published at submit */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;      /* provided buffer ring (buffer group 0) */
+	uint8_t *bufs;                     /* URING_BUFS * URING_BUF_SIZE bytes */
+	uint16_t br_tail;
+	struct io_uring_cqe *deferred;     /* completions of other sessions while reactor_del() waits */
+	unsigned deferred_head, deferred_count, deferred_size;
+};
+#endif
+
+struct orphan_t { /* child of destroyed session: SIGHUP sent, not reaped yet */
+	struct watch_t watch;           /* first member: watch is cast to orphan_t */
+	pid_t pid;
+	int pidfd;                      /* -1: reaped by signalfd(SIGCHLD) */
+	bool polled;                    /* io_uring: poll of pidfd in flight */
+	bool killed;                    /* SIGKILL sent */
+	uint64_t deadline;              /* msec (CLOCK_MONOTONIC): SIGKILL after this */
+	struct orphan_t *next;
+};
+
+struct reactor_t {
+	enum io_engine engine;
+#if defined(HAVE_IO_URING)
+	struct uring_t uring;
+#endif
+	int epfd;                                 /* epoll instance */
+	int sigfd;                                /* signalfd (SIGCHLD): -1 if unused */
+	struct watch_t sig_watch;
+	struct session_t *sessions;               /* list of all sessions */
+	int count;                                /* number of sessions */
+	int backlogged;                           /* number of sessions having unparsed input */
+	struct session_t *backlog;                /* epoll: list of them (see reactor_catch_up()) */
+	struct session_t *backlog_cursor;         /* epoll: next one to parse in this round */
+	int logs;                                 /* number of sessions having ptylog */
+	struct orphan_t *orphans;                 /* children waiting to be reaped */
+	struct log_syncer_t syncer;               /* ptylogs of sessions (see reactor_log()) */
+	struct epoll_event *batch;                /* epoll: events being dispatched (see reactor_forget()) */
+	int batch_count;
+	void (*on_exit)(struct session_t *session); /* called once when child exited */
+	void (*on_writable)(struct session_t *session); /* outq drained after backpressure */
+	void (*on_damage)(struct session_t *session);   /* screen updated: time to draw */
+	struct pipeline_t *pipeline;              /* not NULL: reads are handed to parser thread */
+};
+
+struct pipeline_t { /* I/O thread reads, parser thread (embedder) parses */
+	struct reactor_t *reactor;        /* owned by I/O thread while running */
+	pthread_t io_thread;
+	pthread_mutex_t lock;             /* reactor dispatch vs pipeline_add()/pipeline_del() */
+	int running;                      /* atomic */
+	int wakefd;                       /* eventfd: wake sleeping parser thread */
+	int sleeping;                     /* atomic: parser thread is waiting on wakefd */
+	struct session_t **ready;         /* SPSC queue of sessions having unparsed input */
+	size_t ready_size;                /* power of 2, >= number of sessions */
+	_Alignas(CACHE_LINE) size_t ready_tail; /* producer: I/O thread */
+	_Alignas(CACHE_LINE) size_t ready_head; /* consumer: parser thread */
+	uint64_t wakeups, empty_wakeups;  /* consumer: counters of parser thread sleep */
+	struct parser_pool_t *workers;    /* not NULL: parsed by worker threads (see workers_start()) */
+};
+
+struct worker_t { /* parser thread of parser_pool_t */
+	_Alignas(CACHE_LINE) pthread_mutex_t lock; /* deque: owner, I/O thread and thieves */
+	struct session_t **deque;         /* sessions to parse: [head, tail) */
+	size_t head, tail, size;          /* size: power of 2, >= number of sessions */
+	int wakefd;                       /* eventfd */
+	int sleeping;                     /* atomic */
+	int index;
+	pthread_t thread;
+	struct parser_pool_t *pool;
+	struct session_t *current;        /* atomic: session in worker_thread() loop, NULL if none */
+	uint64_t parsed, stolen, wakeups; /* counters: owner only */
+};
+
+struct parser_pool_t {
+	struct pipeline_t *pl;
+	struct worker_t *workers;
+	int count;
+	int running;                      /* atomic */
+	int idle;                         /* atomic: number of sleeping workers */
+	pthread_mutex_t lock;             /* pipeline_del() waits on cond until session->queued is cleared */
+	pthread_cond_t cond;
+	int waiting;                      /* atomic: number of pipeline_del() waiting */
+	unsigned next;                    /* atomic: round robin for new sessions (I/O thread, reactor_write()) */
+};
+#endif
+
+/* immutable after shared_init(): shared by all terminals */
+const struct glyph_t *glyph_index[UCS2_CHARS]; /* array of pointer to glyphs[] */
+struct palette_t default_palette;              /* color_list[] and its pixel formats */
+pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+struct hist_store_t hist_store = { .lock = PTHREAD_MUTEX_INITIALIZER }; /* scrollback pages */
+
+#if defined(__linux__)
+struct mem_usage_t { /* bytes used by session: see mgr_usage() */
+	size_t terminal;   /* terminal_t and session_t */
+	size_t grid;       /* cells, line pointers, line_dirty, tabstop */
+	size_t esc;        /* escape sequence buffer */
+	size_t palette;    /* private palette: 0 while default_palette is shared */
+	size_t outq;       /* buffer of output to child */
+	size_t input;      /* resident pages of input ring or SPSC ring */
+	size_t scrollback; /* history: shared pages are divided by their references */
+	size_t other;      /* ptylog, recorder, io_uring inflight write */
+	size_t total;
+	size_t shared;     /* mgr_usage_total(): glyph_index and default_palette (once per process) */
+};
+
+enum sync_msg {
+	SYNC_HELLO = 1, /* server -> viewer: grid size */
+	SYNC_DELTA,     /* server -> viewer: changed spans, cursor, mode */
+	SYNC_ACK,       /* viewer -> server: applied generation */
+};
+
+struct sync_line_t { /* last change of a line */
+	uint64_t gen, prev_gen;    /* generation of last change and the change before it */
+	uint16_t x0, x1;           /* changed span of last change */
+	int newer, older;          /* list of lines ordered by gen (-1: end of list) */
+};
+
+struct sync_cache_t { /* encoded SYNC_DELTA frame shared by viewers at the same generation */
+	uint64_t from, to;         /* from: 0 means full state (snapshot for new viewer) */
+	struct outq_t frame;
+};
+
+struct sync_viewer_t {
+	int fd;
+	uint64_t sent, acked;      /* generation of last sent/acked delta */
+	int inflight;              /* deltas not acked yet */
+	struct outq_t in, out;
+	struct sync_viewer_t *next;
+};
+
+struct sync_server_t {
+	struct terminal_t *term;
+	int fd;                    /* listening unix socket */
+	uint64_t gen;              /* current generation */
+	int cols, lines;
+	struct cell_t *shadow;     /* cells at current generation */
+	struct sync_line_t *line;
+	int recent;                /* most recently changed line: head of line list */
+	struct point_t cursor;
+	enum term_mode mode;
+	struct sync_viewer_t *viewers;
+	int count;
+	struct outq_t scratch;
+	struct sync_cache_t cache[SYNC_CACHE];
+	int cache_next;            /* round robin replacement */
+	uint64_t deltas;           /* total deltas sent */
+	uint64_t encodes;          /* deltas actually encoded (others are copied from cache) */
+};
+
+struct sync_client_t { /* reference viewer */
+	int fd;
+	bool ready;                /* term is initialized by SYNC_HELLO */
+	struct terminal_t term;    /* rebuilt grid */
+	uint64_t gen, deltas;
+	struct outq_t in, out;
+};
+
+struct session_mgr_t {
+	struct reactor_t *reactor;       /* sessions are added to this reactor */
+	struct pty_pool_t *pool;         /* NULL: spawn by espawnpty() */
+	struct session_t **table;        /* open addressing (linear probing) by id */
+	size_t table_size;               /* power of 2 */
+	int count;
+	uint32_t next_id;
+};
+
+/* shared grid: layout of memfd segment (header, line table, cells), all offsets in bytes */
+struct shm_cell_t { /* cell_t without pointer */
+	uint32_t code;             /* UCS4 code point of glyph */
+	uint8_t fg, bg;
+	uint8_t attribute;
+	uint8_t width;             /* enum glyph_width */
+};
+
+struct shm_line_t {
+	uint64_t seq;              /* seqlock: odd while line is written */
+	uint64_t gen;              /* generation of last change */
+};
+
+struct shm_header_t {
+	uint32_t magic, version;
+	uint32_t header_size, line_size, cell_size;
+	uint32_t cols, lines;
+	uint64_t line_offset, cell_offset;
+	uint64_t size;             /* bytes of segment: never shrinks */
+	uint64_t seq;              /* seqlock of fields below and of layout (size, cols, lines, offsets) */
+	uint64_t gen;              /* generation: incremented by each shm_update() having changes */
+	struct point_t cursor;
+	uint32_t mode;
+};
+
+struct shm_grid_t { /* writer: parser side */
+	struct terminal_t *term;
+	int fd;                    /* memfd: pass to reader processes */
+	uint8_t *map;
+	size_t size;
+	struct shm_header_t *header;
+	uint64_t updates, lines_written;
+};
+
+struct handoff_header_t { /* handoff: precedes each batch, carries its master fds (SCM_RIGHTS) */
+	char magic[4];             /* "YHND" */
+	uint32_t version;          /* HANDOFF_VERSION */
+	uint32_t count;            /* sessions (and fds) in this batch: 0 ends handoff */
+	uint32_t reserved;
+	uint64_t size;             /* bytes of payload following header */
+};
+
+struct shm_view_t { /* reader: other process */
+	int fd;
+	const uint8_t *map;
+	size_t size;
+	const struct shm_header_t *header;
+	uint64_t retries;          /* seqlock read retries */
+};
+#endif
+
 volatile sig_atomic_t vt_active   = true;  /* SIGUSR1: vt is active or not */
 volatile sig_atomic_t need_redraw = false; /* SIGUSR1: vt activated */
 volatile sig_atomic_t child_alive = false; /* SIGCHLD: child process (shell) is alive or not */
@@ -184,6 +845,42 @@ enum {
 	VERBOSE          = false,  /* write dump of input to stdout, debug message to stderr */
 	TABSTOP          = 8,      /* hardware tabstop */
 	LAZY_DRAW        = true,   /* don't draw when input data size is larger than BUFSIZE */
+	HUGE_PAGE_ARENA  = false,  /* terminal arena >= HUGE_PAGE_SIZE on transparent huge pages (slower to create) */
+	REACTOR_EVENTS   = 256,    /* max events handled by one epoll_wait() */
+	INPUT_RING_SIZE  = 1024 * 1024, /* per session input ring (reserved, touched on demand) */
+	READ_BATCH_MIN   = 4096,   /* initial/minimum read high-water mark per round */
+	FLOW_HIWAT       = 256 * 1024, /* stop reading master while unparsed input exceeds this */
+	FLOW_LOWAT       = 64 * 1024,  /* resume reading master */
+	PARSE_BUDGET     = 64 * 1024,  /* max bytes parsed per session and round (fairness) */
+	FRAME_SKIP_MAX   = 16,     /* LAZY_DRAW: max frames skipped in a row */
+	LOG_KEEP         = 4,      /* ptylog: number of rotated files kept */
+	LOG_SYNC_INTERVAL = 1,     /* ptylog: fdatasync() interval (sec) */
+	REC_BLOCK_SIZE   = 64 * 1024, /* recording: events block is compressed at this size */
+	REC_FLUSH_INTERVAL = 1,    /* recording: or when its first event is older than this (sec) */
+	REC_KEYFRAME_BYTES = 1024 * 1024, /* recording: keyframe after this much input */
+	REC_KEYFRAME_INTERVAL = 10, /* recording: or after this time if any input (sec) */
+	REC_QUEUE_MAX    = 64,     /* recording: blocks waiting for writer thread (parser waits) */
+	TIMELINE_KEYFRAME_INTERVAL = 5, /* timeline: keyframe interval (sec) */
+	TIMELINE_KEYFRAME_RATIO = 4, /* timeline: or when deltas exceed this times keyframe size */
+	MGR_TABLE_SIZE   = 1024,   /* session manager: initial size of id table (power of 2) */
+	MGR_KILL_TIMEOUT = 100,    /* session manager: msec to wait SIGHUP before SIGKILL */
+	POOL_KILL_TIMEOUT = 100,   /* pty pool: msec to wait SIGHUP of pre-spawned shell before SIGKILL */
+	SYNC_WINDOW      = 2,      /* state sync: max deltas not acked per viewer */
+	SYNC_VIEWERS     = 64,     /* state sync: max viewers (more are refused by sync_accept()) */
+	SYNC_FRAME_MAX   = 16 * 1024 * 1024, /* state sync: max message size (server -> viewer) */
+	SYNC_ACK_MAX     = 16,     /* state sync: max message size (viewer -> server) */
+	PIPE_RING_SIZE   = 256 * 1024, /* pipeline: per session SPSC ring */
+	WRITE_RING_SIZE  = 64 * 1024,  /* parser pool: per session ring of reactor_write() input (power of 2) */
+	PIPELINE_SESSIONS = 16384, /* pipeline: max sessions (ready queue size, power of 2) */
+	PIPELINE_TIMEOUT = 100,    /* pipeline: I/O thread checks stop request (msec) */
+	URING_ENTRIES    = 1024,   /* io_uring: number of SQ entries */
+	URING_BUFS       = 1024,   /* io_uring: number of provided buffers (power of 2) */
+	URING_BUF_SIZE   = 4096,   /* io_uring: size of each provided buffer */
+	PREDICT_TIMEOUT  = 1000,   /* prediction: msec to wait echo before rollback */
+	HISTORY_LINES    = 10000,  /* history: max lines kept per terminal */
+	HISTORY_PAGE_LINES = 64,   /* history: max lines per page */
+	HISTORY_PAGE_CUT = 16,     /* history: average lines per page (boundary chosen by content) */
+	HIST_TABLE_SIZE  = 1024,   /* history: initial size of page table (power of 2) */
 	BACKGROUND_DRAW  = false,  /* always draw even if vt is not active */
 	VT_CONTROL       = true,   /* handle vt switching */
 	FORCE_TEXT_MODE  = false,  /* force KD_TEXT mode (not use KD_GRAPHICS mode) */